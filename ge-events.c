@@ -0,0 +1,262 @@
+#include "ge-events.h"
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define GE_EVENTS_MASK		(GE_EVENTS_RING_SIZE-1)
+
+// Without write access to the segment a subscriber can't register as a
+// waiter, so the writer won't wake it. It polls at this interval instead.
+#define GE_EVENTS_POLL_US	(1000)
+
+// Not FUTEX_PRIVATE_FLAG: the word is shared between processes.
+static long
+ge_futex(atomic_uint* word, int op, unsigned value, const struct timespec* timeout) {
+	return syscall(SYS_futex,word,op,value,timeout,NULL,0);
+}
+
+static uint64_t
+ge_events_now_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME,&ts);
+	return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+static int64_t
+ge_events_monotonic_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (int64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+#pragma mark - Writer
+
+int
+ge_events_create(ge_events_t bus, const char* name) {
+	int fd;
+	int i;
+	struct ge_events_state_s* state;
+
+	memset(bus,0,sizeof(*bus));
+
+	fd = shm_open(name,O_RDWR|O_CREAT,0644);
+	if(fd<0)
+		return -1;
+
+	if(ftruncate(fd,sizeof(*state))<0) {
+		close(fd);
+		return -1;
+	}
+
+	state = mmap(NULL,sizeof(*state),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+
+	if(state==MAP_FAILED)
+		return -1;
+
+	state->magic = 0;
+	atomic_thread_fence(memory_order_release);
+
+	// Subscribers that outlived a previous writer find their cursor
+	// ahead of the new head, and start again from it.
+	atomic_store_explicit(&state->head,0,memory_order_relaxed);
+	atomic_store_explicit(&state->waiters,0,memory_order_relaxed);
+	for(i=0;i<GE_EVENTS_RING_SIZE;i++)
+		atomic_store_explicit(&state->slot[i].seq,0,memory_order_relaxed);
+	state->layout_version = GE_EVENTS_LAYOUT_VERSION;
+	state->ring_size = GE_EVENTS_RING_SIZE;
+	state->writer_pid = getpid();
+
+	atomic_thread_fence(memory_order_release);
+	state->magic = GE_EVENTS_MAGIC;
+
+	bus->state = state;
+	bus->writer = true;
+	snprintf(bus->name,sizeof(bus->name),"%s",name);
+
+	return 0;
+}
+
+void
+ge_events_close(ge_events_t bus) {
+	if(!bus->state)
+		return;
+
+	if(bus->writer) {
+		bus->state->magic = 0;
+
+		// Let anyone asleep notice we've gone.
+		atomic_fetch_add(&bus->state->futex,1);
+		ge_futex(&bus->state->futex,FUTEX_WAKE,INT_MAX,NULL);
+	}
+
+	munmap(bus->state,sizeof(*bus->state));
+
+	if(bus->writer)
+		shm_unlink(bus->name);
+
+	bus->state = NULL;
+}
+
+void
+ge_events_publish(ge_events_t bus, struct ge_event_s* event) {
+	struct ge_events_state_s* state = bus->state;
+	uint64_t n = atomic_load_explicit(&state->head,memory_order_relaxed);
+	struct ge_events_slot_s* slot = &state->slot[n&GE_EVENTS_MASK];
+
+	event->time_us = ge_events_now_us();
+
+	atomic_store_explicit(&slot->seq,n*2+1,memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memcpy(&slot->event,event,sizeof(*event));
+	atomic_store_explicit(&slot->seq,n*2+2,memory_order_release);
+
+	atomic_store_explicit(&state->head,n+1,memory_order_release);
+
+	// Pairs with the waiter count in ge_events_wait(): either the waiter
+	// sees the new futex value, or we see the waiter. The syscall is
+	// only made when someone is actually asleep.
+	atomic_store(&state->futex,(unsigned)(n+1));
+	if(atomic_load(&state->waiters))
+		ge_futex(&state->futex,FUTEX_WAKE,INT_MAX,NULL);
+}
+
+#pragma mark - Subscriber
+
+int
+ge_events_open(ge_events_t bus, const char* name) {
+	int fd;
+	int prot = PROT_READ|PROT_WRITE;
+	struct stat st;
+	struct ge_events_state_s* state;
+
+	memset(bus,0,sizeof(*bus));
+
+	fd = shm_open(name,O_RDWR,0);
+	if(fd<0 && errno==EACCES) {
+		fd = shm_open(name,O_RDONLY,0);
+		prot = PROT_READ;
+	}
+	if(fd<0)
+		return -1;
+
+	if(fstat(fd,&st)<0 || st.st_size<(off_t)sizeof(*state)) {
+		close(fd);
+		return -1;
+	}
+
+	state = mmap(NULL,sizeof(*state),prot,MAP_SHARED,fd,0);
+	close(fd);
+
+	if(state==MAP_FAILED)
+		return -1;
+
+	if(state->magic!=GE_EVENTS_MAGIC
+		|| state->layout_version!=GE_EVENTS_LAYOUT_VERSION
+		|| state->ring_size!=GE_EVENTS_RING_SIZE
+	) {
+		munmap(state,sizeof(*state));
+		return -1;
+	}
+
+	bus->state = state;
+	bus->can_wait = (prot&PROT_WRITE)!=0;
+	snprintf(bus->name,sizeof(bus->name),"%s",name);
+
+	return 0;
+}
+
+void
+ge_events_subscribe(ge_events_t bus, struct ge_events_cursor_s* cursor) {
+	cursor->next = atomic_load_explicit(&bus->state->head,memory_order_acquire);
+	cursor->lost = 0;
+}
+
+bool
+ge_events_next(ge_events_t bus, struct ge_events_cursor_s* cursor, struct ge_event_s* event) {
+	struct ge_events_state_s* state = bus->state;
+
+	for(;;) {
+		uint64_t head = atomic_load_explicit(&state->head,memory_order_acquire);
+		const struct ge_events_slot_s* slot;
+		uint64_t seq;
+
+		if(cursor->next>=head) {
+			// The writer restarted and counts from zero again.
+			if(cursor->next>head)
+				cursor->next = head;
+			return false;
+		}
+
+		if(head-cursor->next>GE_EVENTS_RING_SIZE) {
+			cursor->lost += head-GE_EVENTS_RING_SIZE-cursor->next;
+			cursor->next = head-GE_EVENTS_RING_SIZE;
+		}
+
+		slot = &state->slot[cursor->next&GE_EVENTS_MASK];
+
+		seq = atomic_load_explicit((atomic_uint_least64_t*)&slot->seq,memory_order_acquire);
+		if(seq==cursor->next*2+2) {
+			memcpy(event,&slot->event,sizeof(*event));
+			atomic_thread_fence(memory_order_acquire);
+			if(atomic_load_explicit((atomic_uint_least64_t*)&slot->seq,memory_order_relaxed)==seq) {
+				cursor->next++;
+				return true;
+			}
+		}
+
+		// The writer has already reused the slot, so this one is gone.
+		cursor->next++;
+		cursor->lost++;
+	}
+}
+
+bool
+ge_events_wait(ge_events_t bus, const struct ge_events_cursor_s* cursor, int timeout_ms) {
+	struct ge_events_state_s* state = bus->state;
+	int64_t deadline = ge_events_monotonic_ms()+timeout_ms;
+	bool ret = false;
+
+	if(bus->can_wait)
+		atomic_fetch_add(&state->waiters,1);
+
+	for(;;) {
+		unsigned value = atomic_load(&state->futex);
+		int64_t remaining = deadline-ge_events_monotonic_ms();
+		struct timespec ts;
+
+		if(atomic_load_explicit(&state->head,memory_order_acquire)!=cursor->next
+			|| state->magic!=GE_EVENTS_MAGIC
+		) {
+			ret = true;
+			break;
+		}
+
+		if(timeout_ms>=0 && remaining<=0)
+			break;
+
+		if(!bus->can_wait) {
+			usleep(GE_EVENTS_POLL_US);
+			continue;
+		}
+
+		ts.tv_sec = remaining/1000;
+		ts.tv_nsec = (remaining%1000)*1000000;
+		ge_futex(&state->futex,FUTEX_WAIT,value,(timeout_ms>=0)?&ts:NULL);
+	}
+
+	if(bus->can_wait)
+		atomic_fetch_sub(&state->waiters,1);
+
+	return ret;
+}
@@ -0,0 +1,125 @@
+
+#ifndef __GE_EVENTS_H__
+#define __GE_EVENTS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Broadcast ring of decoded panel events in POSIX shared memory. There
+// is one writer and any number of subscribers. Each subscriber keeps
+// its own cursor, so subscribing costs the writer nothing. A subscriber
+// that falls more than a ring's worth behind is told how many events it
+// lost. Subscribers can sleep on a futex in the segment; the writer
+// only makes the wake-up syscall when someone is actually waiting.
+
+#define GE_EVENTS_MAGIC				(0x47454556)	// "GEEV"
+#define GE_EVENTS_LAYOUT_VERSION	(1)
+
+#ifndef GE_EVENTS_DEFAULT_NAME
+#define GE_EVENTS_DEFAULT_NAME		"/ge-rs232-events"
+#endif
+
+// Must be a power of two.
+#define GE_EVENTS_RING_SIZE			(1024)
+#define GE_EVENTS_NAME_LENGTH		(64)
+#define GE_EVENTS_TEXT_LENGTH		(40)
+
+enum {
+	GE_EVENT_ZONE_STATUS = 1,
+	GE_EVENT_ALARM,
+	GE_EVENT_ARMING,
+	GE_EVENT_TOUCHPAD,
+	GE_EVENT_FEATURES,
+	GE_EVENT_LIGHTS,
+};
+
+struct ge_event_s {
+	uint64_t time_us;		// CLOCK_REALTIME, filled in by the writer.
+	uint16_t type;
+	uint8_t partition;
+	uint8_t area;
+	uint16_t zone;
+	uint16_t reserved;
+	union {
+		struct {
+			uint8_t status;		// GE_RS232_ZONE_STATUS_* bits.
+			uint8_t previous;
+		} zone_status;
+		struct {
+			uint8_t source_type;
+			uint8_t general_type;
+			uint8_t specific_type;
+			uint32_t unit_id;
+			uint16_t event_data;
+		} alarm;
+		struct {
+			uint8_t level;
+			uint16_t user;
+		} arming;
+		struct {
+			uint16_t state;		// Feature or light bits.
+			uint16_t previous;
+		} bits;
+		struct {
+			char text[GE_EVENTS_TEXT_LENGTH];	// ASCII, NUL-terminated.
+		} touchpad;
+	} u;
+};
+
+struct ge_events_slot_s {
+	// 2n+1 while event n is being written, 2n+2 once it's complete.
+	atomic_uint_least64_t seq;
+	struct ge_event_s event;
+};
+
+struct ge_events_state_s {
+	uint32_t magic;
+	uint16_t layout_version;
+	uint16_t ring_size;
+	int32_t writer_pid;
+
+	atomic_uint_least64_t head;	// Number of events ever written.
+	atomic_uint futex;			// Low bits of `head`, to wait on.
+	atomic_uint waiters;
+
+	struct ge_events_slot_s slot[GE_EVENTS_RING_SIZE];
+};
+
+struct ge_events_s {
+	struct ge_events_state_s* state;
+	char name[GE_EVENTS_NAME_LENGTH];
+	bool writer;
+	bool can_wait;		// False if we could only map the segment read-only.
+};
+typedef struct ge_events_s* ge_events_t;
+
+struct ge_events_cursor_s {
+	uint64_t next;
+	uint64_t lost;		// Events overwritten before we got to them.
+};
+
+#pragma mark - Writer
+
+// Creates (or takes over) the segment `name`. Returns 0 on success.
+int ge_events_create(ge_events_t bus, const char* name);
+void ge_events_close(ge_events_t bus);
+void ge_events_publish(ge_events_t bus, struct ge_event_s* event);
+
+#pragma mark - Subscriber
+
+// Maps the segment `name`. Returns 0 on success, or -1 if it doesn't
+// exist or has a layout we don't understand.
+int ge_events_open(ge_events_t bus, const char* name);
+
+// Starts the cursor at the next event to be written.
+void ge_events_subscribe(ge_events_t bus, struct ge_events_cursor_s* cursor);
+
+// Copies out the next event, returning false if there isn't one yet.
+bool ge_events_next(ge_events_t bus, struct ge_events_cursor_s* cursor, struct ge_event_s* event);
+
+// Sleeps until there is an event after `cursor`, or `timeout_ms` passes
+// (negative to wait forever). Returns false on timeout.
+bool ge_events_wait(ge_events_t bus, const struct ge_events_cursor_s* cursor, int timeout_ms);
+
+#endif
@@ -0,0 +1,174 @@
+#include <smcp/assert_macros.h>
+#include <stdio.h>
+#include "ge-gateway-node.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+static void
+ge_gateway_node_dealloc(ge_gateway_node_t self) {
+	if(self->epoll_fd>=0)
+		close(self->epoll_fd);
+	free(self);
+}
+
+static ge_gateway_node_t
+ge_gateway_node_alloc() {
+	ge_gateway_node_t ret =
+	    (ge_gateway_node_t)calloc(sizeof(struct ge_gateway_node_s), 1);
+
+	ret->node.finalize = (void (*)(smcp_node_t)) &ge_gateway_node_dealloc;
+	return ret;
+}
+
+// Keeps the epoll registration in step with the panel, whose descriptor
+// changes when its serial port is reopened or its serial thread starts.
+static void
+ge_gateway_panel_watch(ge_gateway_node_t self, struct ge_gateway_panel_s* panel) {
+	int fd = smcp_ge_system_node_get_fd(panel->node);
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = panel };
+
+	if(fd==panel->fd)
+		return;
+
+	// Fails harmlessly if the old descriptor is already closed.
+	if(panel->fd>=0)
+		epoll_ctl(self->epoll_fd,EPOLL_CTL_DEL,panel->fd,NULL);
+	panel->fd = -1;
+
+	if(fd<0)
+		return;
+
+	if(0==epoll_ctl(self->epoll_fd,EPOLL_CTL_ADD,fd,&event)) {
+		panel->fd = fd;
+	} else {
+		log_msg(LOG_LEVEL_ERROR,"Unable to watch panel fd %d",fd);
+	}
+}
+
+// Milliseconds until the panel has timed work to do.
+static cms_t
+ge_gateway_panel_timeout(struct ge_gateway_panel_s* panel) {
+	cms_t timeout = INT32_MAX;
+
+	smcp_ge_system_node_update_fdset(panel->node,NULL,NULL,NULL,NULL,&timeout);
+
+	return timeout;
+}
+
+ge_gateway_node_t
+smcp_ge_gateway_node_init(
+	ge_gateway_node_t self,
+	smcp_node_t parent,
+	const char* name
+) {
+	require(self || (self = ge_gateway_node_alloc()), bail);
+
+	require(smcp_node_init(
+		&self->node,
+		(void*)parent,
+		name
+	), bail);
+
+	self->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	require_action(self->epoll_fd>=0, bail, {
+		log_msg(LOG_LEVEL_CRITICAL,"Unable to create epoll fd");
+		smcp_node_delete(&self->node);
+		self = NULL;
+	});
+
+bail:
+	return self;
+}
+
+ge_system_node_t
+smcp_ge_gateway_node_add_panel(
+	ge_gateway_node_t self,
+	const char* name,
+	const char* const* devices
+) {
+	ge_system_node_t node = NULL;
+	struct ge_gateway_panel_s* panel;
+
+	require_action(self->panel_count<GE_GATEWAY_MAX_PANELS, bail,
+		log_msg(LOG_LEVEL_ERROR,"Too many panels, not adding \"%s\"",name)
+	);
+
+	node = smcp_ge_system_node_init_with_devices(NULL,&self->node,name,devices);
+	require(node, bail);
+
+	// The gateway does the waiting, a panel should never block.
+	node->serial_poll_ms = 0;
+
+	panel = &self->panel[self->panel_count++];
+	panel->node = node;
+	panel->fd = -1;
+	panel->ready = true;
+
+	ge_gateway_panel_watch(self,panel);
+
+	log_msg(LOG_LEVEL_NOTICE,"Added panel \"%s\" (%d bytes)",name,(int)sizeof(*node));
+
+bail:
+	return node;
+}
+
+smcp_status_t
+smcp_ge_gateway_node_update_fdset(
+	ge_gateway_node_t self,
+    fd_set *read_fd_set,
+    fd_set *write_fd_set,
+    fd_set *exc_fd_set,
+    int *max_fd,
+	cms_t *timeout
+) {
+	int i;
+
+	for(i=0;i<self->panel_count;i++) {
+		struct ge_gateway_panel_s* panel = &self->panel[i];
+
+		ge_gateway_panel_watch(self,panel);
+
+		if(timeout && panel->ready)
+			*timeout = 0;
+		else if(timeout)
+			smcp_ge_system_node_update_fdset(panel->node,NULL,NULL,NULL,NULL,timeout);
+	}
+
+	if(max_fd && *max_fd<self->epoll_fd)
+		*max_fd = self->epoll_fd;
+
+	if(read_fd_set && self->epoll_fd>=0)
+		FD_SET(self->epoll_fd,read_fd_set);
+
+	return 0;
+}
+
+// Processes only the panels that have input waiting or timed work due,
+// so an idle panel costs nothing but its share of this loop.
+smcp_status_t
+smcp_ge_gateway_node_process(ge_gateway_node_t self) {
+	struct epoll_event events[GE_GATEWAY_MAX_PANELS];
+	int i, count;
+
+	count = epoll_wait(self->epoll_fd,events,GE_GATEWAY_MAX_PANELS,0);
+
+	for(i=0;i<count;i++)
+		((struct ge_gateway_panel_s*)events[i].data.ptr)->ready = true;
+
+	for(i=0;i<self->panel_count;i++) {
+		struct ge_gateway_panel_s* panel = &self->panel[i];
+
+		if(!panel->ready && ge_gateway_panel_timeout(panel)>0)
+			continue;
+
+		panel->ready = false;
+		smcp_ge_system_node_process(panel->node);
+		ge_gateway_panel_watch(self,panel);
+	}
+
+	return 0;
+}
@@ -0,0 +1,54 @@
+
+#ifndef __GE_GATEWAY_NODE_H__
+#define __GE_GATEWAY_NODE_H__
+
+#include "ge-system-node.h"
+
+#ifndef GE_GATEWAY_MAX_PANELS
+#define GE_GATEWAY_MAX_PANELS			(8)
+#endif
+
+struct ge_gateway_panel_s {
+	ge_system_node_t node;
+	int fd;		// As registered with epoll, or -1.
+	bool ready;
+};
+
+// Several panels, each a ge_system_node_s under this node, driven from
+// one epoll descriptor. Per-panel metrics are in each panel's `sys`
+// node.
+struct ge_gateway_node_s {
+	struct smcp_node_s node;
+	int epoll_fd;
+	uint8_t panel_count;
+	struct ge_gateway_panel_s panel[GE_GATEWAY_MAX_PANELS];
+};
+
+typedef struct ge_gateway_node_s* ge_gateway_node_t;
+
+extern ge_gateway_node_t smcp_ge_gateway_node_init(
+	ge_gateway_node_t self,
+	smcp_node_t parent,
+	const char* name
+);
+
+// Adds a panel at <gateway>/<name>/..., on the first of `devices` that
+// opens (a NULL-terminated list, or NULL for GE_SERIAL_DEFAULT_DEVICES).
+extern ge_system_node_t smcp_ge_gateway_node_add_panel(
+	ge_gateway_node_t self,
+	const char* name,
+	const char* const* devices
+);
+
+extern smcp_status_t smcp_ge_gateway_node_update_fdset(
+	ge_gateway_node_t self,
+    fd_set *read_fd_set,
+    fd_set *write_fd_set,
+    fd_set *exc_fd_set,
+    int *max_fd,
+	cms_t *timeout
+);
+
+extern smcp_status_t smcp_ge_gateway_node_process(ge_gateway_node_t self);
+
+#endif
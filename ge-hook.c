@@ -0,0 +1,288 @@
+#include "ge-hook.h"
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+extern char **environ;
+
+static uint64_t
+ge_hook_now_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+static int
+ge_hook_pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+	return (int)syscall(SYS_pidfd_open,pid,0);
+#else
+	return -1;
+#endif
+}
+
+ge_hook_runner_t
+ge_hook_runner_init(ge_hook_runner_t runner) {
+	int i;
+
+	memset(runner,0,sizeof(*runner));
+	runner->max_running = GE_HOOK_MAX_RUNNING;
+
+	for(i=0;i<GE_HOOK_MAX_RUNNING;i++)
+		runner->child[i].pidfd = -1;
+
+	return runner;
+}
+
+void
+ge_hook_runner_finalize(ge_hook_runner_t runner) {
+	int i;
+
+	for(i=0;i<GE_HOOK_MAX_RUNNING;i++) {
+		if(runner->child[i].pidfd>=0)
+			close(runner->child[i].pidfd);
+		runner->child[i].pidfd = -1;
+		runner->child[i].pid = 0;
+	}
+	runner->running = 0;
+	runner->queue_count = 0;
+}
+
+int
+ge_hook_configure(ge_hook_runner_t runner, uint8_t hook, const char* path, int32_t timeout_ms) {
+	if(hook>=GE_HOOK_MAX_HOOKS)
+		return -1;
+
+	if(!path)
+		path = "";
+
+	if(strlen(path)>=GE_HOOK_PATH_LENGTH)
+		return -1;
+
+	strcpy(runner->hook[hook].path,path);
+	runner->hook[hook].timeout_ms = (timeout_ms>0)?timeout_ms:GE_HOOK_DEFAULT_TIMEOUT_MS;
+
+	return 0;
+}
+
+bool
+ge_hook_is_configured(ge_hook_runner_t runner, uint8_t hook) {
+	return hook<GE_HOOK_MAX_HOOKS && runner->hook[hook].path[0];
+}
+
+static bool
+ge_hook_spawn(ge_hook_runner_t runner, const struct ge_hook_job_s* job, struct ge_hook_child_s* child) {
+	const struct ge_hook_s* hook = &runner->hook[job->hook];
+	char* argv[GE_HOOK_MAX_ARGS+2];
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigs;
+	pid_t pid;
+	int ret;
+	int i;
+
+	argv[0] = (char*)hook->path;
+	for(i=0;i<job->argc;i++)
+		argv[i+1] = (char*)job->argv[i];
+	argv[i+1] = NULL;
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions,STDIN_FILENO,"/dev/null",O_RDONLY,0);
+
+	// Own process group, so a timeout takes out anything it started too.
+	// Signals go back to normal in case the daemon blocks or ignores any.
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setpgroup(&attr,0);
+	sigemptyset(&sigs);
+	posix_spawnattr_setsigmask(&attr,&sigs);
+	sigfillset(&sigs);
+	posix_spawnattr_setsigdefault(&attr,&sigs);
+	posix_spawnattr_setflags(&attr,POSIX_SPAWN_SETPGROUP|POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETSIGDEF);
+
+	ret = posix_spawn(&pid,hook->path,&actions,&attr,argv,environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if(ret!=0) {
+		errno = ret;
+		return false;
+	}
+
+	child->pid = pid;
+	child->pidfd = ge_hook_pidfd_open(pid);
+	child->hook = job->hook;
+	child->killed = false;
+	child->started_us = ge_hook_now_us();
+	child->deadline_us = child->started_us+(uint64_t)hook->timeout_ms*1000;
+
+	return true;
+}
+
+static void
+ge_hook_start_queued(ge_hook_runner_t runner) {
+	int i;
+
+	while(runner->queue_count && runner->running<runner->max_running) {
+		struct ge_hook_job_s* job = &runner->queue[runner->queue_head];
+		struct ge_hook_child_s* child = NULL;
+
+		runner->queue_head = (runner->queue_head+1)%GE_HOOK_QUEUE_SIZE;
+		runner->queue_count--;
+
+		for(i=0;i<GE_HOOK_MAX_RUNNING;i++) {
+			if(!runner->child[i].pid) {
+				child = &runner->child[i];
+				break;
+			}
+		}
+
+		if(!child || !ge_hook_spawn(runner,job,child)) {
+			runner->stats.failed++;
+			if(runner->finished)
+				(*runner->finished)(runner->context,job->hook,-1,0);
+			continue;
+		}
+
+		runner->running++;
+		runner->stats.started++;
+		if(runner->stats.max_wait_us<child->started_us-job->queued_us)
+			runner->stats.max_wait_us = (uint32_t)(child->started_us-job->queued_us);
+	}
+}
+
+int
+ge_hook_run(ge_hook_runner_t runner, uint8_t hook, int argc, const char* const argv[]) {
+	struct ge_hook_job_s* job;
+	int i;
+
+	if(!ge_hook_is_configured(runner,hook) || argc>GE_HOOK_MAX_ARGS)
+		return -1;
+
+	if(runner->queue_count>=GE_HOOK_QUEUE_SIZE) {
+		runner->stats.dropped++;
+		return -1;
+	}
+
+	job = &runner->queue[(runner->queue_head+runner->queue_count)%GE_HOOK_QUEUE_SIZE];
+	job->hook = hook;
+	job->argc = argc;
+	for(i=0;i<argc;i++)
+		snprintf(job->argv[i],GE_HOOK_ARG_LENGTH,"%s",argv[i]);
+	job->queued_us = ge_hook_now_us();
+	runner->queue_count++;
+
+	ge_hook_start_queued(runner);
+
+	return 0;
+}
+
+void
+ge_hook_runner_update_fdset(
+	ge_hook_runner_t runner,
+	fd_set *read_fd_set,
+	int *max_fd,
+	int32_t *timeout_ms
+) {
+	uint64_t now;
+	bool need_poll = false;
+	int i;
+
+	if(!runner->running)
+		return;
+
+	now = ge_hook_now_us();
+
+	for(i=0;i<GE_HOOK_MAX_RUNNING;i++) {
+		struct ge_hook_child_s* child = &runner->child[i];
+
+		if(!child->pid)
+			continue;
+
+		if(child->pidfd>=0 && read_fd_set) {
+			FD_SET(child->pidfd,read_fd_set);
+			if(max_fd && *max_fd<child->pidfd)
+				*max_fd = child->pidfd;
+		} else {
+			need_poll = true;
+		}
+
+		if(timeout_ms && !child->killed) {
+			int32_t remaining = (child->deadline_us>now)?(int32_t)((child->deadline_us-now+999)/1000):0;
+			if(*timeout_ms>remaining)
+				*timeout_ms = remaining;
+		}
+	}
+
+	if(timeout_ms && need_poll) {
+		int32_t remaining = (runner->next_poll_us>now)?(int32_t)((runner->next_poll_us-now+999)/1000):0;
+		if(*timeout_ms>remaining)
+			*timeout_ms = remaining;
+	}
+}
+
+void
+ge_hook_runner_process(ge_hook_runner_t runner) {
+	uint64_t now;
+	int i;
+
+	if(!runner->running)
+		goto start;
+
+	now = ge_hook_now_us();
+
+	for(i=0;i<GE_HOOK_MAX_RUNNING;i++) {
+		struct ge_hook_child_s* child = &runner->child[i];
+		int status = 0;
+		pid_t ret;
+		uint32_t run_us;
+
+		if(!child->pid)
+			continue;
+
+		ret = waitpid(child->pid,&status,WNOHANG);
+
+		if(ret==0) {
+			if(!child->killed && now>=child->deadline_us) {
+				kill(-child->pid,SIGKILL);
+				child->killed = true;
+				runner->stats.timed_out++;
+			}
+			continue;
+		}
+
+		// ECHILD means someone set SIGCHLD to SIG_IGN and the kernel
+		// reaped it for us; all we can say is that it's gone.
+		if(ret<0 && errno!=ECHILD)
+			continue;
+
+		run_us = (uint32_t)(now-child->started_us);
+		runner->stats.run_us += run_us;
+		if(runner->stats.max_run_us<run_us)
+			runner->stats.max_run_us = run_us;
+		if(ret>0 && !(WIFEXITED(status) && WEXITSTATUS(status)==0))
+			runner->stats.failed++;
+
+		if(child->pidfd>=0)
+			close(child->pidfd);
+		child->pidfd = -1;
+		child->pid = 0;
+		runner->running--;
+
+		if(runner->finished)
+			(*runner->finished)(runner->context,child->hook,(ret>0)?status:0,run_us);
+	}
+
+	runner->next_poll_us = now+GE_HOOK_POLL_MS*1000;
+
+start:
+	ge_hook_start_queued(runner);
+}
@@ -0,0 +1,128 @@
+
+#ifndef __GE_HOOK_H__
+#define __GE_HOOK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/select.h>
+
+// Runs external hook programs without blocking the caller. Programs are
+// started with posix_spawn(), with no shell in between, and at most
+// max_running of them run at once. Anything beyond that waits in a
+// small queue. When the queue is full, new requests are refused rather
+// than left to pile up. A hook still running after its timeout has its
+// process group killed.
+//
+// Children are reaped from ge_hook_runner_process(). Where the kernel
+// has pidfd_open(), each child's pidfd is added to the read set so the
+// caller's select() wakes up as soon as a child exits. Otherwise the
+// runner asks to be polled every GE_HOOK_POLL_MS.
+
+#ifndef GE_HOOK_MAX_HOOKS
+#define GE_HOOK_MAX_HOOKS			(4)
+#endif
+
+#ifndef GE_HOOK_MAX_RUNNING
+#define GE_HOOK_MAX_RUNNING			(4)
+#endif
+
+#ifndef GE_HOOK_QUEUE_SIZE
+#define GE_HOOK_QUEUE_SIZE			(8)
+#endif
+
+#ifndef GE_HOOK_DEFAULT_TIMEOUT_MS
+#define GE_HOOK_DEFAULT_TIMEOUT_MS	(30*1000)
+#endif
+
+#define GE_HOOK_MAX_ARGS			(6)
+#define GE_HOOK_ARG_LENGTH			(24)
+#define GE_HOOK_PATH_LENGTH			(128)
+#define GE_HOOK_POLL_MS				(50)
+
+struct ge_hook_s {
+	char path[GE_HOOK_PATH_LENGTH];		// Empty if the hook is disabled.
+	int32_t timeout_ms;
+};
+
+struct ge_hook_job_s {
+	uint8_t hook;
+	uint8_t argc;
+	char argv[GE_HOOK_MAX_ARGS][GE_HOOK_ARG_LENGTH];
+	uint64_t queued_us;
+};
+
+struct ge_hook_child_s {
+	pid_t pid;			// Zero if the slot is free.
+	int pidfd;			// -1 if the kernel doesn't have pidfds.
+	uint8_t hook;
+	bool killed;
+	uint64_t started_us;
+	uint64_t deadline_us;
+};
+
+struct ge_hook_stats_s {
+	uint32_t started;
+	uint32_t failed;		// Couldn't be started, or exited unsuccessfully.
+	uint32_t timed_out;
+	uint32_t dropped;		// Refused because the queue was full.
+
+	// From ge_hook_run() to the child starting, and from the child
+	// starting to it being reaped.
+	uint32_t max_wait_us;
+	uint32_t max_run_us;
+	uint64_t run_us;
+};
+
+struct ge_hook_runner_s {
+	struct ge_hook_s hook[GE_HOOK_MAX_HOOKS];
+	uint8_t max_running;
+	uint8_t running;
+
+	struct ge_hook_child_s child[GE_HOOK_MAX_RUNNING];
+
+	struct ge_hook_job_s queue[GE_HOOK_QUEUE_SIZE];
+	uint8_t queue_head;
+	uint8_t queue_count;
+
+	// When to next check on children we have no pidfd for.
+	uint64_t next_poll_us;
+
+	struct ge_hook_stats_s stats;
+
+	// Called once for each hook that finishes, with its wait() status,
+	// or -1 if it couldn't be started.
+	void (*finished)(void* context, uint8_t hook, int status, uint32_t run_us);
+	void* context;
+};
+typedef struct ge_hook_runner_s* ge_hook_runner_t;
+
+extern ge_hook_runner_t ge_hook_runner_init(ge_hook_runner_t runner);
+
+// Stops tracking any children still running, and leaves them to finish
+// on their own.
+extern void ge_hook_runner_finalize(ge_hook_runner_t runner);
+
+// Sets the program run for `hook`. A NULL or empty path disables it.
+extern int ge_hook_configure(ge_hook_runner_t runner, uint8_t hook, const char* path, int32_t timeout_ms);
+
+extern bool ge_hook_is_configured(ge_hook_runner_t runner, uint8_t hook);
+
+// Queues `hook` to be run with the given arguments, and starts it right
+// away if there is room. Returns 0 on success, or -1 if the hook isn't
+// configured or the queue is full.
+extern int ge_hook_run(ge_hook_runner_t runner, uint8_t hook, int argc, const char* const argv[]);
+
+// Adds child pidfds to `read_fd_set`, and lowers `timeout_ms` to the
+// next hook timeout or poll.
+extern void ge_hook_runner_update_fdset(
+	ge_hook_runner_t runner,
+	fd_set *read_fd_set,
+	int *max_fd,
+	int32_t *timeout_ms
+);
+
+// Reaps exited children, kills overdue ones and starts queued hooks.
+extern void ge_hook_runner_process(ge_hook_runner_t runner);
+
+#endif
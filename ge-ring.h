@@ -0,0 +1,138 @@
+
+#ifndef __GE_RING_H__
+#define __GE_RING_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+// Fixed-size rings of fixed-size items for passing data between threads
+// without locks. The caller provides the storage; the number of items
+// must be a power of two.
+
+#pragma mark - Single producer, single consumer
+
+struct ge_spsc_ring_s {
+	_Atomic uint32_t head;		// Written by the consumer.
+	_Atomic uint32_t tail;		// Written by the producer.
+	uint32_t mask;
+	uint16_t item_size;
+	uint8_t* items;
+};
+
+static inline void
+ge_spsc_ring_init(struct ge_spsc_ring_s* ring, void* items, uint16_t item_size, uint32_t count) {
+	atomic_init(&ring->head,0);
+	atomic_init(&ring->tail,0);
+	ring->mask = count-1;
+	ring->item_size = item_size;
+	ring->items = items;
+}
+
+static inline bool
+ge_spsc_ring_push(struct ge_spsc_ring_s* ring, const void* item) {
+	uint32_t tail = atomic_load_explicit(&ring->tail,memory_order_relaxed);
+
+	if(tail-atomic_load_explicit(&ring->head,memory_order_acquire)>ring->mask)
+		return false;	// Full.
+
+	memcpy(ring->items+(tail&ring->mask)*ring->item_size,item,ring->item_size);
+	atomic_store_explicit(&ring->tail,tail+1,memory_order_release);
+	return true;
+}
+
+static inline bool
+ge_spsc_ring_pop(struct ge_spsc_ring_s* ring, void* item) {
+	uint32_t head = atomic_load_explicit(&ring->head,memory_order_relaxed);
+
+	if(head==atomic_load_explicit(&ring->tail,memory_order_acquire))
+		return false;	// Empty.
+
+	memcpy(item,ring->items+(head&ring->mask)*ring->item_size,ring->item_size);
+	atomic_store_explicit(&ring->head,head+1,memory_order_release);
+	return true;
+}
+
+#pragma mark - Multiple producers, single consumer
+
+// Each slot carries a sequence number telling producers and the consumer
+// whose turn it is, so producers only contend on the tail index.
+
+#define GE_MPSC_RING_SLOT_HEADER	(8)
+#define GE_MPSC_RING_STRIDE(item_size)	(GE_MPSC_RING_SLOT_HEADER+(((item_size)+7)&~7))
+
+// Bytes of storage needed for `count` items of `item_size` bytes.
+#define GE_MPSC_RING_STORAGE(item_size,count)	(GE_MPSC_RING_STRIDE(item_size)*(count))
+
+struct ge_mpsc_ring_s {
+	_Atomic uint32_t tail;		// Shared by the producers.
+	uint32_t head;				// Owned by the consumer.
+	uint32_t mask;
+	uint16_t item_size;
+	uint16_t stride;
+	uint8_t* slots;
+};
+
+static inline _Atomic uint32_t*
+ge_mpsc_ring_seq(struct ge_mpsc_ring_s* ring, uint32_t i) {
+	return (_Atomic uint32_t*)(ring->slots+(i&ring->mask)*ring->stride);
+}
+
+static inline void
+ge_mpsc_ring_init(struct ge_mpsc_ring_s* ring, void* storage, uint16_t item_size, uint32_t count) {
+	uint32_t i;
+
+	atomic_init(&ring->tail,0);
+	ring->head = 0;
+	ring->mask = count-1;
+	ring->item_size = item_size;
+	ring->stride = GE_MPSC_RING_STRIDE(item_size);
+	ring->slots = storage;
+
+	for(i=0;i<count;i++)
+		atomic_init(ge_mpsc_ring_seq(ring,i),i);
+}
+
+static inline bool
+ge_mpsc_ring_push(struct ge_mpsc_ring_s* ring, const void* item) {
+	uint32_t pos = atomic_load_explicit(&ring->tail,memory_order_relaxed);
+	_Atomic uint32_t* seq;
+
+	for(;;) {
+		int32_t diff;
+
+		seq = ge_mpsc_ring_seq(ring,pos);
+		diff = (int32_t)(atomic_load_explicit(seq,memory_order_acquire)-pos);
+
+		if(diff==0) {
+			// The slot is free, try to claim it.
+			if(atomic_compare_exchange_weak_explicit(&ring->tail,&pos,pos+1,memory_order_relaxed,memory_order_relaxed))
+				break;
+		} else if(diff<0) {
+			return false;	// Full.
+		} else {
+			pos = atomic_load_explicit(&ring->tail,memory_order_relaxed);
+		}
+	}
+
+	memcpy((uint8_t*)seq+GE_MPSC_RING_SLOT_HEADER,item,ring->item_size);
+	atomic_store_explicit(seq,pos+1,memory_order_release);
+	return true;
+}
+
+static inline bool
+ge_mpsc_ring_pop(struct ge_mpsc_ring_s* ring, void* item) {
+	uint32_t pos = ring->head;
+	_Atomic uint32_t* seq = ge_mpsc_ring_seq(ring,pos);
+
+	if((int32_t)(atomic_load_explicit(seq,memory_order_acquire)-(pos+1))<0)
+		return false;	// Empty, or a producer hasn't finished writing.
+
+	memcpy(item,(uint8_t*)seq+GE_MPSC_RING_SLOT_HEADER,ring->item_size);
+	atomic_store_explicit(seq,pos+ring->mask+1,memory_order_release);
+	ring->head = pos+1;
+	return true;
+}
+
+#endif
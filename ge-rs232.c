@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <time.h>
 
 #if __AVR__
 #include <avr/pgmspace.h>
@@ -91,10 +92,53 @@ hex_digit_to_int(char c) {
 	return 0;
 }
 
+static uint32_t
+get_time_ms(void) {
+#if __AVR__
+	return time(NULL)*1000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1000+ts.tv_nsec/1000000;
+#endif
+}
+
+static void
+ge_rs232_rtt_sample(ge_rs232_t self, uint32_t rtt) {
+	if(!self->rtt_samples) {
+		self->srtt = rtt;
+		self->rttvar = rtt/2;
+	} else {
+		uint32_t delta = (self->srtt>rtt)?self->srtt-rtt:rtt-self->srtt;
+		self->rttvar = (3*self->rttvar+delta)/4;
+		self->srtt = (7*self->srtt+rtt)/8;
+	}
+	self->rtt_samples++;
+
+	self->rto = self->srtt+4*self->rttvar;
+	if(self->rto<GE_RS232_RTO_MIN)
+		self->rto = GE_RS232_RTO_MIN;
+	if(self->rto>GE_RS232_RTO_MAX)
+		self->rto = GE_RS232_RTO_MAX;
+}
+
+// The timeout doubles with every retransmission of the same frame.
+static uint32_t
+ge_rs232_current_rto(ge_rs232_t self) {
+	uint32_t rto = self->rto;
+	uint8_t i;
+
+	for(i=1;i<self->output_attempt_count && rto<GE_RS232_RTO_MAX;i++)
+		rto *= 2;
+
+	return (rto<GE_RS232_RTO_MAX)?rto:GE_RS232_RTO_MAX;
+}
+
 ge_rs232_t
 ge_rs232_init(ge_rs232_t self) {
 	bzero((void*)self,sizeof(*self));
 	self->last_response = GE_RS232_ACK;
+	self->rto = GE_RS232_RTO_INITIAL;
 	return self;
 }
 
@@ -110,6 +154,10 @@ ge_rs232_receive_byte(ge_rs232_t self, uint8_t byte) {
 		self->buffer_sum = 0;
 	} else if(byte == GE_RS232_ACK && !self->last_response) {
 		self->last_response = GE_RS232_ACK;
+		// Karn's rule: an ACK for a retransmitted frame could belong to
+		// any of the copies, so it says nothing about the round trip.
+		if(self->output_attempt_count==1)
+			ge_rs232_rtt_sample(self,get_time_ms()-self->last_sent);
 		if(self->got_response)
 			self->got_response(self->response_context,self,true);
 	} else if(byte == GE_RS232_NAK && !self->last_response) {
@@ -163,17 +211,28 @@ bail:
 ge_rs232_status_t
 ge_rs232_ready_to_send(ge_rs232_t self) {
 	ge_rs232_status_t ret = GE_RS232_STATUS_WAIT;
-	time_t curr_time = time(&curr_time);
 	if(self->last_response == GE_RS232_ACK) {
 		ret = GE_RS232_STATUS_OK;
 	} else if(self->last_response == GE_RS232_NAK) {
 		ret = GE_RS232_STATUS_NAK;
-	} else if(curr_time-self->last_sent > 1) {
+	} else if(ge_rs232_get_timeout(self) == 0) {
 		ret = GE_RS232_STATUS_TIMEOUT;
 	}
 	return ret;
 }
 
+int32_t
+ge_rs232_get_timeout(ge_rs232_t self) {
+	int32_t remaining;
+
+	if(self->last_response)
+		return -1;
+
+	remaining = (int32_t)(self->last_sent+ge_rs232_current_rto(self)-get_time_ms());
+
+	return (remaining>0)?remaining:0;
+}
+
 ge_rs232_status_t
 ge_rs232_resend_last_message(ge_rs232_t self) {
 	return ge_rs232_send_message(self,self->output_buffer,self->output_buffer_len);
@@ -193,6 +252,8 @@ ge_rs232_send_message(ge_rs232_t self, const uint8_t* data, uint8_t len) {
 		memcpy(self->output_buffer,data,len);
 		self->output_buffer_len = len;
 		self->output_attempt_count = 0;
+	} else {
+		self->retransmits++;
 	}
 
 	self->output_attempt_count++;
@@ -230,7 +291,7 @@ ge_rs232_send_message(ge_rs232_t self, const uint8_t* data, uint8_t len) {
 	ret = self->send_byte(self->context,int_to_hex_digit(checksum),self);
 	if(ret) goto bail;
 
-	self->last_sent = time(&self->last_sent);
+	self->last_sent = get_time_ms();
 bail:
 	return ret;
 }
@@ -255,36 +316,146 @@ typedef struct ge_queue_s *ge_queue_t;
 
 ge_queue_t
 ge_queue_init(ge_queue_t qinterface, ge_rs232_t interface) {
-	memset((void*)qinterface,sizeof(*qinterface),0);
+	memset((void*)qinterface,0,sizeof(*qinterface));
 	qinterface->interface = interface;
 	return qinterface;
 }
 
+uint8_t
+ge_queue_depth(ge_queue_t qinterface) {
+	return (qinterface->tail-qinterface->head)&(GE_QUEUE_MAX_MESSAGES-1);
+}
+
+static void
+ge_queue_finish(ge_queue_t qinterface, const struct ge_message_waiter_s* waiter, ge_rs232_status_t status) {
+	if(NULL==waiter->finished)
+		return;
+
+	if(waiter->executor)
+		waiter->executor->post(waiter->executor,waiter->finished,waiter->context,status);
+	else
+		waiter->finished(waiter->context,status);
+}
+
 static void
 ge_queue_got_response(void* context,struct ge_rs232_s* instance, bool didAck) {
 	ge_queue_t qinterface = context;
 	ge_rs232_status_t status = ge_rs232_ready_to_send(qinterface->interface);
 	struct ge_message_s *message = &qinterface->queue[qinterface->head];
 
+	// Detach before calling any waiters. One that queues more messages
+	// can get the next frame sent right away, and that frame installs
+	// its own handler here.
+	qinterface->interface->got_response = NULL;
+	qinterface->interface->response_context = NULL;
+
 	if(status==GE_RS232_STATUS_OK || message->attempts>=3) {
-		if(NULL!=message->finished)
-			message->finished(
-				message->context,
-				status
-			);
+		struct ge_message_waiter_s waiter[GE_QUEUE_MAX_WAITERS];
+		uint8_t waiter_count = message->waiter_count;
+		int i;
+
+		// Pop it first, so that waiters can queue more messages. Its
+		// slot may be reused by them, hence the copy.
+		memcpy(waiter,message->waiter,waiter_count*sizeof(*waiter));
+		message->waiter_count = 0;
 		qinterface->head = (qinterface->head+1)&(GE_QUEUE_MAX_MESSAGES-1);
+
+		for(i=0;i<waiter_count;i++)
+			ge_queue_finish(qinterface,&waiter[i],status);
 	}
+}
 
-	qinterface->interface->got_response = NULL;
-	qinterface->interface->response_context = NULL;
+static ge_rs232_status_t ge_queue_insert(
+	ge_queue_t qinterface,
+	const uint8_t* data,
+	uint8_t len,
+	void (*finished)(void* context,ge_rs232_status_t status),
+	void* context,
+	bool coalesce,
+	ge_executor_t executor
+);
+
+#if GE_QUEUE_THREADS
+void
+ge_queue_set_owner(
+	ge_queue_t qinterface,
+	pthread_t owner,
+	void (*wakeup)(void* context),
+	void* wakeup_context,
+	ge_executor_t executor
+) {
+	ge_mpsc_ring_init(&qinterface->inbox,qinterface->inbox_storage,sizeof(struct ge_queue_request_s),GE_QUEUE_INBOX_SIZE);
+	atomic_init(&qinterface->inbox_full,0);
+	qinterface->wakeup = wakeup;
+	qinterface->wakeup_context = wakeup_context;
+	qinterface->executor = executor;
+	qinterface->owner = owner;
+	qinterface->has_owner = true;
+}
 
+static ge_rs232_status_t
+ge_queue_post(
+	ge_queue_t qinterface,
+	const uint8_t* data,
+	uint8_t len,
+	void (*finished)(void* context,ge_rs232_status_t status),
+	void* context,
+	bool coalesce,
+	ge_executor_t executor
+) {
+	struct ge_queue_request_s request;
+
+	memcpy(request.msg,data,len);
+	request.msg_len = len;
+	request.coalesce = coalesce;
+	request.finished = finished;
+	request.context = context;
+	request.executor = executor;
+
+	if(!ge_mpsc_ring_push(&qinterface->inbox,&request)) {
+		atomic_fetch_add_explicit(&qinterface->inbox_full,1,memory_order_relaxed);
+		return GE_RS232_STATUS_QUEUE_FULL;
+	}
+
+	if(qinterface->wakeup)
+		qinterface->wakeup(qinterface->wakeup_context);
+
+	return GE_RS232_STATUS_OK;
 }
 
+static void
+ge_queue_drain_inbox(ge_queue_t qinterface) {
+	struct ge_queue_request_s request;
+
+	while(ge_mpsc_ring_pop(&qinterface->inbox,&request)) {
+		ge_rs232_status_t status = ge_queue_insert(
+			qinterface,
+			request.msg,
+			request.msg_len,
+			request.finished,
+			request.context,
+			request.coalesce,
+			request.executor
+		);
+
+		if(status) {
+			struct ge_message_waiter_s waiter = { request.context, request.finished, request.executor };
+			ge_queue_finish(qinterface,&waiter,status);
+		}
+	}
+}
+#endif
+
 ge_rs232_status_t
 ge_queue_update(ge_queue_t qinterface) {
 	ge_rs232_status_t status = 0;
     struct ge_message_s *message;
 
+#if GE_QUEUE_THREADS
+	if(qinterface->has_owner)
+		ge_queue_drain_inbox(qinterface);
+#endif
+
 	if(qinterface->head==qinterface->tail)
 		goto bail;	// Empty.
 
@@ -295,53 +466,157 @@ ge_queue_update(ge_queue_t qinterface) {
 		&& qinterface->interface->got_response == &ge_queue_got_response
 	) {
 		(*qinterface->interface->got_response)(qinterface->interface->response_context,qinterface->interface,0);
+
+		// A waiter may have queued and sent the next message already.
+		if(qinterface->head==qinterface->tail
+			|| ge_rs232_ready_to_send(qinterface->interface)==GE_RS232_STATUS_WAIT
+		) {
+			goto bail;
+		}
 	}
 
 	// RELEASE THE KRAKEN!
     message = &qinterface->queue[qinterface->head];
-	message->attempts++;
 
 	qinterface->interface->got_response = &ge_queue_got_response;
 	qinterface->interface->response_context = qinterface;
 
-	status = ge_rs232_send_message(qinterface->interface, message->msg, message->msg_len);
+	// Retries go through the resend path so the interface knows they
+	// are retransmissions, for backoff and RTT sampling.
+	if(message->attempts++)
+		status = ge_rs232_resend_last_message(qinterface->interface);
+	else
+		status = ge_rs232_send_message(qinterface->interface, message->msg, message->msg_len);
 
 bail:
 	return status;
 }
 
-ge_rs232_status_t ge_queue_message(
+static ge_rs232_status_t
+ge_queue_insert(
 	ge_queue_t qinterface,
 	const uint8_t* data,
 	uint8_t len,
 	void (*finished)(void* context,ge_rs232_status_t status),
-	void* context
+	void* context,
+	bool coalesce,
+	ge_executor_t executor
 ) {
 	ge_rs232_status_t status = 0;
-	struct ge_message_s *message = &qinterface->queue[qinterface->tail];
+	struct ge_message_s *message;
+	uint8_t i;
+
+	if(coalesce) {
+		// Only messages that haven't gone out yet can take more waiters,
+		// the head may already be on the wire.
+		for(i=qinterface->head;i!=qinterface->tail;i=(i+1)&(GE_QUEUE_MAX_MESSAGES-1)) {
+			message = &qinterface->queue[i];
+			if(message->coalesce
+				&& message->attempts==0
+				&& message->msg_len==len
+				&& message->waiter_count<GE_QUEUE_MAX_WAITERS
+				&& 0==memcmp(message->msg,data,len)
+			) {
+				message->waiter[message->waiter_count].context = context;
+				message->waiter[message->waiter_count].finished = finished;
+				message->waiter[message->waiter_count].executor = executor;
+				message->waiter_count++;
+				qinterface->coalesced++;
+				goto bail;
+			}
+		}
+	}
+
+	message = &qinterface->queue[qinterface->tail];
 
 	// Stuff is added to the tail and removed from the head.
 	// Tail is always empty.
 
-	if((qinterface->tail-qinterface->head&(GE_QUEUE_MAX_MESSAGES-1)) == (GE_QUEUE_MAX_MESSAGES-1)) {
-		// Queue is full!
+	if(ge_queue_depth(qinterface) == (GE_QUEUE_MAX_MESSAGES-1)) {
+		// Queue is full! Leave it alone and let the caller deal with it.
+		qinterface->rejected++;
 		status = GE_RS232_STATUS_QUEUE_FULL;
+		goto bail;
 	}
 
-	message->context = context;
-	message->finished = finished;
+	message->waiter[0].context = context;
+	message->waiter[0].finished = finished;
+	message->waiter[0].executor = executor;
+	message->waiter_count = 1;
 	memcpy(message->msg,data,len);
 	message->msg_len = len;
 	message->attempts = 0;
+	message->coalesce = coalesce;
 
 	qinterface->tail = (qinterface->tail+1)&(GE_QUEUE_MAX_MESSAGES-1);
 
-	ge_queue_update(qinterface);
+	if(qinterface->max_depth<ge_queue_depth(qinterface))
+		qinterface->max_depth = ge_queue_depth(qinterface);
 
 bail:
 	return status;
 }
 
+ge_rs232_status_t
+ge_queue_submit(
+	ge_queue_t qinterface,
+	const uint8_t* data,
+	uint8_t len,
+	uint8_t flags,
+	void (*finished)(void* context,ge_rs232_status_t status),
+	void* context,
+	ge_executor_t executor
+) {
+	bool coalesce = !!(flags&GE_QUEUE_FLAG_COALESCE);
+	ge_rs232_status_t status;
+
+	if(len>GE_RS232_MAX_MESSAGE_SIZE)
+		return GE_RS232_STATUS_MESSAGE_TOO_BIG;
+
+#if GE_QUEUE_THREADS
+	if(qinterface->has_owner && !pthread_equal(qinterface->owner,pthread_self()))
+		return ge_queue_post(qinterface,data,len,finished,context,coalesce,executor);
+#endif
+
+	status = ge_queue_insert(qinterface,data,len,finished,context,coalesce,executor);
+
+	if(!status)
+		ge_queue_update(qinterface);
+
+	return status;
+}
+
+// Results for messages queued from the owner thread (or from anywhere,
+// if the queue has no owner) are delivered in place.
+static ge_executor_t
+ge_queue_caller_executor(ge_queue_t qinterface) {
+#if GE_QUEUE_THREADS
+	if(qinterface->has_owner && !pthread_equal(qinterface->owner,pthread_self()))
+		return qinterface->executor;
+#endif
+	return NULL;
+}
+
+ge_rs232_status_t ge_queue_message(
+	ge_queue_t qinterface,
+	const uint8_t* data,
+	uint8_t len,
+	void (*finished)(void* context,ge_rs232_status_t status),
+	void* context
+) {
+	return ge_queue_submit(qinterface,data,len,GE_QUEUE_FLAG_COALESCE,finished,context,ge_queue_caller_executor(qinterface));
+}
+
+ge_rs232_status_t ge_queue_append_message(
+	ge_queue_t qinterface,
+	const uint8_t* data,
+	uint8_t len,
+	void (*finished)(void* context,ge_rs232_status_t status),
+	void* context
+) {
+	return ge_queue_submit(qinterface,data,len,0,finished,context,ge_queue_caller_executor(qinterface));
+}
+
 const char *ge_rs232_text_token_lookup[256] = {
 	"0",
 	"1",
@@ -566,8 +841,7 @@ const char *ge_rs232_text_token_lookup[256] = {
 };
 
 const char*
-ge_text_to_ascii_one_line(const uint8_t * bytes, uint8_t len) {
-	static char ret[1024];
+ge_text_to_ascii_one_line(char* ret, size_t ret_len, const uint8_t * bytes, uint8_t len) {
 	ret[0] = 0;
 	// TODO: Optimize!
 	while(len--) {
@@ -575,27 +849,26 @@ ge_text_to_ascii_one_line(const uint8_t * bytes, uint8_t len) {
 		if(str) {
 			if(str[0]=='\n') {
 				if(len)
-					strlcat(ret,isspace(ret[strlen(ret)-1])?"| ":" | ",sizeof(ret));
+					strlcat(ret,isspace(ret[strlen(ret)-1])?"| ":" | ",ret_len);
 			} else if(str[0]=='\b') {
 				// Backspace
 				if(ret[0])
 					ret[strlen(ret)-1] = 0;
 			} else {
-				strlcat(ret,str,sizeof(ret));
+				strlcat(ret,str,ret_len);
 			}
 		} else {
-			strlcat(ret,"?",sizeof(ret));
+			strlcat(ret,"?",ret_len);
 		}
 	}
 	// Remove trailing whitespace.
-	for(len=strlen(ret);len && isspace(ret[len-1]);len--)
-		ret[len-1] = 0;
+	for(ret_len=strlen(ret);ret_len && isspace(ret[ret_len-1]);ret_len--)
+		ret[ret_len-1] = 0;
 	return ret;
 }
 
 const char*
-ge_text_to_ascii(const uint8_t * bytes, uint8_t len) {
-	static char ret[1024];
+ge_text_to_ascii(char* ret, size_t ret_len, const uint8_t * bytes, uint8_t len) {
 	ret[0] = 0;
 	// TODO: Optimize!
 	while(len--) {
@@ -606,49 +879,43 @@ ge_text_to_ascii(const uint8_t * bytes, uint8_t len) {
 				if(ret[0])
 					ret[strlen(ret)-1] = 0;
 			} else {
-				strlcat(ret,str,sizeof(ret));
+				strlcat(ret,str,ret_len);
 			}
 		} else {
-			strlcat(ret,"?",sizeof(ret));
+			strlcat(ret,"?",ret_len);
 		}
 	}
 	// Remove trailing whitespace.
-	for(len=strlen(ret);len && isspace(ret[len-1]);len--)
-		ret[len-1] = 0;
+	for(ret_len=strlen(ret);ret_len && isspace(ret[ret_len-1]);ret_len--)
+		ret[ret_len-1] = 0;
 	return ret;
 }
 
 const char* ge_user_to_cstr(char* dest, int user) {
-	static char static_string[48];
-
-	if (dest == NULL) {
-		dest = static_string;
-	}
-
 	if (user >= 230 && user <= 237) {
-		snprintf(dest, sizeof(static_string), "P%d-MASTER-CODE", user - 230);
+		snprintf(dest, GE_RS232_USER_MAX_LENGTH, "P%d-MASTER-CODE", user - 230);
 	} else if (user >= 238 && user <= 245) {
-		snprintf(dest, sizeof(static_string), "P%d-DURESS-CODE", user - 238);
+		snprintf(dest, GE_RS232_USER_MAX_LENGTH, "P%d-DURESS-CODE", user - 238);
 	} else if (user == 246) {
-		strlcpy(dest, "SYSTEM-CODE", sizeof(static_string));
+		strlcpy(dest, "SYSTEM-CODE", GE_RS232_USER_MAX_LENGTH);
 	} else if (user == 247) {
-		strlcpy(dest, "INSTALLER", sizeof(static_string));
+		strlcpy(dest, "INSTALLER", GE_RS232_USER_MAX_LENGTH);
 	} else if (user == 248) {
-		strlcpy(dest, "DEALER", sizeof(static_string));
+		strlcpy(dest, "DEALER", GE_RS232_USER_MAX_LENGTH);
 	} else if (user == 249) {
-		strlcpy(dest, "AVM-CODE", sizeof(static_string));
+		strlcpy(dest, "AVM-CODE", GE_RS232_USER_MAX_LENGTH);
 	} else if (user == 250) {
-		strlcpy(dest, "QUICK-ARM", sizeof(static_string));
+		strlcpy(dest, "QUICK-ARM", GE_RS232_USER_MAX_LENGTH);
 	} else if (user == 251) {
-		strlcpy(dest, "KEY-SWITCH", sizeof(static_string));
+		strlcpy(dest, "KEY-SWITCH", GE_RS232_USER_MAX_LENGTH);
 	} else if (user == 252) {
-		strlcpy(dest, "SYSTEM", sizeof(static_string));
+		strlcpy(dest, "SYSTEM", GE_RS232_USER_MAX_LENGTH);
 	} else if (user == 255) {
-		strlcpy(dest, "AUTOMATION", sizeof(static_string));
+		strlcpy(dest, "AUTOMATION", GE_RS232_USER_MAX_LENGTH);
 	} else if (user == 65535) {
-		strlcpy(dest, "SYSTEM/KEY-SWITCH", sizeof(static_string));
+		strlcpy(dest, "SYSTEM/KEY-SWITCH", GE_RS232_USER_MAX_LENGTH);
 	} else {
-		snprintf(dest, sizeof(static_string), "USER-%d", user);
+		snprintf(dest, GE_RS232_USER_MAX_LENGTH, "USER-%d", user);
 	}
 
 	return dest;
@@ -4,8 +4,19 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <time.h>
 
+// Lets a queue be owned by one thread while others submit to it.
+#ifndef GE_QUEUE_THREADS
+#define GE_QUEUE_THREADS			(!__AVR__)
+#endif
+
+#if GE_QUEUE_THREADS
+#include <pthread.h>
+#include "ge-ring.h"
+#endif
+
 #define GE_RS232_START_OF_MESSAGE	(0x0A)	// ASCII Line Feed
 #define GE_RS232_ACK				(0x06)	// ASCII ACK
 #define GE_RS232_NAK				(0x15)	// ASCII NAK
@@ -16,6 +27,30 @@
 #define GE_QUEUE_MAX_MESSAGES		(8)
 #endif
 
+// Retransmission timeout bounds, in milliseconds. The timeout starts at
+// GE_RS232_RTO_INITIAL and then follows the measured round-trip times.
+#ifndef GE_RS232_RTO_INITIAL
+#define GE_RS232_RTO_INITIAL		(1500)
+#endif
+
+#ifndef GE_RS232_RTO_MIN
+#define GE_RS232_RTO_MIN			(200)
+#endif
+
+#ifndef GE_RS232_RTO_MAX
+#define GE_RS232_RTO_MAX			(4000)
+#endif
+
+#ifndef GE_QUEUE_MAX_WAITERS
+#define GE_QUEUE_MAX_WAITERS		(4)
+#endif
+
+// Messages other threads can have in flight to a queue's owner. Must be
+// a power of two.
+#ifndef GE_QUEUE_INBOX_SIZE
+#define GE_QUEUE_INBOX_SIZE			(16)
+#endif
+
 
 #define GE_RS232_STATUS_OK					(0)
 #define GE_RS232_STATUS_ERROR				(-1)
@@ -127,7 +162,7 @@ struct ge_rs232_s {
 	uint8_t nibble_buffer;
 	uint8_t last_response;
 	uint8_t buffer_sum;
-	time_t last_sent;
+	uint32_t last_sent;		// In milliseconds.
 	uint8_t buffer[GE_RS232_MAX_MESSAGE_SIZE];
 	uint8_t output_buffer[GE_RS232_MAX_MESSAGE_SIZE];
 	uint8_t output_buffer_len;
@@ -136,6 +171,14 @@ struct ge_rs232_s {
 	ge_rs232_status_t (*send_byte)(void* context, uint8_t byte,struct ge_rs232_s* instance);
 	void* response_context;
 	void (*got_response)(void* context,struct ge_rs232_s* instance, bool didAck);
+
+	// Round-trip estimates from ACKed frames, in milliseconds, kept the
+	// same way TCP does (RFC 6298). Retransmitted frames aren't sampled.
+	uint32_t srtt;
+	uint32_t rttvar;
+	uint32_t rto;
+	uint32_t rtt_samples;
+	uint32_t retransmits;
 };
 
 typedef struct ge_rs232_s* ge_rs232_t;
@@ -143,23 +186,87 @@ typedef struct ge_rs232_s* ge_rs232_t;
 ge_rs232_t ge_rs232_init(ge_rs232_t interface);
 ge_rs232_status_t ge_rs232_receive_byte(ge_rs232_t interface, uint8_t byte);
 ge_rs232_status_t ge_rs232_ready_to_send(ge_rs232_t interface);
+
+// Milliseconds until the frame in flight times out, or -1 if no
+// response is outstanding.
+int32_t ge_rs232_get_timeout(ge_rs232_t interface);
 ge_rs232_status_t ge_rs232_send_message(ge_rs232_t interface, const uint8_t* data, uint8_t len);
 ge_rs232_status_t ge_rs232_resend_last_message(ge_rs232_t self);
 
 #pragma mark - Queue Interface
 
+// Runs `finished` callbacks somewhere other than the queue's owner
+// thread. `post` is called on the owner thread and must not block.
+// Implementations embed this as their first member.
+struct ge_executor_s {
+	void (*post)(
+		struct ge_executor_s* executor,
+		void (*finished)(void* context,ge_rs232_status_t status),
+		void* context,
+		ge_rs232_status_t status
+	);
+};
+typedef struct ge_executor_s* ge_executor_t;
+
+// Everyone who queued this message while it was pending. They are all
+// told how it went once it has been sent.
+struct ge_message_waiter_s {
+	void* context;
+	void (*finished)(void* context,ge_rs232_status_t status);
+	ge_executor_t executor;	// NULL to call `finished` directly.
+};
+
 struct ge_message_s {
 	uint8_t msg[GE_RS232_MAX_MESSAGE_SIZE];
 	uint8_t msg_len;
 	uint8_t attempts;
-	void* context;
+	bool coalesce;
+	uint8_t waiter_count;
+	struct ge_message_waiter_s waiter[GE_QUEUE_MAX_WAITERS];
+};
+
+#if GE_QUEUE_THREADS
+// A message on its way from another thread to the queue's owner.
+struct ge_queue_request_s {
+	uint8_t msg[GE_RS232_MAX_MESSAGE_SIZE];
+	uint8_t msg_len;
+	bool coalesce;
 	void (*finished)(void* context,ge_rs232_status_t status);
+	void* context;
+	ge_executor_t executor;
 };
+#endif
 
 struct ge_queue_s {
 	ge_rs232_t interface;
 	struct ge_message_s queue[GE_QUEUE_MAX_MESSAGES];
 	uint8_t head, tail;
+
+	uint8_t max_depth;
+	uint32_t rejected;
+	uint32_t coalesced;
+
+#if GE_QUEUE_THREADS
+	// Once a queue has an owner, only the owner touches the queue and the
+	// interface. Everyone else's messages go through the inbox, which the
+	// owner drains from ge_queue_update().
+	bool has_owner;
+	pthread_t owner;
+	struct ge_mpsc_ring_s inbox;
+	uint8_t inbox_storage[GE_MPSC_RING_STORAGE(sizeof(struct ge_queue_request_s),GE_QUEUE_INBOX_SIZE)];
+
+	// Called after a message lands in the inbox, to get the owner to
+	// call ge_queue_update().
+	void (*wakeup)(void* context);
+	void* wakeup_context;
+
+	// Where results go for messages other threads queue through
+	// ge_queue_message() and ge_queue_append_message().
+	ge_executor_t executor;
+
+	// Messages turned away because the inbox was full.
+	atomic_uint inbox_full;
+#endif
 };
 typedef struct ge_queue_s *ge_queue_t;
 
@@ -167,6 +274,40 @@ ge_queue_t ge_queue_init(ge_queue_t qinterface,ge_rs232_t interface);
 
 ge_rs232_status_t ge_queue_update(ge_queue_t qinterface);
 
+// Number of messages waiting, including the one being sent.
+uint8_t ge_queue_depth(ge_queue_t qinterface);
+
+#if GE_QUEUE_THREADS
+// Hands the queue to `owner`. From then on, messages queued by other
+// threads return as soon as they are in the inbox, and GE_RS232_STATUS_QUEUE_FULL
+// only means the inbox was full; the outcome arrives through `finished`.
+void ge_queue_set_owner(
+	ge_queue_t qinterface,
+	pthread_t owner,
+	void (*wakeup)(void* context),
+	void* wakeup_context,
+	ge_executor_t executor
+);
+#endif
+
+#define GE_QUEUE_FLAG_COALESCE		(1<<0)
+
+// Queues a message from any thread. With GE_QUEUE_FLAG_COALESCE it
+// behaves like ge_queue_message(), otherwise like ge_queue_append_message().
+// `finished` is posted to `executor`, or called on the owner thread if
+// `executor` is NULL.
+ge_rs232_status_t ge_queue_submit(
+	ge_queue_t qinterface,
+	const uint8_t* data,
+	uint8_t len,
+	uint8_t flags,
+	void (*finished)(void* context,ge_rs232_status_t status),
+	void* context,
+	ge_executor_t executor
+);
+
+// Queues a message, unless an identical one is already waiting to be
+// sent, in which case `finished` is attached to that one instead.
 ge_rs232_status_t ge_queue_message(
 	ge_queue_t qinterface,
 	const uint8_t* data,
@@ -175,12 +316,31 @@ ge_rs232_status_t ge_queue_message(
 	void* context
 );
 
+// Always queues a new message. For messages whose effect depends on
+// how many times they are sent, like raw keypresses.
+ge_rs232_status_t ge_queue_append_message(
+	ge_queue_t qinterface,
+	const uint8_t* data,
+	uint8_t len,
+	void (*finished)(void* context,ge_rs232_status_t status),
+	void* context
+);
+
 #pragma mark - Text conversion
 
+// Room for any text field the panel can send, once converted.
+#define GE_RS232_TEXT_MAX_LENGTH	(GE_RS232_MAX_MESSAGE_SIZE*16)
+
+// Room for any user name from ge_user_to_cstr().
+#define GE_RS232_USER_MAX_LENGTH	(24)
+
 extern const char* ge_rs232_text_token_lookup[256];
 
-const char* ge_text_to_ascii_one_line(const uint8_t * bytes, uint8_t len);
-const char* ge_text_to_ascii(const uint8_t * bytes, uint8_t len);
+// These write into `dest` and return it. The result is truncated to fit.
+const char* ge_text_to_ascii_one_line(char* dest, size_t dest_len, const uint8_t * bytes, uint8_t len);
+const char* ge_text_to_ascii(char* dest, size_t dest_len, const uint8_t * bytes, uint8_t len);
+
+// `dest` must have room for GE_RS232_USER_MAX_LENGTH characters.
 const char* ge_user_to_cstr(char* dest, int user);
 
 
@@ -0,0 +1,75 @@
+
+#ifndef __GE_SEQLOCK_H__
+#define __GE_SEQLOCK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+// Sequence lock for data with one writer and any number of readers. The
+// writer never waits; readers retry if the writer got in their way. The
+// count is odd while a write is in progress.
+//
+// The guarded data must be plain old data, since readers may copy it
+// while it is half written (and then throw the copy away).
+
+struct ge_seqlock_s {
+	atomic_uint seq;
+};
+
+static inline void
+ge_seqlock_init(struct ge_seqlock_s* lock) {
+	atomic_init(&lock->seq,0);
+}
+
+static inline void
+ge_seqlock_write_begin(struct ge_seqlock_s* lock) {
+	unsigned seq = atomic_load_explicit(&lock->seq,memory_order_relaxed);
+
+	atomic_store_explicit(&lock->seq,seq+1,memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static inline void
+ge_seqlock_write_end(struct ge_seqlock_s* lock) {
+	unsigned seq = atomic_load_explicit(&lock->seq,memory_order_relaxed);
+
+	atomic_store_explicit(&lock->seq,seq+1,memory_order_release);
+}
+
+static inline unsigned
+ge_seqlock_read_begin(const struct ge_seqlock_s* lock) {
+	unsigned seq;
+
+	// A write is only ever a short copy, so just spin it out.
+	while((seq = atomic_load_explicit((atomic_uint*)&lock->seq,memory_order_acquire))&1)
+		;
+
+	return seq;
+}
+
+static inline bool
+ge_seqlock_read_retry(const struct ge_seqlock_s* lock, unsigned seq) {
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit((atomic_uint*)&lock->seq,memory_order_relaxed)!=seq;
+}
+
+static inline void
+ge_seqlock_write(struct ge_seqlock_s* lock, void* dest, const void* src, size_t len) {
+	ge_seqlock_write_begin(lock);
+	memcpy(dest,src,len);
+	ge_seqlock_write_end(lock);
+}
+
+static inline void
+ge_seqlock_read(const struct ge_seqlock_s* lock, void* dest, const void* src, size_t len) {
+	unsigned seq;
+
+	do {
+		seq = ge_seqlock_read_begin(lock);
+		memcpy(dest,src,len);
+	} while(ge_seqlock_read_retry(lock,seq));
+}
+
+#endif
@@ -0,0 +1,168 @@
+#include "ge-shm.h"
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#pragma mark - Writer
+
+int
+ge_shm_create(ge_shm_t shm, const char* name) {
+	int fd;
+	struct ge_shm_state_s* state;
+
+	memset(shm,0,sizeof(*shm));
+
+	fd = shm_open(name,O_RDWR|O_CREAT,0644);
+	if(fd<0)
+		return -1;
+
+	if(ftruncate(fd,sizeof(*state))<0) {
+		close(fd);
+		return -1;
+	}
+
+	state = mmap(NULL,sizeof(*state),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+
+	if(state==MAP_FAILED)
+		return -1;
+
+	// Readers that still have an old mapping see the magic vanish while
+	// we lay things out again.
+	state->magic = 0;
+	atomic_thread_fence(memory_order_release);
+
+	memset(&state->zone,0,sizeof(state->zone));
+	memset(&state->partition,0,sizeof(state->partition));
+	state->layout_version = GE_SHM_LAYOUT_VERSION;
+	state->max_zones = GE_SHM_MAX_ZONES;
+	state->max_partitions = GE_SHM_MAX_PARTITIONS;
+	state->writer_pid = getpid();
+	atomic_store_explicit(&state->generation,0,memory_order_relaxed);
+
+	atomic_thread_fence(memory_order_release);
+	state->magic = GE_SHM_MAGIC;
+
+	shm->state = state;
+	shm->writer = true;
+	snprintf(shm->name,sizeof(shm->name),"%s",name);
+
+	return 0;
+}
+
+void
+ge_shm_close(ge_shm_t shm) {
+	if(!shm->state)
+		return;
+
+	if(shm->writer)
+		shm->state->magic = 0;
+
+	munmap(shm->state,sizeof(*shm->state));
+
+	if(shm->writer)
+		shm_unlink(shm->name);
+
+	shm->state = NULL;
+}
+
+void
+ge_shm_write_zone(ge_shm_t shm, const struct ge_shm_zone_state_s* zone) {
+	struct ge_shm_zone_s* entry;
+
+	if(!zone->zone_number || zone->zone_number>GE_SHM_MAX_ZONES)
+		return;
+
+	entry = &shm->state->zone[zone->zone_number-1];
+	ge_seqlock_write(&entry->lock,&entry->state,zone,sizeof(*zone));
+}
+
+void
+ge_shm_write_partition(ge_shm_t shm, const struct ge_shm_partition_state_s* partition) {
+	struct ge_shm_partition_s* entry;
+
+	if(!partition->partition_number || partition->partition_number>GE_SHM_MAX_PARTITIONS)
+		return;
+
+	entry = &shm->state->partition[partition->partition_number-1];
+	ge_seqlock_write(&entry->lock,&entry->state,partition,sizeof(*partition));
+}
+
+void
+ge_shm_commit(ge_shm_t shm) {
+	atomic_fetch_add_explicit(&shm->state->generation,1,memory_order_release);
+}
+
+#pragma mark - Reader
+
+int
+ge_shm_open(ge_shm_t shm, const char* name) {
+	int fd;
+	struct stat st;
+	struct ge_shm_state_s* state;
+
+	memset(shm,0,sizeof(*shm));
+
+	fd = shm_open(name,O_RDONLY,0);
+	if(fd<0)
+		return -1;
+
+	if(fstat(fd,&st)<0 || st.st_size<(off_t)sizeof(*state)) {
+		close(fd);
+		return -1;
+	}
+
+	state = mmap(NULL,sizeof(*state),PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+
+	if(state==MAP_FAILED)
+		return -1;
+
+	if(state->magic!=GE_SHM_MAGIC
+		|| state->layout_version!=GE_SHM_LAYOUT_VERSION
+		|| state->max_zones!=GE_SHM_MAX_ZONES
+		|| state->max_partitions!=GE_SHM_MAX_PARTITIONS
+	) {
+		munmap(state,sizeof(*state));
+		return -1;
+	}
+
+	shm->state = state;
+	snprintf(shm->name,sizeof(shm->name),"%s",name);
+
+	return 0;
+}
+
+unsigned
+ge_shm_generation(ge_shm_t shm) {
+	return atomic_load_explicit(&shm->state->generation,memory_order_acquire);
+}
+
+bool
+ge_shm_read_zone(ge_shm_t shm, int zonei, struct ge_shm_zone_state_s* zone) {
+	const struct ge_shm_zone_s* entry;
+
+	if(zonei<1 || zonei>GE_SHM_MAX_ZONES)
+		return false;
+
+	entry = &shm->state->zone[zonei-1];
+	ge_seqlock_read(&entry->lock,zone,&entry->state,sizeof(*zone));
+
+	return zone->zone_number!=0;
+}
+
+bool
+ge_shm_read_partition(ge_shm_t shm, int partitioni, struct ge_shm_partition_state_s* partition) {
+	const struct ge_shm_partition_s* entry;
+
+	if(partitioni<1 || partitioni>GE_SHM_MAX_PARTITIONS)
+		return false;
+
+	entry = &shm->state->partition[partitioni-1];
+	ge_seqlock_read(&entry->lock,partition,&entry->state,sizeof(*partition));
+
+	return partition->partition_number!=0;
+}
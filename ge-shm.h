@@ -0,0 +1,112 @@
+
+#ifndef __GE_SHM_H__
+#define __GE_SHM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ge-seqlock.h"
+
+// Read-only mirror of panel state in POSIX shared memory, for local
+// processes that want current state without going through CoAP. The
+// layout is fixed; readers should check `magic` and `layout_version`
+// before trusting anything else. Each zone and partition has its own
+// seqlock, so a reader never blocks the daemon and never sees a
+// half-written entry.
+
+#define GE_SHM_MAGIC				(0x47455348)	// "GESH"
+#define GE_SHM_LAYOUT_VERSION		(1)
+
+#ifndef GE_SHM_DEFAULT_NAME
+#define GE_SHM_DEFAULT_NAME			"/ge-rs232"
+#endif
+
+#define GE_SHM_MAX_ZONES			(96)
+#define GE_SHM_MAX_PARTITIONS		(6)
+#define GE_SHM_NAME_LENGTH			(64)
+
+struct ge_shm_zone_state_s {
+	uint32_t version;
+	uint16_t zone_number;	// Zero if the panel hasn't reported the zone.
+	uint8_t partition;
+	uint8_t area;
+	uint8_t group;
+	uint8_t type;
+	uint8_t status;			// GE_RS232_ZONE_STATUS_* bits.
+	uint8_t label_len;
+	int64_t last_tripped;
+	char label[16];			// Panel text tokens, not ASCII.
+};
+
+struct ge_shm_partition_state_s {
+	uint32_t version;
+	uint8_t partition_number;	// Zero if the panel hasn't reported it.
+	uint8_t arming_level;
+	uint16_t armed_by;
+	int64_t arm_date;
+	uint16_t light_state;
+	uint8_t feature_state;
+	uint8_t ready_to_arm;
+	uint8_t touchpad_len;
+	char touchpad[63];		// ASCII, NUL-terminated.
+};
+
+struct ge_shm_zone_s {
+	struct ge_seqlock_s lock;
+	struct ge_shm_zone_state_s state;
+};
+
+struct ge_shm_partition_s {
+	struct ge_seqlock_s lock;
+	struct ge_shm_partition_state_s state;
+};
+
+struct ge_shm_state_s {
+	uint32_t magic;
+	uint16_t layout_version;
+	uint16_t max_zones;
+	uint16_t max_partitions;
+	uint16_t reserved;
+	int32_t writer_pid;
+
+	// Bumped after every batch of updates, so readers can tell cheaply
+	// whether anything changed since they last looked.
+	atomic_uint generation;
+
+	struct ge_shm_zone_s zone[GE_SHM_MAX_ZONES];
+	struct ge_shm_partition_s partition[GE_SHM_MAX_PARTITIONS];
+};
+
+struct ge_shm_s {
+	struct ge_shm_state_s* state;
+	char name[GE_SHM_NAME_LENGTH];
+	bool writer;
+};
+
+typedef struct ge_shm_s* ge_shm_t;
+
+#pragma mark - Writer
+
+// Creates (or takes over) the segment `name`. Returns 0 on success.
+int ge_shm_create(ge_shm_t shm, const char* name);
+
+// Unmaps the segment, and removes it if we created it.
+void ge_shm_close(ge_shm_t shm);
+
+void ge_shm_write_zone(ge_shm_t shm, const struct ge_shm_zone_state_s* zone);
+void ge_shm_write_partition(ge_shm_t shm, const struct ge_shm_partition_state_s* partition);
+
+// Tells readers a batch of writes is complete.
+void ge_shm_commit(ge_shm_t shm);
+
+#pragma mark - Reader
+
+// Maps the segment `name` read-only. Returns 0 on success, or -1 if it
+// doesn't exist or has a layout we don't understand.
+int ge_shm_open(ge_shm_t shm, const char* name);
+
+unsigned ge_shm_generation(ge_shm_t shm);
+
+bool ge_shm_read_zone(ge_shm_t shm, int zonei, struct ge_shm_zone_state_s* zone);
+bool ge_shm_read_partition(ge_shm_t shm, int partitioni, struct ge_shm_partition_state_s* partition);
+
+#endif
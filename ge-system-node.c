@@ -6,6 +6,8 @@
 #include "ge-system-node.h"
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <ctype.h>
 #include <smcp/smcp.h>
 #include <smcp/smcp-node.h>
 #include <smcp/smcp-pairing.h>
@@ -13,26 +15,37 @@
 #include <termios.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#if GE_QUEUE_THREADS
+#include <sched.h>
+#include <sys/eventfd.h>
+#endif
 
 #define GE_RS232_MAX_ZONES				(96)
 #define GE_RS232_MAX_PARTITIONS			(6)
 #define GE_RS232_MAX_SCHEDULES			(16)
 
+// How long to wait for the panel to start streaming back state after
+// we ask for a dynamic data refresh, and how long the stream has to
+// go quiet before we consider the refresh burst to be finished. A burst
+// never lasts longer than GE_REFRESH_MAX_MS from its start, however
+// busy the panel is.
+#define GE_REFRESH_START_TIMEOUT_MS		(5000)
+#define GE_REFRESH_QUIET_MS				(500)
+#define GE_REFRESH_MAX_MS				(15000)
+
+// Seconds a client should wait before retrying when the queue is full.
+#define GE_QUEUE_RETRY_AFTER			(2)
+
 #define USE_SYSLOG		1
 
 #if USE_SYSLOG
 #include <syslog.h>
 #endif
 
-#define LOG_LEVEL_EMERGENCY		(0)
-#define LOG_LEVEL_ALERT		(1)
-#define LOG_LEVEL_CRITICAL	(2)
-#define LOG_LEVEL_ERROR		(3)
-#define LOG_LEVEL_WARNING		(4)
-#define LOG_LEVEL_NOTICE		(5)
-#define LOG_LEVEL_INFO		(6)
-#define LOG_LEVEL_DEBUG		(7)
-
 int current_log_level = LOG_LEVEL_INFO;
 
 void log_msg(int level,const char* format, ...) {
@@ -78,6 +91,30 @@ void log_msg(int level,const char* format, ...) {
 #endif
 }
 
+static uint32_t
+get_time_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint32_t)(ts.tv_sec*1000+ts.tv_nsec/1000000);
+}
+
+static uint64_t
+get_time_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+// True when a serial thread owns the interface and the queue.
+static bool
+ge_serial_is_threaded(ge_system_node_t self) {
+#if GE_QUEUE_THREADS
+	return self->serial_thread.running;
+#else
+	return false;
+#endif
+}
+
 typedef struct {
 	smcp_t smcp;
 	struct smcp_async_response_s async_response;
@@ -100,6 +137,13 @@ resend_async_response(panel_response_context *context) {
 
 	if(context->status == GE_RS232_STATUS_OK) {
         ret = smcp_outbound_begin_response(COAP_RESULT_204_CHANGED);
+	} else if(context->status == GE_SYSTEM_STATUS_UNCONFIRMED) {
+        ret = smcp_outbound_begin_response(COAP_RESULT_504_GATEWAY_TIMEOUT);
+	} else if(context->status == GE_RS232_STATUS_QUEUE_FULL) {
+		// With the serial thread, a full queue is only found once the
+		// request gets there, so it comes back this way rather than
+		// through ge_queue_rejected().
+        ret = smcp_outbound_begin_response(COAP_RESULT_503_SERVICE_UNAVAILABLE);
 	} else {
         ret = smcp_outbound_begin_response(COAP_RESULT_500_INTERNAL_SERVER_ERROR);
 	}
@@ -109,10 +153,17 @@ resend_async_response(panel_response_context *context) {
     ret = smcp_outbound_set_async_response(async_response);
     require_noerr(ret,bail);
 
+	if(context->status == GE_RS232_STATUS_QUEUE_FULL) {
+		ret = smcp_outbound_add_option_uint(COAP_OPTION_MAX_AGE,GE_QUEUE_RETRY_AFTER);
+		require_noerr(ret,bail);
+	}
+
 	if(context->status == GE_RS232_STATUS_NAK)
 		smcp_outbound_set_content_formatted("NAK");
 	else if(context->status == GE_RS232_STATUS_TIMEOUT)
 		smcp_outbound_set_content_formatted("ACK-TIMEOUT");
+	else if(context->status == GE_SYSTEM_STATUS_UNCONFIRMED)
+		smcp_outbound_set_content_formatted("NOT-CONFIRMED");
 
     ret = smcp_outbound_send();
     require_noerr(ret,bail);
@@ -159,6 +210,43 @@ static panel_response_context* new_panel_response_context() {
 	return ret;
 }
 
+// Sends a bare response right away, from inside a variable handler. The
+// returned status tells the variable node not to respond itself.
+static smcp_status_t
+ge_respond_now(coap_code_t code, uint32_t max_age) {
+	smcp_status_t ret = smcp_outbound_begin_response(code);
+	require_noerr(ret,bail);
+
+	if(max_age) {
+		ret = smcp_outbound_add_option_uint(COAP_OPTION_MAX_AGE,max_age);
+		require_noerr(ret,bail);
+	}
+
+	ret = smcp_outbound_send();
+	require_noerr(ret,bail);
+
+	ret = SMCP_STATUS_ASYNC_RESPONSE;	// Already responded.
+
+bail:
+	return ret;
+}
+
+// Handles a request whose message couldn't be queued. A full queue gets
+// a 5.03 with a Max-Age telling the client when to try again; anything
+// else is dropped, as before.
+static smcp_status_t
+ge_queue_rejected(ge_rs232_status_t status, panel_response_context* context) {
+	free(context);
+
+	if(status==GE_RS232_STATUS_QUEUE_FULL) {
+		log_msg(LOG_LEVEL_WARNING,"Outbound queue full, rejecting request");
+		return ge_respond_now(COAP_RESULT_503_SERVICE_UNAVAILABLE,GE_QUEUE_RETRY_AFTER);
+	}
+
+	smcp_outbound_drop();
+	return SMCP_STATUS_FAILURE;
+}
+
 
 static const uint8_t refresh_equipment_msg[] = { GE_RS232_ATP_EQUIP_LIST_REQUEST };
 static const uint8_t dynamic_data_refresh_msg[] = { GE_RS232_ATP_DYNAMIC_DATA_REFRESH };
@@ -178,612 +266,3543 @@ ge_rs232_status_t dynamic_data_refresh(ge_queue_t qinterface,
 }
 
 
+#pragma mark - Keypress encoding
+
+#define GE_KEY_INVALID		(0xFF)
+
+static const uint8_t ge_key_codes[256] = {
+	[0 ... 255] = GE_KEY_INVALID,
+	['0'] = 0x00, ['1'] = 0x01, ['2'] = 0x02, ['3'] = 0x03, ['4'] = 0x04,
+	['5'] = 0x05, ['6'] = 0x06, ['7'] = 0x07, ['8'] = 0x08, ['9'] = 0x09,
+	['*'] = 0x0A, ['#'] = 0x0B,
+	['A'] = 0x2C, ['a'] = 0x2C,
+	['B'] = 0x30, ['b'] = 0x30,
+	['C'] = 0x2D, ['c'] = 0x2D,
+	['D'] = 0x33, ['d'] = 0x33,
+	['E'] = 0x2E, ['e'] = 0x2E,
+	['F'] = 0x36, ['f'] = 0x36,
+};
+
+// Translates a keypress string into panel key codes. Digits, '*', '#'
+// and the letters A-F map to their keys, and "[xx]" gives a raw hex
+// key code. Returns the number of codes written, or -1 on error.
+int
+ge_keypress_encode(const char* keys, uint8_t* codes, uint8_t max_len) {
+	uint8_t len = 0;
+	for(;*keys;keys++) {
+		uint8_t code = ge_key_codes[(uint8_t)*keys];
+		if(*keys=='[') {
+			if(keys[1]==0)
+				continue;
+			const char* start = ++keys;
+			long value = strtol(start,(char**)&keys,16);
+			if(*keys!=']') {
+				log_msg(LOG_LEVEL_WARNING,"send_keypress: '[' without ']'");
+				return -1;
+			}
+			if(keys==start || value<0 || value>0xFF) {
+				log_msg(LOG_LEVEL_WARNING,"send_keypress: bad raw key code \"%.*s\"",(int)(keys-start),start);
+				return -1;
+			}
+			code = value;
+		} else if(code==GE_KEY_INVALID) {
+			log_msg(LOG_LEVEL_WARNING,"send_keypress: bad key code %d '%c'",*keys,*keys);
+			return -1;
+		}
+		if(len==max_len) {
+			log_msg(LOG_LEVEL_WARNING,"send_keypress: too many keys");
+			return -1;
+		}
+		codes[len++] = code;
+	}
+	return len;
+}
+
 ge_rs232_status_t send_keypress(ge_queue_t qinterface,uint8_t partition, uint8_t area, char* keys,
 	void (*finished)(void* context,ge_rs232_status_t status),
 	void* context
 ) {
-	uint8_t msg[50] = {
+	uint8_t msg[GE_RS232_MAX_MESSAGE_SIZE] = {
 		GE_RS232_ATP_KEYPRESS,
 		partition,	// Partition
 		area,	// Area
 	};
-	uint8_t len = 3;
-	for(;*keys;keys++) {
-		uint8_t code = 255;
-		switch(*keys) {
-			case '0':
-			case '1':
-			case '2':
-			case '3':
-			case '4':
-			case '5':
-			case '6':
-			case '7':
-			case '8':
-			case '9':
-				code = *keys - '0';
-				break;
-			case '*':code = 0x0A;break;
-			case '#':code = 0x0B;break;
-			case 'A':case 'a':code = 0x2C;break;
-			case 'B':case 'b':code = 0x30;break;
-			case 'C':case 'c':code = 0x2D;break;
-			case 'D':case 'd':code = 0x33;break;
-			case 'E':case 'e':code = 0x2E;break;
-			case 'F':case 'f':code = 0x36;break;
-			case '[':
-				if(keys[1]!=0) {
-					keys++;
-					code = strtol(keys,&keys,16);
-					if(*keys!=']') {
-						log_msg(LOG_LEVEL_WARNING,"send_keypress: '[' without ']'");
-						return -1;
-					}
-				}
-				break;
-			default:
-				log_msg(LOG_LEVEL_WARNING,"send_keypress: bad key code %d '%c'",*keys,*keys);
-				return -1;
-				break;
+	int len = ge_keypress_encode(keys,msg+3,sizeof(msg)-3);
+	if(len<0)
+		return -1;
+	// Pressing the same keys twice is not the same as pressing them once.
+	return ge_queue_append_message(qinterface,msg,len+3,finished,context);
+}
+
+#pragma mark - Keypress macros
+
+static const struct {
+	uint8_t index;
+	const char* name;
+	const char* keys;
+} ge_builtin_macros[] = {
+	{ GE_MACRO_DISARM, "disarm", "5[20]" },
+	{ GE_MACRO_ARM_STAY, "arm-stay", "5[28]" },
+	{ GE_MACRO_ARM_AWAY, "arm-away", "5[27]" },
+	{ GE_MACRO_CHIME_TOGGLE, "chime-toggle", "71" },
+};
+
+static struct ge_keypress_macro_s*
+ge_keypress_macro_find(struct ge_system_node_s* self, const char* name) {
+	int i;
+	for(i=0;i<self->macro_count;i++) {
+		if(0==strcmp(self->macro[i].name,name))
+			return &self->macro[i];
+	}
+	return NULL;
+}
+
+// Compiles `keys` and stores it under `name`, replacing any macro that
+// already has that name. Built-in macros keep their slot when redefined.
+int
+ge_keypress_macro_define(struct ge_system_node_s* self, const char* name, const char* keys) {
+	struct ge_keypress_macro_s* macro = ge_keypress_macro_find(self,name);
+	uint8_t codes[GE_KEYPRESS_FRAME_MAX_KEYS];
+	int len;
+
+	if(strlen(name)>=sizeof(macro->name)) {
+		log_msg(LOG_LEVEL_WARNING,"Macro name \"%s\" is too long",name);
+		return -1;
+	}
+
+	len = ge_keypress_encode(keys,codes,sizeof(codes));
+	if(len<=0) {
+		log_msg(LOG_LEVEL_WARNING,"Macro \"%s\" has bad keys \"%s\"",name,keys);
+		return -1;
+	}
+
+	if(!macro) {
+		if(self->macro_count==GE_KEYPRESS_MAX_MACROS) {
+			log_msg(LOG_LEVEL_WARNING,"Too many macros, dropping \"%s\"",name);
+			return -1;
 		}
-		if(code==255)
-			continue;
-		msg[len++] = code;
+		macro = &self->macro[self->macro_count++];
+		strcpy(macro->name,name);
 	}
-	return ge_queue_message(qinterface,msg,len,finished,context);
+
+	memcpy(macro->codes,codes,len);
+	macro->len = len;
+
+	return 0;
 }
 
-	enum {
-		PATH_ARM_LEVEL=0,
-		PATH_ARMED_BY,
-		PATH_ARM_DATE,
-		PATH_FS_CHIME,
-		PATH_FS_ENERGY_SAVER,
-		PATH_FS_NO_DELAY,
-		PATH_FS_LATCHKEY,
-		PATH_FS_SILENT_ARMING,
-		PATH_FS_QUICK_ARM,
-//		PATH_TEXT,
-		PATH_TOUCHPAD_TEXT,
-		PATH_KEYPRESS,
-		PATH_REFRESH_EQUIPMENT,
-		PATH_DDR,
-//		PATH_ENTRY_DELAY_REMAINING,
-//		PATH_EXIT_DELAY_REMAINING,
-		PATH_LIGHT_ALL,
-		PATH_LIGHT_1,
-		PATH_LIGHT_2,
-		PATH_LIGHT_3,
-		PATH_LIGHT_4,
-		PATH_LIGHT_5,
-		PATH_LIGHT_6,
-		PATH_LIGHT_7,
-		PATH_LIGHT_8,
-		PATH_LIGHT_9,
+// Reads macro definitions from a file, one "<name> <keys>" per line.
+// Blank lines and lines starting with ';' are ignored. Bad lines are
+// logged and skipped. Returns the number of macros defined, or -1 if
+// the file couldn't be opened.
+int
+ge_keypress_macro_load(struct ge_system_node_s* self, const char* path) {
+	FILE* file = fopen(path,"r");
+	char line[128];
+	int line_number = 0;
+	int count = 0;
+
+	if(!file)
+		return -1;
 
-		PATH_COUNT,
+	while(fgets(line,sizeof(line),file)) {
+		char name[GE_KEYPRESS_MACRO_NAME_LENGTH];
+		char keys[96];
+		int fields;
+
+		line_number++;
+
+		fields = sscanf(line," %23s %95s",name,keys);
+		if(fields<=0 || name[0]==';')
+			continue;
+
+		if(fields!=2) {
+			log_msg(LOG_LEVEL_WARNING,"%s:%d: Expected \"<name> <keys>\"",path,line_number);
+			continue;
+		}
+
+		if(0==ge_keypress_macro_define(self,name,keys))
+			count++;
+	}
+
+	fclose(file);
+
+	log_msg(LOG_LEVEL_INFO,"Loaded %d keypress macros from \"%s\"",count,path);
+
+	return count;
+}
+
+static ge_rs232_status_t
+ge_keypress_macro_queue(struct ge_system_node_s* self, uint8_t partition, const struct ge_keypress_macro_s* macro, bool coalesce,
+	void (*finished)(void* context,ge_rs232_status_t status),
+	void* context
+) {
+	uint8_t msg[GE_RS232_MAX_MESSAGE_SIZE] = {
+		GE_RS232_ATP_KEYPRESS,
+		partition,	// Partition
+		0,	// Area
 	};
+	memcpy(msg+3,macro->codes,macro->len);
 
+	if(coalesce)
+		return ge_queue_message(&self->qinterface,msg,macro->len+3,finished,context);
+	return ge_queue_append_message(&self->qinterface,msg,macro->len+3,finished,context);
+}
 
-static smcp_status_t
-partition_node_var_func(
-	struct ge_partition_s *node,
-	uint8_t action,
-	uint8_t path,
-	char* value
+// Sends the macro as raw keypresses. Sending one twice can mean
+// something different from sending it once (chime-toggle, for one), so
+// every call queues its own frame.
+ge_rs232_status_t
+ge_keypress_macro_send(struct ge_system_node_s* self, uint8_t partition, const struct ge_keypress_macro_s* macro,
+	void (*finished)(void* context,ge_rs232_status_t status),
+	void* context
 ) {
-	smcp_status_t ret = 0;
+	return ge_keypress_macro_queue(self,partition,macro,false,finished,context);
+}
 
-	if(path>=PATH_COUNT) {
-		ret = SMCP_STATUS_NOT_FOUND;
-	} else if(action==SMCP_VAR_GET_KEY) {
-		static const char* path_names[] = {
-			"arm-level",
-			"armed-by",
-			"arm-date",
-			"chime",
-			"energy-saver",
-			"no-delay",
-			"latchkey",
-			"silent-arming",
-			"quick-arm",
-//			"text",
-			"touchpad-text",
-			"keypress",
-			"refresh-equipment",
-			"ddr",
-//			"entry-delay-remaining",
-//			"exit-delay-remaining",
-			"light-all",
-			"light-1",
-			"light-2",
-			"light-3",
-			"light-4",
-			"light-5",
-			"light-6",
-			"light-7",
-			"light-8",
-			"light-9",
-		};
-		strcpy(value,path_names[path]);
-	} else if(action==SMCP_VAR_GET_LF_TITLE) {
-		if(path==PATH_ARM_LEVEL) {
-			const char *arm_level[] = {
-				[0]="ZONE-TEST",
-				[1]="DISARMED",
-				[2]="STAY",
-				[3]="AWAY",
-				[4]="NIGHT",
-				[5]="SILENT",
-			};
-			if(node->arming_level<sizeof(arm_level)/sizeof(*arm_level)-1) {
-				strncpy(value,arm_level[node->arming_level],SMCP_VARIABLE_MAX_VALUE_LENGTH);
-			} else {
-				ret = SMCP_STATUS_NOT_ALLOWED;
-			}
-		} else if(path==PATH_ARMED_BY) {
-			ge_user_to_cstr(value,node->armed_by);
-		} else {
-			ret = SMCP_STATUS_NOT_ALLOWED;
-		}
-	} else if(action==SMCP_VAR_GET_MAX_AGE) {
-		int v = 0;
-		switch(path) {
-			case PATH_TOUCHPAD_TEXT:
-				v = (node->arming_level<=1)?60:240;
-				break;
-			case PATH_ARM_LEVEL:
-			case PATH_ARMED_BY:
-			case PATH_ARM_DATE:
-			case PATH_FS_CHIME:
-			case PATH_FS_ENERGY_SAVER:
-			case PATH_FS_NO_DELAY:
-			case PATH_FS_LATCHKEY:
-			case PATH_FS_SILENT_ARMING:
-			case PATH_FS_QUICK_ARM:
-			case PATH_LIGHT_ALL:
-			case PATH_LIGHT_1:
-			case PATH_LIGHT_2:
-			case PATH_LIGHT_3:
-			case PATH_LIGHT_4:
-			case PATH_LIGHT_5:
-			case PATH_LIGHT_6:
-			case PATH_LIGHT_7:
-			case PATH_LIGHT_8:
-			case PATH_LIGHT_9:
-				v = 3600;
-				break;
-			default:
-				ret = SMCP_STATUS_NOT_ALLOWED;
-				break;
-		}
-		if(v) {
-			sprintf(value,"%d",v);
-		} else {
-			ret = SMCP_STATUS_NOT_ALLOWED;
-		}
-	} else if(action==SMCP_VAR_GET_OBSERVABLE) {
-		switch(path) {
-			case PATH_TOUCHPAD_TEXT:
-			case PATH_ARM_LEVEL:
-			case PATH_ARMED_BY:
-			case PATH_ARM_DATE:
-			case PATH_FS_CHIME:
-			case PATH_FS_ENERGY_SAVER:
-			case PATH_FS_NO_DELAY:
-			case PATH_FS_LATCHKEY:
-			case PATH_FS_SILENT_ARMING:
-			case PATH_FS_QUICK_ARM:
-			case PATH_LIGHT_ALL:
-			case PATH_LIGHT_1:
-			case PATH_LIGHT_2:
-			case PATH_LIGHT_3:
-			case PATH_LIGHT_4:
-			case PATH_LIGHT_5:
-			case PATH_LIGHT_6:
-			case PATH_LIGHT_7:
-			case PATH_LIGHT_8:
-			case PATH_LIGHT_9:
-				ret = SMCP_STATUS_OK;
-				break;
-			default:
-				ret = SMCP_STATUS_NOT_ALLOWED;
-				break;
-		}
-	} else if(action==SMCP_VAR_GET_VALUE) {
-		if(path==PATH_TOUCHPAD_TEXT) {
-			// Just send the ascii for now.
-			int i = 0;
-			value[0]=0;
-			strcpy(value,ge_text_to_ascii(node->touchpad_lcd,node->touchpad_lcd_len));
-
-/*
-			for(;i<node->touchpad_lcd_len;i++) {
-				const char* str = ge_rs232_text_token_lookup[node->touchpad_lcd[i]];
-
-				if(str) {
-					strlcat(value,str,SMCP_VARIABLE_MAX_VALUE_LENGTH);
-				}
-			}
-*/
-/*
-		} else if(path==PATH_TEXT) {
-			// Just send the ascii for now.
-			int i = 0;
-			value[0]=0;
-			for(;i<node->label_len;i++) {
-				const char* str = ge_rs232_text_token_lookup[node->label[i]];
-
-				if(str) {
-					strlcat(value,str,SMCP_VARIABLE_MAX_VALUE_LENGTH);
-				}
-			}
-*/
-		} else {
-			int v = 0;
-
-			if(path==PATH_ARM_LEVEL)
-				v = node->arming_level;
-			else if(path>=PATH_LIGHT_ALL && path<=PATH_LIGHT_9)
-				v = !!(node->light_state & (1<<(path-PATH_LIGHT_ALL)));
-			else if(path==PATH_ARM_DATE)
-				v = node->arm_date;
-			else if(path==PATH_ARMED_BY)
-				v = node->armed_by;
-			else if(path==PATH_FS_CHIME)
-				v = !!(node->feature_state & (1<<0));
-			else if(path==PATH_FS_ENERGY_SAVER)
-				v = !!(node->feature_state & (1<<1));
-			else if(path==PATH_FS_NO_DELAY)
-				v = !!(node->feature_state & (1<<2));
-			else if(path==PATH_FS_LATCHKEY)
-				v = !!(node->feature_state & (1<<3));
-			else if(path==PATH_FS_SILENT_ARMING)
-				v = !!(node->feature_state & (1<<4));
-			else if(path==PATH_FS_QUICK_ARM)
-				v = !!(node->feature_state & (1<<5));
-			else
-				ret = SMCP_STATUS_NOT_ALLOWED;
-			sprintf(value,"%d",v);
-		}
-	} else if(action==SMCP_VAR_SET_VALUE) {
-		if(path==PATH_ARM_LEVEL) {
-			struct ge_system_node_s* system_state=(struct ge_system_node_s*)node->node.node.parent;
-			if((node->arming_level)==atoi(value)) {
-				// arm level already set!
-				ret = SMCP_STATUS_OK;
-			} else {
-				switch(atoi(value)) {
-					case 1:
-						send_keypress(&system_state->qinterface,node->partition_number,0,"5[20]",&got_panel_response,new_panel_response_context());
-						ret = SMCP_STATUS_ASYNC_RESPONSE;
-						break;
-					case 2:
-						send_keypress(&system_state->qinterface,node->partition_number,0,"5[28]",&got_panel_response,new_panel_response_context());
-						ret = SMCP_STATUS_ASYNC_RESPONSE;
-						break;
-					case 3:
-						send_keypress(&system_state->qinterface,node->partition_number,0,"5[27]",&got_panel_response,new_panel_response_context());
-						ret = SMCP_STATUS_ASYNC_RESPONSE;
-						break;
-					default:
-						log_msg(LOG_LEVEL_WARNING,"Bad arming level \"%s\"",value);
-						return SMCP_STATUS_FAILURE;
-				}
-//				ret = smcp_start_async_response(&system_state->async_response,0);
-//				require_noerr(ret,bail);
-//				system_state->interface.response_context = system_state;
-//				system_state->interface.got_response=(void*)&got_panel_response;
-//				ret = SMCP_STATUS_ASYNC_RESPONSE;
-//			} else {
-//				smcp_outbound_drop();
-//				log_msg(LOG_LEVEL_WARNING,"Too busy to set arming level. Dropping packet.");
-//				ret = SMCP_STATUS_FAILURE;
-			}
-		} else if(path>=PATH_LIGHT_ALL && path<=PATH_LIGHT_9) {
-			struct ge_system_node_s* system_state=(struct ge_system_node_s*)node->node.node.parent;
-			char cmd[] = { '[','1','1'-!!atoi(value),']','0'+path-PATH_LIGHT_ALL,0};
-			if(!!(node->light_state & (1<<(path-PATH_LIGHT_ALL)))==atoi(value)) {
-				// Light already set!
-				ret = SMCP_STATUS_OK;
-			} else if(0== send_keypress(&system_state->qinterface,node->partition_number,0,cmd,&got_panel_response,new_panel_response_context())) {
-//				ret = smcp_start_async_response(&system_state->async_response,0);
-//				require_noerr(ret,bail);
-//				system_state->interface.response_context = system_state;
-//				system_state->interface.got_response=(void*)&got_panel_response;
-				ret = SMCP_STATUS_ASYNC_RESPONSE;
-			} else {
-				log_msg(LOG_LEVEL_WARNING,"Too busy to change light. Dropping packet.");
-				smcp_outbound_drop();
-				ret = SMCP_STATUS_FAILURE;
-			}
-		} else if(path==PATH_FS_CHIME) {
-			struct ge_system_node_s* system_state=(struct ge_system_node_s*)node->node.node.parent;
-			if((node->feature_state & (1<<0))==atoi(value)) {
-				// Chime already set!
-				ret = SMCP_STATUS_OK;
-			} else if(0== send_keypress(&system_state->qinterface,node->partition_number,0,"71",&got_panel_response,new_panel_response_context())) {
-//				ret = smcp_start_async_response(&system_state->async_response,0);
-//				require_noerr(ret,bail);
-//				system_state->interface.response_context = system_state;
-//				system_state->interface.got_response=(void*)&got_panel_response;
-				ret = SMCP_STATUS_ASYNC_RESPONSE;
-			} else {
-				log_msg(LOG_LEVEL_WARNING,"Too busy to set chime. Dropping packet.");
-				smcp_outbound_drop();
-				ret = SMCP_STATUS_FAILURE;
-			}
-		} else if(path==PATH_REFRESH_EQUIPMENT) {
-			struct ge_system_node_s* system_state=(struct ge_system_node_s*)node->node.node.parent;
-			if(GE_RS232_STATUS_OK!=ge_queue_message(&system_state->qinterface,refresh_equipment_msg,sizeof(refresh_equipment_msg),&got_panel_response,new_panel_response_context()))
-				ret = SMCP_STATUS_FAILURE;
-			else
-				ret = SMCP_STATUS_ASYNC_RESPONSE;
-//			if(!system_state->interface.got_response) {
-//				ret = smcp_start_async_response(&system_state->async_response,0);
-//				require_noerr(ret,bail);
-//				system_state->interface.response_context = system_state;
-//				system_state->interface.got_response=(void*)&got_panel_response;
-				ret = SMCP_STATUS_ASYNC_RESPONSE;
-//			}
-		} else if(path==PATH_KEYPRESS) {
-			struct ge_system_node_s* system_state=(struct ge_system_node_s*)node->node.node.parent;
-			if(0 == send_keypress(&system_state->qinterface,node->partition_number,0,value,&got_panel_response,new_panel_response_context())) {
-//				ret = smcp_start_async_response(&system_state->async_response,0);
-//				require_noerr(ret,bail);
-//				system_state->interface.response_context = system_state;
-//				system_state->interface.got_response=(void*)&got_panel_response;
-				ret = SMCP_STATUS_ASYNC_RESPONSE;
-			} else {
-				log_msg(LOG_LEVEL_WARNING,"Too busy to send keypresses. Dropping packet.");
-				smcp_outbound_drop();
-				ret = SMCP_STATUS_FAILURE;
-			}
-		} else if(path==PATH_DDR) {
-			struct ge_system_node_s* system_state=(struct ge_system_node_s*)node->node.node.parent;
-			if(GE_RS232_STATUS_OK!=ge_queue_message(&system_state->qinterface,dynamic_data_refresh_msg,sizeof(dynamic_data_refresh_msg),&got_panel_response,new_panel_response_context()))
-				ret = SMCP_STATUS_FAILURE;
-			else
-				ret = SMCP_STATUS_ASYNC_RESPONSE;
-
-//			if(!system_state->interface.got_response) {
-//				dynamic_data_refresh(&system_state->interface);
-//				ret = smcp_start_async_response(&system_state->async_response,0);
-//				require_noerr(ret,bail);
-//				system_state->interface.response_context = system_state;
-//				system_state->interface.got_response=(void*)&got_panel_response;
-//				ret = SMCP_STATUS_ASYNC_RESPONSE;
-//			} else {
-//				log_msg(LOG_LEVEL_WARNING,"Too busy to send dynamic data refresh. Dropping packet.");
-//				smcp_outbound_drop();
-//				ret = SMCP_STATUS_FAILURE;
-//			}
-		} else {
-			ret = SMCP_STATUS_NOT_ALLOWED;
+static void
+ge_keypress_macro_init(struct ge_system_node_s* self) {
+	int i;
+
+	self->macro_count = GE_MACRO_BUILTIN_COUNT;
+	for(i=0;i<sizeof(ge_builtin_macros)/sizeof(*ge_builtin_macros);i++) {
+		struct ge_keypress_macro_s* macro = &self->macro[ge_builtin_macros[i].index];
+		strcpy(macro->name,ge_builtin_macros[i].name);
+		macro->len = ge_keypress_encode(ge_builtin_macros[i].keys,macro->codes,sizeof(macro->codes));
+	}
+
+	ge_keypress_macro_load(self,GE_KEYPRESS_MACRO_FILE);
+}
+
+#pragma mark - Group commands
+
+struct ge_keypress_group_s {
+	uint8_t remaining;
+	ge_rs232_status_t status;
+	void (*finished)(void* context,ge_rs232_status_t status);
+	void* context;
+};
+
+void
+ge_keypress_batch_init(ge_keypress_batch_t batch, uint8_t partition, uint8_t area) {
+	memset(batch,0,sizeof(*batch));
+	batch->partition = partition;
+	batch->area = area;
+}
+
+// Appends one keypress sequence to the batch. A sequence is never
+// split across frames, so that another command can't land in the
+// middle of it.
+int
+ge_keypress_batch_add_codes(ge_keypress_batch_t batch, const uint8_t* codes, uint8_t len) {
+	uint8_t* frame;
+
+	if(!len)
+		return 0;
+
+	// A group of codes never straddles two frames.
+	if(len>GE_KEYPRESS_FRAME_MAX_KEYS) {
+		log_msg(LOG_LEVEL_WARNING,"ge_keypress_batch_add: %d keys won't fit in one frame",len);
+		return -1;
+	}
+
+	if(!batch->frame_count
+		|| batch->frame_len[batch->frame_count-1]+len>GE_RS232_MAX_MESSAGE_SIZE
+	) {
+		if(batch->frame_count==GE_KEYPRESS_BATCH_MAX_FRAMES) {
+			log_msg(LOG_LEVEL_WARNING,"ge_keypress_batch_add: batch is full");
+			return -1;
 		}
-	} else {
-		ret = SMCP_STATUS_NOT_IMPLEMENTED;
+		frame = batch->frame[batch->frame_count];
+		frame[0] = GE_RS232_ATP_KEYPRESS;
+		frame[1] = batch->partition;
+		frame[2] = batch->area;
+		batch->frame_len[batch->frame_count++] = 3;
 	}
-bail:
-	return ret;
+
+	frame = batch->frame[batch->frame_count-1];
+	memcpy(frame+batch->frame_len[batch->frame_count-1],codes,len);
+	batch->frame_len[batch->frame_count-1] += len;
+
+	return 0;
 }
 
-	enum {
-		PATH_PARTITION=0,
-		PATH_AREA,
-		PATH_GROUP,
-		PATH_TYPE,
-		PATH_TEXT,
-		PATH_LAST_TRIPPED,
-		PATH_STATUS_TRIPPED,
-		PATH_STATUS_FAULT,
-		PATH_STATUS_ALARM,
-		PATH_STATUS_TROUBLE,
-		PATH_STATUS_BYPASS,
+int
+ge_keypress_batch_add(ge_keypress_batch_t batch, const char* keys) {
+	uint8_t codes[GE_KEYPRESS_FRAME_MAX_KEYS];
+	int len = ge_keypress_encode(keys,codes,sizeof(codes));
 
-		PATH_ZONE_COUNT,
-	};
+	if(len<0)
+		return len;
 
-static smcp_status_t
-zone_node_var_func(
-	struct ge_zone_s *node,
-	uint8_t action,
-	uint8_t path,
-	char* value
+	return ge_keypress_batch_add_codes(batch,codes,len);
+}
+
+static void
+ge_keypress_group_frame_finished(void* c, ge_rs232_status_t status) {
+	struct ge_keypress_group_s* group = c;
+
+	if(status!=GE_RS232_STATUS_OK && group->status==GE_RS232_STATUS_OK)
+		group->status = status;
+
+	if(--group->remaining)
+		return;
+
+	if(group->finished)
+		(*group->finished)(group->context,group->status);
+
+	free(group);
+}
+
+// Queues every frame of the batch. `finished` is called once, after
+// the last frame, with the first failure if any frame failed.
+ge_rs232_status_t
+ge_keypress_batch_send(ge_queue_t qinterface, ge_keypress_batch_t batch,
+	void (*finished)(void* context,ge_rs232_status_t status),
+	void* context
 ) {
-	smcp_status_t ret = 0;
+	ge_rs232_status_t status = GE_RS232_STATUS_OK;
+	struct ge_keypress_group_s* group;
+	int i;
 
-	if(path>=PATH_ZONE_COUNT) {
-		ret = SMCP_STATUS_NOT_FOUND;
-	} else if(action==SMCP_VAR_GET_KEY) {
-		static const char* path_names[] = {
-			"pn",
-			"an",
-			"gn",
-			"zt",
-			"text",
-			"last-tripped",
-			"zs.tripped",
-			"zs.fault",
-			"zs.alarm",
-			"zs.trouble",
-			"zs.bypass",
-		};
-		strcpy(value,path_names[path]);
-	} else if(action==SMCP_VAR_GET_MAX_AGE) {
-		int v = 0;
-		switch(path) {
-			case PATH_PARTITION:
-			case PATH_AREA:
-			case PATH_GROUP:
-			case PATH_TYPE:
-			case PATH_TEXT:
-				v = 3600;
-				break;
-			case PATH_LAST_TRIPPED:
-			case PATH_STATUS_TRIPPED:
-			case PATH_STATUS_FAULT:
-			case PATH_STATUS_ALARM:
-			case PATH_STATUS_TROUBLE:
-			case PATH_STATUS_BYPASS:
-				v = 60*5;
-				break;
-			default:
-				ret = SMCP_STATUS_NOT_ALLOWED;
-				break;
-		}
-		if(v) {
-			sprintf(value,"%d",v);
-		} else {
-			ret = SMCP_STATUS_NOT_ALLOWED;
-		}
-	} else if(action==SMCP_VAR_GET_OBSERVABLE) {
-		switch(path) {
-			case PATH_LAST_TRIPPED:
-			case PATH_STATUS_TRIPPED:
-			case PATH_STATUS_FAULT:
-			case PATH_STATUS_ALARM:
-			case PATH_STATUS_TROUBLE:
-			case PATH_STATUS_BYPASS:
-				ret = SMCP_STATUS_OK;
-				break;
-			default:
-				ret = SMCP_STATUS_NOT_ALLOWED;
-				break;
-		}
-	} else if(action==SMCP_VAR_GET_VALUE) {
-		if(path==PATH_TEXT) {
-			// Just send the ascii for now.
-			int i = 0;
-			value[0]=0;
-			for(;i<node->label_len;i++) {
-				const char* str = ge_rs232_text_token_lookup[node->label[i]];
-
-				if(str) {
-					strlcat(value,str,SMCP_VARIABLE_MAX_VALUE_LENGTH);
-				}
-			}
-		} else {
-			int v = 0;
-			if(path==PATH_PARTITION)
-				v = node->partition;
-			else if(path==PATH_AREA)
-				v = node->area;
-			else if(path==PATH_GROUP)
-				v = node->group;
-			else if(path==PATH_TYPE)
-				v = node->type;
-			else if(path==PATH_LAST_TRIPPED)
-				v = node->last_tripped;
-			else if(path==PATH_STATUS_TRIPPED)
-				v = !!(node->status & GE_RS232_ZONE_STATUS_TRIPPED);
-			else if(path==PATH_STATUS_TROUBLE)
-				v = !!(node->status & GE_RS232_ZONE_STATUS_TROUBLE);
-			else if(path==PATH_STATUS_FAULT)
-				v = !!(node->status & GE_RS232_ZONE_STATUS_FAULT);
-			else if(path==PATH_STATUS_BYPASS)
-				v = !!(node->status & GE_RS232_ZONE_STATUS_BYPASSED);
-			else if(path==PATH_STATUS_ALARM)
-				v = !!(node->status & GE_RS232_ZONE_STATUS_ALARM);
-			sprintf(value,"%d",v);
+	if(!batch->frame_count) {
+		if(finished)
+			(*finished)(context,GE_RS232_STATUS_OK);
+		return GE_RS232_STATUS_OK;
+	}
+
+	// Keypress frames are never merged with an earlier message, so a
+	// repeated request is pressed again.
+	if(batch->frame_count==1)
+		return ge_queue_append_message(qinterface,batch->frame[0],batch->frame_len[0],finished,context);
+
+	group = calloc(1,sizeof(*group));
+	if(!group)
+		return GE_RS232_STATUS_ERROR;
+
+	group->remaining = batch->frame_count;
+	group->finished = finished;
+	group->context = context;
+
+	for(i=0;i<batch->frame_count;i++) {
+		// Frames of a batch must go out in order, so never merge them
+		// into an earlier message.
+		status = ge_queue_append_message(qinterface,batch->frame[i],batch->frame_len[i],&ge_keypress_group_frame_finished,group);
+		if(status!=GE_RS232_STATUS_OK)
+			break;
+	}
+
+	if(i<batch->frame_count) {
+		// Frames that made it into the queue still report back, and
+		// the last of them reports the failure.
+		group->remaining -= batch->frame_count-i;
+		group->status = status;
+		if(!group->remaining) {
+			free(group);
+			return status;
 		}
+	}
+
+	return GE_RS232_STATUS_OK;
+}
+
+// Switches the lights in `mask` (bit 0 is "all", bits 1-9 are the
+// individual lights) on or off, skipping lights already in that state.
+int
+ge_partition_set_lights(ge_keypress_batch_t batch, struct ge_partition_s* partition, uint16_t mask, bool on) {
+	uint16_t todo = mask&(on?~partition->light_state:partition->light_state)&0x3FF;
+
+	while(todo) {
+		const uint8_t codes[] = { on?0x10:0x11, __builtin_ctz(todo) };
+		if(ge_keypress_batch_add_codes(batch,codes,sizeof(codes)))
+			return -1;
+		todo &= todo-1;
+	}
+	return 0;
+}
+
+// Bypasses (or un-bypasses) the given zones. Bypass is a toggle on the
+// panel, so zones already in the requested state are left alone.
+int
+ge_partition_bypass_zones(ge_keypress_batch_t batch, struct ge_partition_s* partition, const uint32_t* zones, bool bypass) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)partition->node.node.parent;
+	const char* code = self->system_code;
+	int i;
+
+	if(!code[0]) {
+		log_msg(LOG_LEVEL_WARNING,"Can't bypass zones without a system code");
+		return -1;
+	}
+
+	for(i=0;i<GE_ZONE_SET_WORDS;i++) {
+		uint32_t todo = zones[i]
+			& partition->zones[i]
+			& (bypass?~self->zone_sets[GE_ZONE_SET_BYPASSED][i]:self->zone_sets[GE_ZONE_SET_BYPASSED][i]);
+
+		while(todo) {
+			char cmd[16];
+			snprintf(cmd,sizeof(cmd),"#%s%02d",code,i*32+__builtin_ctz(todo)+1);
+			if(ge_keypress_batch_add(batch,cmd))
+				return -1;
+			todo &= todo-1;
+		}
+	}
+	return 0;
+}
+
+// Bypasses every open zone of the partition that belongs to `group`.
+int
+ge_partition_bypass_open_group(ge_keypress_batch_t batch, struct ge_partition_s* partition, uint8_t group) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)partition->node.node.parent;
+	uint32_t zones[GE_ZONE_SET_WORDS] = { };
+	int i;
+
+	for(i=0;i<GE_RS232_MAX_ZONES;i++) {
+		if(self->zone[i].node.node.parent && self->zone[i].group==group)
+			zones[i/32] |= (1u<<(i%32));
+	}
+
+	for(i=0;i<GE_ZONE_SET_WORDS;i++)
+		zones[i] &= self->zone_sets[GE_ZONE_SET_TRIPPED][i];
+
+	return ge_partition_bypass_zones(batch,partition,zones,true);
+}
+
+#pragma mark - Rules
+
+static const char* const ge_rule_day_names[] = {
+	"sun", "mon", "tue", "wed", "thu", "fri", "sat",
+};
+
+static const struct {
+	const char* name;
+	uint8_t bit;
+} ge_rule_zone_statuses[] = {
+	{ "tripped", GE_RS232_ZONE_STATUS_TRIPPED },
+	{ "fault", GE_RS232_ZONE_STATUS_FAULT },
+	{ "alarm", GE_RS232_ZONE_STATUS_ALARM },
+	{ "trouble", GE_RS232_ZONE_STATUS_TROUBLE },
+	{ "bypassed", GE_RS232_ZONE_STATUS_BYPASSED },
+};
+
+static int
+ge_rule_parse_days(const char* text, uint8_t* days) {
+	char copy[32];
+	char* saveptr;
+	char* day;
+	int i;
+
+	*days = 0;
+
+	if(0==strcmp(text,"*")) {
+		*days = 0x7F;
+		return 0;
+	}
+
+	snprintf(copy,sizeof(copy),"%s",text);
+	for(day=strtok_r(copy,",",&saveptr);day;day=strtok_r(NULL,",",&saveptr)) {
+		for(i=0;i<7 && 0!=strcasecmp(day,ge_rule_day_names[i]);i++)
+			;
+		if(i==7)
+			return -1;
+		*days |= 1<<i;
+	}
+
+	return *days?0:-1;
+}
+
+static int
+ge_rule_parse_window(const char* text, uint16_t* start, uint16_t* end) {
+	unsigned start_hour, start_min, end_hour, end_min;
+
+	if(4!=sscanf(text,"%u:%u-%u:%u",&start_hour,&start_min,&end_hour,&end_min)
+		|| start_min>59 || end_min>59
+		|| start_hour*60+start_min>=end_hour*60+end_min
+		|| end_hour*60+end_min>24*60
+	) {
+		return -1;
+	}
+
+	*start = start_hour*60+start_min;
+	*end = end_hour*60+end_min;
+	return 0;
+}
+
+// Parses a comma-separated list of numbers from `min` to `max` into a
+// bit set, one bit per number.
+static int
+ge_rule_parse_numbers(const char* text, int min, int max, uint32_t* set) {
+	char copy[96];
+	char* saveptr;
+	char* item;
+	char* end;
+
+	snprintf(copy,sizeof(copy),"%s",text);
+	for(item=strtok_r(copy,",",&saveptr);item;item=strtok_r(NULL,",",&saveptr)) {
+		long n = strtol(item,&end,10);
+		if(*end || n<min || n>max)
+			return -1;
+		set[(n-min)/32] |= 1u<<((n-min)%32);
+	}
+	return 0;
+}
+
+static int
+ge_rule_parse_number(const char* text, int min, int max) {
+	char* end;
+	long n;
+
+	if(!text)
+		return -1;
+	n = strtol(text,&end,10);
+	if(*end || n<min || n>max)
+		return -1;
+	return (int)n;
+}
+
+// Compiles `text` ("if <terms> then <action>") and stores it under
+// `name`, replacing any rule that already has that name.
+int
+ge_rule_define(struct ge_system_node_s* self, const char* name, const char* text) {
+	struct ge_rules_s* rules = &self->rules;
+	struct ge_rule_s rule = { .state = -1 };
+	char copy[192];
+	char* word[32];
+	char* saveptr;
+	int count = 0;
+	int i = 0;
+	int n;
+	int slot;
+
+	if(strlen(name)>=sizeof(rule.name)) {
+		log_msg(LOG_LEVEL_WARNING,"Rule name \"%s\" is too long",name);
+		return -1;
+	}
+	strcpy(rule.name,name);
+
+	snprintf(copy,sizeof(copy),"%s",text);
+	word[0] = strtok_r(copy," \t\r\n",&saveptr);
+	while(word[count] && count<sizeof(word)/sizeof(*word)-1)
+		word[++count] = strtok_r(NULL," \t\r\n",&saveptr);
+	word[count] = NULL;
+
+	require(count && 0==strcmp(word[i++],"if"), bad);
+
+	for(;;) {
+		struct ge_rule_term_s* term = &rule.term[rule.term_count];
+
+		require(rule.term_count<GE_RULE_MAX_TERMS && word[i], bad);
+
+		if(0==strcmp(word[i],"not")) {
+			term->negate = true;
+			i++;
+			require(word[i], bad);
+		}
+
+		if(0==strcmp(word[i],"armed") || 0==strcmp(word[i],"disarmed")) {
+			term->type = (word[i][0]=='a')?GE_RULE_TERM_ARMED:GE_RULE_TERM_DISARMED;
+			n = ge_rule_parse_number(word[i+1],1,GE_RS232_MAX_PARTITIONS);
+			require(n>0, bad);
+			term->number = n;
+			i += 2;
+		} else if(0==strcmp(word[i],"zone")) {
+			term->type = GE_RULE_TERM_ZONE;
+			n = ge_rule_parse_number(word[i+1],1,GE_RS232_MAX_ZONES);
+			require(n>0 && word[i+2], bad);
+			term->number = n;
+			for(n=0;n<sizeof(ge_rule_zone_statuses)/sizeof(*ge_rule_zone_statuses);n++) {
+				if(0==strcmp(word[i+2],ge_rule_zone_statuses[n].name))
+					term->status = ge_rule_zone_statuses[n].bit;
+			}
+			require(term->status, bad);
+			i += 3;
+		} else if(0==strcmp(word[i],"time")) {
+			term->type = GE_RULE_TERM_TIME;
+			require(word[i+1] && word[i+2], bad);
+			require(0==ge_rule_parse_days(word[i+1],&term->days), bad);
+			require(0==ge_rule_parse_window(word[i+2],&term->start,&term->end), bad);
+			i += 3;
+		} else {
+			goto bad;
+		}
+
+		rule.term_count++;
+
+		if(!word[i] || 0!=strcmp(word[i],"and"))
+			break;
+		i++;
+	}
+
+	require(word[i] && 0==strcmp(word[i],"then") && word[i+1], bad);
+	i++;
+
+	if(0==strcmp(word[i],"bypass")) {
+		rule.action = GE_RULE_ACTION_BYPASS;
+		require(word[i+1] && !word[i+2], bad);
+		require(0==ge_rule_parse_numbers(word[i+1],1,GE_RS232_MAX_ZONES,rule.zones), bad);
+	} else if(0==strcmp(word[i],"light")) {
+		uint32_t lights = 0;
+		rule.action = GE_RULE_ACTION_LIGHT;
+		n = ge_rule_parse_number(word[i+1],1,GE_RS232_MAX_PARTITIONS);
+		require(n>0 && word[i+2] && !word[i+3], bad);
+		rule.partition = n;
+		require(0==ge_rule_parse_numbers(word[i+2],0,9,&lights), bad);
+		rule.lights = lights;
+	} else if(0==strcmp(word[i],"macro")) {
+		struct ge_keypress_macro_s* macro;
+		rule.action = GE_RULE_ACTION_MACRO;
+		n = ge_rule_parse_number(word[i+1],1,GE_RS232_MAX_PARTITIONS);
+		require(n>0 && word[i+2] && !word[i+3], bad);
+		rule.partition = n;
+		macro = ge_keypress_macro_find(self,word[i+2]);
+		require_action(macro, bail,
+			log_msg(LOG_LEVEL_WARNING,"Rule \"%s\" uses unknown macro \"%s\"",name,word[i+2])
+		);
+		rule.macro = macro-self->macro;
+	} else {
+		goto bad;
+	}
+
+	for(slot=0;slot<rules->count && 0!=strcmp(rules->rule[slot].name,name);slot++)
+		;
+	if(slot==rules->count) {
+		require_action(rules->count<GE_RULES_MAX, bail,
+			log_msg(LOG_LEVEL_WARNING,"Too many rules, dropping \"%s\"",name)
+		);
+		rules->count++;
+	}
+	rules->rule[slot] = rule;
+	rules->dirty |= 1u<<slot;
+	rules->failed &= ~(1u<<slot);
+
+	// Rebuild the input index from scratch, since a replaced rule may
+	// have read different inputs.
+	memset(rules->partition_rules,0,sizeof(rules->partition_rules));
+	memset(rules->zone_rules,0,sizeof(rules->zone_rules));
+	memset(rules->zone_bypass_rules,0,sizeof(rules->zone_bypass_rules));
+	rules->time_rules = 0;
+	rules->bypass_rules = 0;
+
+	for(n=0;n<rules->count;n++) {
+		uint16_t bit = 1u<<n;
+		for(i=0;i<rules->rule[n].term_count;i++) {
+			const struct ge_rule_term_s* term = &rules->rule[n].term[i];
+			if(term->type==GE_RULE_TERM_ZONE)
+				rules->zone_rules[term->number-1] |= bit;
+			else if(term->type==GE_RULE_TERM_TIME)
+				rules->time_rules |= bit;
+			else
+				rules->partition_rules[term->number-1] |= bit;
+		}
+		if(rules->rule[n].action==GE_RULE_ACTION_BYPASS) {
+			rules->bypass_rules |= bit;
+			for(i=0;i<GE_RS232_MAX_ZONES;i++) {
+				if(rules->rule[n].zones[i/32]&(1u<<(i%32)))
+					rules->zone_bypass_rules[i] |= bit;
+			}
+		}
+	}
+
+	return 0;
+
+bad:
+	log_msg(LOG_LEVEL_WARNING,"Rule \"%s\" doesn't parse: \"%s\"",name,text);
+bail:
+	return -1;
+}
+
+// Reads rules from a file, one "<name> if ... then ..." per line. Blank
+// lines and lines starting with ';' are ignored. Bad lines are logged
+// and skipped. Returns the number of rules defined, or -1 if the file
+// couldn't be opened.
+int
+ge_rules_load(struct ge_system_node_s* self, const char* path) {
+	FILE* file = fopen(path,"r");
+	char line[192];
+	int line_number = 0;
+	int count = 0;
+
+	if(!file)
+		return -1;
+
+	while(fgets(line,sizeof(line),file)) {
+		char name[GE_RULE_NAME_LENGTH];
+		int offset = 0;
+
+		line_number++;
+		line[strcspn(line,"\r\n")] = 0;
+
+		if(sscanf(line," %23s %n",name,&offset)<=0 || name[0]==';')
+			continue;
+
+		if(!offset || !line[offset]) {
+			log_msg(LOG_LEVEL_WARNING,"%s:%d: Expected \"<name> if ... then ...\"",path,line_number);
+			continue;
+		}
+
+		if(0==ge_rule_define(self,name,line+offset))
+			count++;
+	}
+
+	fclose(file);
+
+	log_msg(LOG_LEVEL_INFO,"Loaded %d rules from \"%s\"",count,path);
+
+	return count;
+}
+
+// Whether a time term holds at `now`, and when it next changes.
+static bool
+ge_rule_time_term(const struct ge_rule_term_s* term, time_t now, const struct tm* local, time_t* boundary) {
+	int minute = local->tm_hour*60+local->tm_min;
+	int day, i;
+
+	// Only runs when a rule with a time term is evaluated, so a plain
+	// search of the coming week is cheap enough.
+	for(day=0;day<=7;day++) {
+		if(!(term->days&(1<<((local->tm_wday+day)%7))))
+			continue;
+
+		for(i=0;i<2;i++) {
+			struct tm tm = *local;
+			int when = i?term->end:term->start;
+			time_t t;
+
+			tm.tm_mday += day;
+			tm.tm_hour = when/60;
+			tm.tm_min = when%60;
+			tm.tm_sec = 0;
+			tm.tm_isdst = -1;
+			t = mktime(&tm);
+
+			if(t>now && (!*boundary || t<*boundary))
+				*boundary = t;
+		}
+	}
+
+	return (term->days&(1<<local->tm_wday)) && minute>=term->start && minute<term->end;
+}
+
+static bool
+ge_rule_evaluate(struct ge_system_node_s* self, struct ge_rule_s* rule, time_t now, const struct tm* local) {
+	bool ret = true;
+	int i;
+
+	rule->next_boundary = 0;
+
+	for(i=0;i<rule->term_count;i++) {
+		const struct ge_rule_term_s* term = &rule->term[i];
+		bool value = false;
+
+		switch(term->type) {
+			case GE_RULE_TERM_ARMED:
+				value = self->partition[term->number-1].arming_level>=2;
+				break;
+			case GE_RULE_TERM_DISARMED:
+				value = self->partition[term->number-1].arming_level==1;
+				break;
+			case GE_RULE_TERM_ZONE:
+				value = !!(self->zone[term->number-1].status&term->status);
+				break;
+			case GE_RULE_TERM_TIME:
+				value = ge_rule_time_term(term,now,local,&rule->next_boundary);
+				break;
+		}
+
+		// Keep going even once the answer is known, so every time term
+		// gets to report its next boundary.
+		if(value==term->negate)
+			ret = false;
+	}
+
+	return ret;
+}
+
+static void
+ge_rules_retry(struct ge_system_node_s* self, uint16_t bits) {
+	self->rules.failed |= bits;
+	if(!ge_timer_is_scheduled(&self->rules_retry_timer))
+		ge_timer_schedule(&self->timers,&self->rules_retry_timer,get_time_ms()+GE_RULE_RETRY_MS);
+}
+
+static void
+ge_rules_retry_due(void* context, ge_timer_t timer) {
+	struct ge_system_node_s* self = context;
+
+	self->rules.dirty |= self->rules.failed;
+}
+
+// Tracks the frames one rule action queued, which may be for several
+// partitions. `remaining` holds one extra count while they are queued.
+struct ge_rule_action_s {
+	struct ge_system_node_s* self;
+	uint16_t bit;
+	uint8_t remaining;
+	ge_rs232_status_t status;
+};
+
+static void
+ge_rule_action_finished(void* context, ge_rs232_status_t status) {
+	struct ge_rule_action_s* action = context;
+	struct ge_system_node_s* self = action->self;
+
+	if(status!=GE_RS232_STATUS_OK && action->status==GE_RS232_STATUS_OK)
+		action->status = status;
+
+	if(--action->remaining)
+		return;
+
+	self->rules.acting &= ~action->bit;
+
+	if(action->status!=GE_RS232_STATUS_OK) {
+		log_msg(LOG_LEVEL_WARNING,"[RULE] Action failed (%d), retrying in %ds",action->status,GE_RULE_RETRY_MS/1000);
+		ge_rules_retry(self,action->bit);
+	}
+
+	free(action);
+}
+
+static void
+ge_rule_action_send(struct ge_rule_action_s* action, ge_keypress_batch_t batch) {
+	ge_rs232_status_t status;
+
+	if(!batch->frame_count)
+		return;
+
+	action->remaining++;
+	status = ge_keypress_batch_send(&action->self->qinterface,batch,&ge_rule_action_finished,action);
+	if(status!=GE_RS232_STATUS_OK)
+		ge_rule_action_finished(action,status);
+}
+
+// Queues whatever it takes to bring the panel in line with `value`.
+// Failures, whether the queue turns the frames away or the panel NAKs
+// them, are retried through ge_rules_retry().
+static void
+ge_rule_act(struct ge_system_node_s* self, const struct ge_rule_s* rule, uint16_t bit, bool value) {
+	struct ge_rule_action_s* action;
+	struct ge_keypress_batch_s batch;
+	struct ge_partition_s* partition;
+	ge_rs232_status_t status;
+	int i;
+
+	action = calloc(1,sizeof(*action));
+	if(!action) {
+		ge_rules_retry(self,bit);
+		return;
+	}
+
+	action->self = self;
+	action->bit = bit;
+	action->remaining = 1;
+	self->rules.acting |= bit;
+
+	switch(rule->action) {
+		case GE_RULE_ACTION_BYPASS:
+			// Bypass is a toggle, and a partition being disarmed clears
+			// it, so only touch armed partitions. That includes the
+			// undo: a rule that stops holding because the partition was
+			// disarmed must not bypass the zones again. A partition
+			// being armed, or the system code turning up, runs the
+			// rule again.
+			for(i=0;i<GE_RS232_MAX_PARTITIONS;i++) {
+				partition = &self->partition[i];
+				if(!partition->node.node.parent || partition->arming_level<2)
+					continue;
+				ge_keypress_batch_init(&batch,partition->partition_number,0);
+				if(0==ge_partition_bypass_zones(&batch,partition,rule->zones,value))
+					ge_rule_action_send(action,&batch);
+			}
+			break;
+		case GE_RULE_ACTION_LIGHT:
+			partition = ge_get_partition(self,rule->partition);
+			ge_keypress_batch_init(&batch,rule->partition,0);
+			if(partition && 0==ge_partition_set_lights(&batch,partition,rule->lights,value))
+				ge_rule_action_send(action,&batch);
+			break;
+		case GE_RULE_ACTION_MACRO:
+			if(value) {
+				action->remaining++;
+				status = ge_keypress_macro_send(self,rule->partition,&self->macro[rule->macro],&ge_rule_action_finished,action);
+				if(status!=GE_RS232_STATUS_OK)
+					ge_rule_action_finished(action,status);
+			}
+			break;
+	}
+
+	ge_rule_action_finished(action,GE_RS232_STATUS_OK);
+}
+
+static void
+ge_rules_zone_changed(struct ge_system_node_s* self, uint8_t zonei, uint8_t changed) {
+	if(zonei && zonei<=GE_RS232_MAX_ZONES) {
+		self->rules.dirty |= self->rules.zone_rules[zonei-1];
+		if(changed&GE_RS232_ZONE_STATUS_BYPASSED)
+			self->rules.dirty |= self->rules.zone_bypass_rules[zonei-1];
+	}
+}
+
+// Bypass rules act on every armed partition, so they are re-run when
+// any partition changes.
+static void
+ge_rules_partition_changed(struct ge_system_node_s* self, uint8_t partitioni) {
+	if(partitioni && partitioni<=GE_RS232_MAX_PARTITIONS)
+		self->rules.dirty |= self->rules.partition_rules[partitioni-1]|self->rules.bypass_rules;
+}
+
+// Re-evaluates the rules whose inputs changed or whose time windows
+// opened or closed, and acts on any whose outcome changed.
+static void
+ge_rules_run(struct ge_system_node_s* self) {
+	struct ge_rules_s* rules = &self->rules;
+	time_t now;
+	struct tm local;
+	time_t next_boundary = 0;
+	int i;
+
+	// During a refresh burst the committed state, zone bypasses
+	// included, may be stale. The commit marks whatever changed.
+	if(!rules->dirty || self->refresh.active)
+		return;
+
+	now = time(NULL);
+	if(rules->dirty&rules->time_rules)
+		localtime_r(&now,&local);
+
+	while(rules->dirty) {
+		uint16_t bit = rules->dirty&-rules->dirty;
+		struct ge_rule_s* rule = &rules->rule[__builtin_ctz(bit)];
+		bool value;
+		bool act;
+
+		rules->dirty &= ~bit;
+		self->stats.rule_evaluations++;
+
+		value = ge_rule_evaluate(self,rule,now,&local);
+
+		// Nothing to undo the first time round.
+		act = rule->state!=value && (rule->state>=0 || value);
+		if(act) {
+			log_msg(LOG_LEVEL_NOTICE,"[RULE] %s: %s",rule->name,value?"on":"off");
+			self->stats.rules_fired++;
+		}
+
+		// A failed action is tried again, and a bypass rule keeps its
+		// zones bypassed for as long as it holds, like the panel state
+		// it reads.
+		if((rules->failed&bit) || (value && rule->action==GE_RULE_ACTION_BYPASS))
+			act = true;
+
+		if(!act) {
+			// Nothing to do.
+		} else if(rules->acting&bit) {
+			// The zone and light state doesn't show the last action
+			// yet, and a bypass is a toggle, so acting now could undo
+			// it. Look again later.
+			ge_rules_retry(self,bit);
+		} else {
+			rules->failed &= ~bit;
+			ge_rule_act(self,rule,bit,value);
+		}
+		rule->state = value;
+	}
+
+	for(i=0;i<rules->count;i++) {
+		time_t boundary = rules->rule[i].next_boundary;
+		if(boundary && (!next_boundary || boundary<next_boundary))
+			next_boundary = boundary;
+	}
+
+	if(next_boundary) {
+		time_t remaining = next_boundary-now;
+		if(remaining<0)
+			remaining = 0;
+		ge_timer_schedule(&self->timers,&self->rules_timer,get_time_ms()+(uint32_t)remaining*1000);
+	} else {
+		ge_timer_cancel(&self->rules_timer);
+	}
+}
+
+static void
+ge_rules_boundary(void* context, ge_timer_t timer) {
+	struct ge_system_node_s* self = context;
+
+	self->rules.dirty |= self->rules.time_rules;
+}
+
+#pragma mark - Pending commands
+
+static void
+ge_pending_release(struct ge_pending_s* pending) {
+	if(pending->acked && pending->resolved)
+		pending->active = false;
+}
+
+static void
+ge_pending_resolve(struct ge_pending_s* pending, ge_rs232_status_t status) {
+	if(pending->resolved)
+		return;
+	pending->resolved = true;
+	ge_timer_cancel(&pending->timer);
+	if(pending->finished)
+		(*pending->finished)(pending->context,status);
+	ge_pending_release(pending);
+}
+
+static void
+ge_pending_acked(void* c, ge_rs232_status_t status) {
+	struct ge_pending_s* pending = c;
+
+	pending->acked = true;
+
+	// An ACK only means the panel got the keys. Keep waiting for the
+	// state change unless the frame didn't make it.
+	if(status!=GE_RS232_STATUS_OK)
+		ge_pending_resolve(pending,status);
+
+	ge_pending_release(pending);
+}
+
+static void
+ge_pending_expired(void* context, ge_timer_t timer) {
+	struct ge_system_node_s* self = context;
+	struct ge_pending_s* pending = (struct ge_pending_s*)((char*)timer-offsetof(struct ge_pending_s,timer));
+
+	log_msg(LOG_LEVEL_WARNING,"Command not confirmed by panel (kind %d, partition %d)",pending->kind,pending->partition);
+	self->unconfirmed[pending->kind]++;
+	ge_pending_resolve(pending,GE_SYSTEM_STATUS_UNCONFIRMED);
+}
+
+// Arranges for a command's completion to be delayed until the panel
+// reports state where (value&mask)==expected, or until the confirmation
+// timeout. On success, `finished` and `context` are replaced with the
+// pair to hand to the queue. If the table is full, they are left alone
+// and the command completes on ACK as before.
+struct ge_pending_s*
+ge_pending_expect(
+	struct ge_system_node_s* self,
+	uint8_t kind,
+	uint8_t partition,
+	uint16_t mask,
+	uint16_t expected,
+	void (**finished)(void* context,ge_rs232_status_t status),
+	void** context
+) {
+	struct ge_pending_s* pending = NULL;
+	int i;
+
+	for(i=0;i<GE_PENDING_MAX_COMMANDS;i++) {
+		if(!self->pending[i].active) {
+			pending = &self->pending[i];
+			break;
+		}
+	}
+
+	if(!pending) {
+		log_msg(LOG_LEVEL_WARNING,"Pending command table full, completing on ACK");
+		return NULL;
+	}
+
+	memset(pending,0,sizeof(*pending));
+	pending->active = true;
+	pending->kind = kind;
+	pending->partition = partition;
+	pending->mask = mask;
+	pending->expected = expected;
+	pending->start = get_time_ms();
+	pending->finished = *finished;
+	pending->context = *context;
+
+	ge_timer_init(&pending->timer,&ge_pending_expired,self);
+	ge_timer_schedule(&self->timers,&pending->timer,pending->start+GE_PENDING_CONFIRM_TIMEOUT_MS);
+
+	*finished = &ge_pending_acked;
+	*context = pending;
+
+	return pending;
+}
+
+// Whether a command meant to bring about the same state is already on
+// its way and not yet confirmed.
+static bool
+ge_pending_is_outstanding(struct ge_system_node_s* self, uint8_t kind, uint8_t partition, uint16_t mask, uint16_t expected) {
+	int i;
+
+	for(i=0;i<GE_PENDING_MAX_COMMANDS;i++) {
+		const struct ge_pending_s* pending = &self->pending[i];
+		if(pending->active
+			&& !pending->resolved
+			&& pending->kind==kind
+			&& pending->partition==partition
+			&& pending->mask==mask
+			&& pending->expected==expected
+		) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Used when the command couldn't be queued, so no ACK will ever come.
+void
+ge_pending_cancel(struct ge_pending_s* pending) {
+	if(pending) {
+		ge_timer_cancel(&pending->timer);
+		pending->active = false;
+	}
+}
+
+static void
+ge_pending_confirm(struct ge_system_node_s* self, uint8_t kind, uint8_t partition, uint16_t value) {
+	uint32_t now = get_time_ms();
+	int i;
+
+	for(i=0;i<GE_PENDING_MAX_COMMANDS;i++) {
+		struct ge_pending_s* pending = &self->pending[i];
+		uint32_t latency;
+		int bucket = 0;
+
+		if(!pending->active
+			|| pending->resolved
+			|| pending->kind!=kind
+			|| pending->partition!=partition
+			|| (value&pending->mask)!=pending->expected
+		) {
+			continue;
+		}
+
+		latency = now-pending->start;
+		while(latency>>bucket && bucket<GE_LATENCY_BUCKETS-1)
+			bucket++;
+		self->latency[kind][bucket]++;
+
+		ge_pending_resolve(pending,GE_RS232_STATUS_OK);
+	}
+}
+
+static void ge_refresh_begin(struct ge_system_node_s *self);
+
+#pragma mark - Value cache
+
+static bool
+ge_value_cache_get(struct ge_value_cache_s* cache, uint8_t path, bool is_text, char* value) {
+	if(!(cache->valid&(1u<<path)))
+		return false;
+	if(is_text && cache->text_path!=path)
+		return false;
+	if(is_text)
+		memcpy(value,cache->text,cache->text_len+1);
+	else
+		memcpy(value,cache->slot[path],GE_VALUE_CACHE_SLOT_LENGTH);
+	return true;
+}
+
+static void
+ge_value_cache_put(struct ge_value_cache_s* cache, uint8_t path, bool is_text, const char* value) {
+	size_t len = strlen(value);
+	if(is_text) {
+		if(len>=sizeof(cache->text))
+			return;
+		if(cache->text_path!=path)
+			cache->valid &= ~(1u<<cache->text_path);
+		memcpy(cache->text,value,len+1);
+		cache->text_len = len;
+		cache->text_path = path;
+	} else {
+		if(len>=GE_VALUE_CACHE_SLOT_LENGTH)
+			return;
+		memcpy(cache->slot[path],value,len+1);
+	}
+	cache->valid |= (1u<<path);
+}
+
+static void
+ge_value_cache_invalidate(struct ge_value_cache_s* cache, uint8_t path) {
+	cache->valid &= ~(1u<<path);
+}
+
+#pragma mark - Variable descriptors
+
+#define GE_VAR_FLAG_OBSERVABLE		(1<<0)
+#define GE_VAR_FLAG_TEXT			(1<<1)	// Long value, cached in the text buffer.
+#define GE_VAR_FLAG_VALUE_SUFFIX	(1<<2)	// Notifications carry "v=<value>".
+
+// Fails to compile if the field lies beyond what the offset can hold.
+#define GE_VAR_OFFSET(type,field)	(offsetof(type,field)+0*sizeof(struct { \
+		_Static_assert(offsetof(type,field)<=UINT32_MAX,"GE_VAR_FIELD offset out of range"); \
+		int unused; \
+	}))
+
+#define GE_VAR_FIELD(type,field)	.offset = GE_VAR_OFFSET(type,field), .width = sizeof(((type*)0)->field)
+
+// Handlers are consulted first for every action except SMCP_VAR_GET_KEY
+// and SMCP_VAR_GET_OBSERVABLE. Returning SMCP_STATUS_NOT_IMPLEMENTED
+// falls back to the generic behavior described by the descriptor.
+typedef smcp_status_t (*ge_var_handler_t)(void* entity, uint8_t action, uint8_t path, char* value);
+
+struct ge_var_desc_s {
+	const char* name;
+	uint32_t offset;
+	uint8_t width;
+	uint32_t mask;
+	uint16_t max_age;
+	uint16_t min_interval_ms;
+	uint8_t flags;
+	ge_var_handler_t handler;
+};
+
+static int64_t
+ge_var_read_field(const void* entity, const struct ge_var_desc_s* desc) {
+	const uint8_t* ptr = (const uint8_t*)entity+desc->offset;
+	int64_t v = 0;
+
+	switch(desc->width) {
+		case 1: v = *(const uint8_t*)ptr; break;
+		case 2: v = *(const uint16_t*)ptr; break;
+		case 4: v = *(const uint32_t*)ptr; break;
+		case 8: v = *(const int64_t*)ptr; break;
+	}
+
+	if(desc->mask)
+		v = !!(v&desc->mask);
+
+	return v;
+}
+
+static smcp_status_t
+ge_var_node_func(
+	void* entity,
+	struct ge_value_cache_s* cache,
+	uint32_t version,
+	const struct ge_var_desc_s* table,
+	uint8_t count,
+	uint8_t action,
+	uint8_t path,
+	char* value
+) {
+	smcp_status_t ret = SMCP_STATUS_NOT_IMPLEMENTED;
+	const struct ge_var_desc_s* desc;
+
+	if(path>=count)
+		return SMCP_STATUS_NOT_FOUND;
+
+	desc = &table[path];
+
+	if(action==SMCP_VAR_GET_KEY) {
+		strcpy(value,desc->name);
+		return SMCP_STATUS_OK;
+	}
+
+	if(action==SMCP_VAR_GET_OBSERVABLE)
+		return (desc->flags&GE_VAR_FLAG_OBSERVABLE)?SMCP_STATUS_OK:SMCP_STATUS_NOT_ALLOWED;
+
+	if(action==SMCP_VAR_GET_ETAG) {
+		sprintf(value,"%u",version);
+		return SMCP_STATUS_OK;
+	}
+
+	if(action==SMCP_VAR_GET_VALUE
+		&& cache
+		&& ge_value_cache_get(cache,path,!!(desc->flags&GE_VAR_FLAG_TEXT),value)
+	) {
+		return SMCP_STATUS_OK;
+	}
+
+	if(desc->handler)
+		ret = (*desc->handler)(entity,action,path,value);
+
+	if(ret==SMCP_STATUS_NOT_IMPLEMENTED) {
+		switch(action) {
+			case SMCP_VAR_GET_VALUE:
+				if(desc->width) {
+					sprintf(value,"%lld",(long long)ge_var_read_field(entity,desc));
+					ret = SMCP_STATUS_OK;
+				} else {
+					ret = SMCP_STATUS_NOT_ALLOWED;
+				}
+				break;
+			case SMCP_VAR_GET_MAX_AGE:
+				if(desc->max_age) {
+					sprintf(value,"%d",desc->max_age);
+					ret = SMCP_STATUS_OK;
+				} else {
+					ret = SMCP_STATUS_NOT_ALLOWED;
+				}
+				break;
+			case SMCP_VAR_GET_LF_TITLE:
+			case SMCP_VAR_SET_VALUE:
+				ret = SMCP_STATUS_NOT_ALLOWED;
+				break;
+		}
+	}
+
+	if(action==SMCP_VAR_GET_VALUE && ret==SMCP_STATUS_OK && cache)
+		ge_value_cache_put(cache,path,!!(desc->flags&GE_VAR_FLAG_TEXT),value);
+
+	return ret;
+}
+
+static bool
+ge_inbound_has_etag(uint32_t etag) {
+	coap_option_key_t key;
+	const uint8_t* value;
+	size_t len;
+	bool ret = false;
+
+	while((key = smcp_inbound_next_option(&value,&len))!=COAP_OPTION_INVALID) {
+		uint32_t tag = 0;
+		if(key!=COAP_OPTION_ETAG || len>4)
+			continue;
+		while(len--)
+			tag = (tag<<8)+*value++;
+		if(tag==etag) {
+			ret = true;
+			break;
+		}
+	}
+
+	smcp_inbound_reset_next_option();
+
+	return ret;
+}
+
+static bool
+ge_inbound_last_path_is(const char* name) {
+	coap_option_key_t key;
+	const uint8_t* value;
+	size_t len;
+	const uint8_t* last = NULL;
+	size_t last_len = 0;
+
+	while((key = smcp_inbound_next_option(&value,&len))!=COAP_OPTION_INVALID) {
+		if(key!=COAP_OPTION_URI_PATH)
+			continue;
+		last = value;
+		last_len = len;
+	}
+
+	smcp_inbound_reset_next_option();
+
+	return last
+		&& last_len==strlen(name)
+		&& 0==memcmp(last,name,last_len);
+}
+
+// A GET carrying an ETag that matches the entity's current version gets
+// a bare 2.03 Valid, without formatting anything. Everything else is
+// handled by the regular variable node handler.
+static smcp_status_t
+ge_conditional_request_handler(
+	smcp_variable_node_t node,
+	smcp_method_t method,
+	uint32_t version
+) {
+	smcp_status_t ret = 0;
+
+	if(method!=COAP_METHOD_GET || !ge_inbound_has_etag(version))
+		return smcp_variable_node_request_handler(node,method);
+
+	ret = smcp_outbound_begin_response(COAP_RESULT_203_VALID);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_add_option_uint(COAP_OPTION_ETAG,version);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_send();
+
+bail:
+	return ret;
+}
+
+#pragma mark - Partition variables
+
+	enum {
+		PATH_ARM_LEVEL=0,
+		PATH_ARMED_BY,
+		PATH_ARM_DATE,
+		PATH_FS_CHIME,
+		PATH_FS_ENERGY_SAVER,
+		PATH_FS_NO_DELAY,
+		PATH_FS_LATCHKEY,
+		PATH_FS_SILENT_ARMING,
+		PATH_FS_QUICK_ARM,
+		PATH_TOUCHPAD_TEXT,
+		PATH_KEYPRESS,
+		PATH_REFRESH_EQUIPMENT,
+		PATH_DDR,
+		PATH_LIGHT_ALL,
+		PATH_LIGHT_1,
+		PATH_LIGHT_2,
+		PATH_LIGHT_3,
+		PATH_LIGHT_4,
+		PATH_LIGHT_5,
+		PATH_LIGHT_6,
+		PATH_LIGHT_7,
+		PATH_LIGHT_8,
+		PATH_LIGHT_9,
+		PATH_READY_TO_ARM,
+		PATH_BLOCKING_ZONES,
+		PATH_LIGHTS_ON,
+		PATH_LIGHTS_OFF,
+		PATH_BYPASS_GROUP,
+		PATH_MACRO,
+
+		PATH_COUNT,
+	};
+
+// Sends `macro` to bring the partition to a state, completing once the
+// panel reports (state&mask)==expected. These macros are toggles or
+// sequences whose effect depends on the state when they land, so a
+// request for a state that is already on its way waits for that command
+// instead of sending another, and identical frames still in the queue
+// are merged.
+static smcp_status_t
+ge_partition_request_state(struct ge_partition_s *node, uint8_t kind, uint16_t mask, uint16_t expected, const struct ge_keypress_macro_s* macro) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)node->node.node.parent;
+	void (*finished)(void*,ge_rs232_status_t) = &got_panel_response;
+	panel_response_context* response = new_panel_response_context();
+	void* context = response;
+	bool outstanding = ge_pending_is_outstanding(self,kind,node->partition_number,mask,expected);
+	struct ge_pending_s* pending = ge_pending_expect(self,kind,node->partition_number,mask,expected,&finished,&context);
+	ge_rs232_status_t status;
+
+	if(outstanding && pending) {
+		// Nothing of ours goes out, so there's no ACK to wait for.
+		pending->acked = true;
+		return SMCP_STATUS_ASYNC_RESPONSE;
+	}
+
+	status = ge_keypress_macro_queue(self,node->partition_number,macro,true,finished,context);
+	if(status!=GE_RS232_STATUS_OK) {
+		ge_pending_cancel(pending);
+		return ge_queue_rejected(status,response);
+	}
+
+	return SMCP_STATUS_ASYNC_RESPONSE;
+}
+
+static smcp_status_t
+partition_arm_level_handler(struct ge_partition_s *node, uint8_t action, uint8_t path, char* value) {
+	smcp_status_t ret = SMCP_STATUS_NOT_IMPLEMENTED;
+	struct ge_system_node_s* system_state=(struct ge_system_node_s*)node->node.node.parent;
+
+	if(action==SMCP_VAR_GET_LF_TITLE) {
+		const char *arm_level[] = {
+			[0]="ZONE-TEST",
+			[1]="DISARMED",
+			[2]="STAY",
+			[3]="AWAY",
+			[4]="NIGHT",
+			[5]="SILENT",
+		};
+		if(node->arming_level<sizeof(arm_level)/sizeof(*arm_level)-1) {
+			strncpy(value,arm_level[node->arming_level],SMCP_VARIABLE_MAX_VALUE_LENGTH);
+			ret = SMCP_STATUS_OK;
+		} else {
+			ret = SMCP_STATUS_NOT_ALLOWED;
+		}
+	} else if(action==SMCP_VAR_SET_VALUE) {
+		if((node->arming_level)==atoi(value)) {
+			// arm level already set!
+			ret = SMCP_STATUS_OK;
+		} else {
+			switch(atoi(value)) {
+				case 2:
+				case 3:
+					if(!node->ready_to_arm) {
+						// The panel would refuse anyway, don't wait for it.
+						log_msg(LOG_LEVEL_WARNING,"Not arming partition %d, %d open, %d faulted, %d in trouble",
+							node->partition_number,
+							node->open_count,
+							node->fault_count,
+							node->trouble_count
+						);
+						ret = ge_respond_now(COAP_RESULT_412_PRECONDITION_FAILED,0);
+						break;
+					}
+					// Fall through.
+				case 1:
+				{
+					static const uint8_t macros[] = { [1] = GE_MACRO_DISARM, [2] = GE_MACRO_ARM_STAY, [3] = GE_MACRO_ARM_AWAY };
+					ret = ge_partition_request_state(node,GE_PENDING_ARM,0xFF,atoi(value),&system_state->macro[macros[atoi(value)]]);
+					break;
+				}
+				default:
+					log_msg(LOG_LEVEL_WARNING,"Bad arming level \"%s\"",value);
+					ret = SMCP_STATUS_FAILURE;
+					break;
+			}
+		}
+	}
+	return ret;
+}
+
+static smcp_status_t
+partition_armed_by_handler(struct ge_partition_s *node, uint8_t action, uint8_t path, char* value) {
+	if(action==SMCP_VAR_GET_LF_TITLE) {
+		ge_user_to_cstr(value,node->armed_by);
+		return SMCP_STATUS_OK;
+	}
+	return SMCP_STATUS_NOT_IMPLEMENTED;
+}
+
+static smcp_status_t
+partition_chime_handler(struct ge_partition_s *node, uint8_t action, uint8_t path, char* value) {
+	smcp_status_t ret = SMCP_STATUS_NOT_IMPLEMENTED;
+	struct ge_system_node_s* system_state=(struct ge_system_node_s*)node->node.node.parent;
+
+	if(action==SMCP_VAR_SET_VALUE) {
+		if((node->feature_state & (1<<0))==atoi(value)) {
+			// Chime already set!
+			return SMCP_STATUS_OK;
+		}
+
+		ret = ge_partition_request_state(node,GE_PENDING_FEATURES,(1<<0),!!atoi(value),&system_state->macro[GE_MACRO_CHIME_TOGGLE]);
+	}
+	return ret;
+}
+
+static smcp_status_t
+partition_touchpad_text_handler(struct ge_partition_s *node, uint8_t action, uint8_t path, char* value) {
+	smcp_status_t ret = SMCP_STATUS_NOT_IMPLEMENTED;
+
+	if(action==SMCP_VAR_GET_VALUE) {
+		// Just send the ascii for now.
+		ge_text_to_ascii(value,SMCP_VARIABLE_MAX_VALUE_LENGTH+1,(const uint8_t*)node->touchpad_lcd,node->touchpad_lcd_len);
+		ret = SMCP_STATUS_OK;
+	} else if(action==SMCP_VAR_GET_MAX_AGE) {
+		sprintf(value,"%d",(node->arming_level<=1)?60:240);
+		ret = SMCP_STATUS_OK;
+	}
+	return ret;
+}
+
+static smcp_status_t
+partition_keypress_handler(struct ge_partition_s *node, uint8_t action, uint8_t path, char* value) {
+	smcp_status_t ret = SMCP_STATUS_NOT_IMPLEMENTED;
+	struct ge_system_node_s* system_state=(struct ge_system_node_s*)node->node.node.parent;
+
+	if(action==SMCP_VAR_SET_VALUE) {
+		panel_response_context* response = new_panel_response_context();
+		ge_rs232_status_t status = send_keypress(&system_state->qinterface,node->partition_number,0,value,&got_panel_response,response);
+		if(status==GE_RS232_STATUS_OK)
+			ret = SMCP_STATUS_ASYNC_RESPONSE;
+		else
+			ret = ge_queue_rejected(status,response);
+	}
+	return ret;
+}
+
+static smcp_status_t
+partition_refresh_equipment_handler(struct ge_partition_s *node, uint8_t action, uint8_t path, char* value) {
+	smcp_status_t ret = SMCP_STATUS_NOT_IMPLEMENTED;
+	struct ge_system_node_s* system_state=(struct ge_system_node_s*)node->node.node.parent;
+
+	if(action==SMCP_VAR_SET_VALUE) {
+		panel_response_context* response = new_panel_response_context();
+		ge_rs232_status_t status = ge_queue_message(&system_state->qinterface,refresh_equipment_msg,sizeof(refresh_equipment_msg),&got_panel_response,response);
+		if(status==GE_RS232_STATUS_OK)
+			ret = SMCP_STATUS_ASYNC_RESPONSE;
+		else
+			ret = ge_queue_rejected(status,response);
+	}
+	return ret;
+}
+
+static smcp_status_t
+partition_ddr_handler(struct ge_partition_s *node, uint8_t action, uint8_t path, char* value) {
+	smcp_status_t ret = SMCP_STATUS_NOT_IMPLEMENTED;
+	struct ge_system_node_s* system_state=(struct ge_system_node_s*)node->node.node.parent;
+
+	if(action==SMCP_VAR_SET_VALUE) {
+		panel_response_context* response = new_panel_response_context();
+		ge_rs232_status_t status = ge_queue_message(&system_state->qinterface,dynamic_data_refresh_msg,sizeof(dynamic_data_refresh_msg),&got_panel_response,response);
+		if(status==GE_RS232_STATUS_OK) {
+			ge_refresh_begin(system_state);
+			ret = SMCP_STATUS_ASYNC_RESPONSE;
+		} else {
+			ret = ge_queue_rejected(status,response);
+		}
+	}
+	return ret;
+}
+
+// Sends a batch on behalf of a request. With a non-zero mask, the
+// response waits until the panel reports that the lights in the mask
+// match `expected`.
+static smcp_status_t
+ge_partition_send_batch(struct ge_partition_s *node, ge_keypress_batch_t batch, uint16_t mask, uint16_t expected) {
+	struct ge_system_node_s* system_state=(struct ge_system_node_s*)node->node.node.parent;
+	void (*finished)(void*,ge_rs232_status_t) = &got_panel_response;
+	panel_response_context* response;
+	void* context;
+	struct ge_pending_s* pending = NULL;
+	ge_rs232_status_t status;
+
+	if(!batch->frame_count)
+		return SMCP_STATUS_OK;
+
+	context = response = new_panel_response_context();
+
+	if(mask)
+		pending = ge_pending_expect(system_state,GE_PENDING_LIGHTS,node->partition_number,mask,expected,&finished,&context);
+
+	status = ge_keypress_batch_send(&system_state->qinterface,batch,finished,context);
+	if(status!=GE_RS232_STATUS_OK) {
+		ge_pending_cancel(pending);
+		return ge_queue_rejected(status,response);
+	}
+
+	return SMCP_STATUS_ASYNC_RESPONSE;
+}
+
+// Light 0 switches all the lights, and isn't reported back as a state
+// of its own, so only individual lights are confirmed.
+static smcp_status_t
+partition_light_handler(struct ge_partition_s *node, uint8_t action, uint8_t path, char* value) {
+	smcp_status_t ret = SMCP_STATUS_NOT_IMPLEMENTED;
+
+	if(action==SMCP_VAR_SET_VALUE) {
+		struct ge_keypress_batch_s batch;
+		uint16_t mask = 1<<(path-PATH_LIGHT_ALL);
+		bool on = !!atoi(value);
+		ge_keypress_batch_init(&batch,node->partition_number,0);
+		ge_partition_set_lights(&batch,node,mask,on);
+		mask &= ~1;
+		ret = ge_partition_send_batch(node,&batch,mask,on?mask:0);
+	}
+	return ret;
+}
+
+static smcp_status_t
+partition_blocking_zones_handler(struct ge_partition_s *node, uint8_t action, uint8_t path, char* value) {
+	struct ge_system_node_s* system_state=(struct ge_system_node_s*)node->node.node.parent;
+	const uint32_t (*sets)[GE_ZONE_SET_WORDS] = system_state->zone_sets;
+	size_t len = 0;
+	int i;
+
+	if(action!=SMCP_VAR_GET_VALUE)
+		return SMCP_STATUS_NOT_IMPLEMENTED;
+
+	value[0] = 0;
+
+	for(i=0;i<GE_ZONE_SET_WORDS;i++) {
+		uint32_t word = node->zones[i]
+			& ~sets[GE_ZONE_SET_BYPASSED][i]
+			& (sets[GE_ZONE_SET_TRIPPED][i]|sets[GE_ZONE_SET_FAULT][i]|sets[GE_ZONE_SET_TROUBLE][i]);
+
+		while(word && len<SMCP_VARIABLE_MAX_VALUE_LENGTH) {
+			len += snprintf(value+len,SMCP_VARIABLE_MAX_VALUE_LENGTH+1-len,"%s%d",
+				len?",":"",
+				i*32+__builtin_ctz(word)+1
+			);
+			word &= word-1;
+		}
+	}
+
+	return SMCP_STATUS_OK;
+}
+
+// Takes a comma separated list of light numbers, 0 being "all".
+static smcp_status_t
+partition_lights_handler(struct ge_partition_s *node, uint8_t action, uint8_t path, char* value) {
+	struct ge_keypress_batch_s batch;
+	uint16_t mask = 0;
+	char* next = value;
+
+	if(action!=SMCP_VAR_SET_VALUE)
+		return SMCP_STATUS_NOT_IMPLEMENTED;
+
+	// Every element must be a number. An empty one would otherwise
+	// parse as 0, turning on every light.
+	for(;;) {
+		char* end;
+		long light = strtol(next,&end,10);
+		if(end==next || light<0 || light>9 || (*end && *end!=','))
+			return SMCP_STATUS_INVALID_ARGUMENT;
+		mask |= (1<<light);
+		if(!*end)
+			break;
+		next = end+1;
+	}
+
+	ge_keypress_batch_init(&batch,node->partition_number,0);
+
+	if(ge_partition_set_lights(&batch,node,mask,path==PATH_LIGHTS_ON))
+		return SMCP_STATUS_FAILURE;
+
+	mask &= ~1;
+	return ge_partition_send_batch(node,&batch,mask,(path==PATH_LIGHTS_ON)?mask:0);
+}
+
+static smcp_status_t
+partition_bypass_group_handler(struct ge_partition_s *node, uint8_t action, uint8_t path, char* value) {
+	struct ge_keypress_batch_s batch;
+
+	if(action!=SMCP_VAR_SET_VALUE)
+		return SMCP_STATUS_NOT_IMPLEMENTED;
+
+	ge_keypress_batch_init(&batch,node->partition_number,0);
+
+	if(ge_partition_bypass_open_group(&batch,node,atoi(value)))
+		return SMCP_STATUS_FAILURE;
+
+	return ge_partition_send_batch(node,&batch,0,0);
+}
+
+// Setting runs the named macro, getting lists the defined macros.
+static smcp_status_t
+partition_macro_handler(struct ge_partition_s *node, uint8_t action, uint8_t path, char* value) {
+	smcp_status_t ret = SMCP_STATUS_NOT_IMPLEMENTED;
+	struct ge_system_node_s* system_state=(struct ge_system_node_s*)node->node.node.parent;
+
+	if(action==SMCP_VAR_GET_VALUE) {
+		size_t len = 0;
+		int i;
+		value[0] = 0;
+		for(i=0;i<system_state->macro_count && len<SMCP_VARIABLE_MAX_VALUE_LENGTH;i++)
+			len += snprintf(value+len,SMCP_VARIABLE_MAX_VALUE_LENGTH+1-len,"%s%s",len?",":"",system_state->macro[i].name);
+		ret = SMCP_STATUS_OK;
 	} else if(action==SMCP_VAR_SET_VALUE) {
-		ret = SMCP_STATUS_NOT_ALLOWED;
+		struct ge_keypress_macro_s* macro = ge_keypress_macro_find(system_state,value);
+		panel_response_context* response;
+		ge_rs232_status_t status;
+		if(!macro)
+			return SMCP_STATUS_NOT_FOUND;
+		response = new_panel_response_context();
+		status = ge_keypress_macro_send(system_state,node->partition_number,macro,&got_panel_response,response);
+		if(status==GE_RS232_STATUS_OK)
+			ret = SMCP_STATUS_ASYNC_RESPONSE;
+		else
+			ret = ge_queue_rejected(status,response);
+	}
+	return ret;
+}
+
+#define PARTITION_FIELD(field)		GE_VAR_FIELD(struct ge_partition_s,field)
+#define PARTITION_STATE_FLAGS		(GE_VAR_FLAG_OBSERVABLE|GE_VAR_FLAG_VALUE_SUFFIX)
+#define PARTITION_LIGHT(name,i)		{ name, PARTITION_FIELD(light_state), .mask = (1<<(i)), .max_age = 3600, .flags = PARTITION_STATE_FLAGS, .handler = (ge_var_handler_t)&partition_light_handler }
+
+static const struct ge_var_desc_s partition_vars[PATH_COUNT] = {
+	[PATH_ARM_LEVEL] = { "arm-level", PARTITION_FIELD(arming_level), .max_age = 3600, .flags = PARTITION_STATE_FLAGS, .handler = (ge_var_handler_t)&partition_arm_level_handler },
+	[PATH_ARMED_BY] = { "armed-by", PARTITION_FIELD(armed_by), .max_age = 3600, .flags = GE_VAR_FLAG_OBSERVABLE, .handler = (ge_var_handler_t)&partition_armed_by_handler },
+	[PATH_ARM_DATE] = { "arm-date", PARTITION_FIELD(arm_date), .max_age = 3600, .flags = GE_VAR_FLAG_OBSERVABLE },
+	[PATH_FS_CHIME] = { "chime", PARTITION_FIELD(feature_state), .mask = (1<<0), .max_age = 3600, .flags = PARTITION_STATE_FLAGS, .handler = (ge_var_handler_t)&partition_chime_handler },
+	[PATH_FS_ENERGY_SAVER] = { "energy-saver", PARTITION_FIELD(feature_state), .mask = (1<<1), .max_age = 3600, .flags = PARTITION_STATE_FLAGS },
+	[PATH_FS_NO_DELAY] = { "no-delay", PARTITION_FIELD(feature_state), .mask = (1<<2), .max_age = 3600, .flags = PARTITION_STATE_FLAGS },
+	[PATH_FS_LATCHKEY] = { "latchkey", PARTITION_FIELD(feature_state), .mask = (1<<3), .max_age = 3600, .flags = PARTITION_STATE_FLAGS },
+	[PATH_FS_SILENT_ARMING] = { "silent-arming", PARTITION_FIELD(feature_state), .mask = (1<<4), .max_age = 3600, .flags = PARTITION_STATE_FLAGS },
+	[PATH_FS_QUICK_ARM] = { "quick-arm", PARTITION_FIELD(feature_state), .mask = (1<<5), .max_age = 3600, .flags = PARTITION_STATE_FLAGS },
+	[PATH_TOUCHPAD_TEXT] = { "touchpad-text", .min_interval_ms = 2000, .flags = GE_VAR_FLAG_OBSERVABLE|GE_VAR_FLAG_TEXT, .handler = (ge_var_handler_t)&partition_touchpad_text_handler },
+	[PATH_KEYPRESS] = { "keypress", .handler = (ge_var_handler_t)&partition_keypress_handler },
+	[PATH_REFRESH_EQUIPMENT] = { "refresh-equipment", .handler = (ge_var_handler_t)&partition_refresh_equipment_handler },
+	[PATH_DDR] = { "ddr", .handler = (ge_var_handler_t)&partition_ddr_handler },
+	[PATH_LIGHT_ALL] = PARTITION_LIGHT("light-all",0),
+	[PATH_LIGHT_1] = PARTITION_LIGHT("light-1",1),
+	[PATH_LIGHT_2] = PARTITION_LIGHT("light-2",2),
+	[PATH_LIGHT_3] = PARTITION_LIGHT("light-3",3),
+	[PATH_LIGHT_4] = PARTITION_LIGHT("light-4",4),
+	[PATH_LIGHT_5] = PARTITION_LIGHT("light-5",5),
+	[PATH_LIGHT_6] = PARTITION_LIGHT("light-6",6),
+	[PATH_LIGHT_7] = PARTITION_LIGHT("light-7",7),
+	[PATH_LIGHT_8] = PARTITION_LIGHT("light-8",8),
+	[PATH_LIGHT_9] = PARTITION_LIGHT("light-9",9),
+	[PATH_READY_TO_ARM] = { "ready-to-arm", PARTITION_FIELD(ready_to_arm), .max_age = 60, .flags = PARTITION_STATE_FLAGS },
+	[PATH_BLOCKING_ZONES] = { "blocking-zones", .max_age = 60, .flags = GE_VAR_FLAG_OBSERVABLE|GE_VAR_FLAG_TEXT, .handler = (ge_var_handler_t)&partition_blocking_zones_handler },
+	[PATH_LIGHTS_ON] = { "lights-on", .handler = (ge_var_handler_t)&partition_lights_handler },
+	[PATH_LIGHTS_OFF] = { "lights-off", .handler = (ge_var_handler_t)&partition_lights_handler },
+	[PATH_BYPASS_GROUP] = { "bypass-group", .handler = (ge_var_handler_t)&partition_bypass_group_handler },
+	[PATH_MACRO] = { "macro", .handler = (ge_var_handler_t)&partition_macro_handler },
+};
+
+static smcp_status_t
+partition_node_var_func(
+	struct ge_partition_s *node,
+	uint8_t action,
+	uint8_t path,
+	char* value
+) {
+	return ge_var_node_func(node,&node->cache,node->version,partition_vars,PATH_COUNT,action,path,value);
+}
+
+static smcp_status_t
+partition_request_handler(struct ge_partition_s *node, smcp_method_t method) {
+	return ge_conditional_request_handler(&node->node,method,node->version);
+}
+
+#pragma mark - Zone variables
+
+	enum {
+		PATH_PARTITION=0,
+		PATH_AREA,
+		PATH_GROUP,
+		PATH_TYPE,
+		PATH_TEXT,
+		PATH_LAST_TRIPPED,
+		PATH_STATUS_TRIPPED,
+		PATH_STATUS_FAULT,
+		PATH_STATUS_ALARM,
+		PATH_STATUS_TROUBLE,
+		PATH_STATUS_BYPASS,
+
+		PATH_ZONE_COUNT,
+	};
+
+static smcp_status_t
+zone_text_handler(struct ge_zone_s *node, uint8_t action, uint8_t path, char* value) {
+	if(action==SMCP_VAR_GET_VALUE) {
+		// Just send the ascii for now.
+		int i = 0;
+		value[0]=0;
+		for(;i<node->label_len;i++) {
+			const char* str = ge_rs232_text_token_lookup[node->label[i]];
+
+			if(str) {
+				strlcat(value,str,SMCP_VARIABLE_MAX_VALUE_LENGTH);
+			}
+		}
+		return SMCP_STATUS_OK;
+	}
+	return SMCP_STATUS_NOT_IMPLEMENTED;
+}
+
+#define ZONE_FIELD(field)			GE_VAR_FIELD(struct ge_zone_s,field)
+#define ZONE_STATUS_FLAGS			(GE_VAR_FLAG_OBSERVABLE|GE_VAR_FLAG_VALUE_SUFFIX)
+
+static const struct ge_var_desc_s zone_vars[PATH_ZONE_COUNT] = {
+	[PATH_PARTITION] = { "pn", ZONE_FIELD(partition), .max_age = 3600 },
+	[PATH_AREA] = { "an", ZONE_FIELD(area), .max_age = 3600 },
+	[PATH_GROUP] = { "gn", ZONE_FIELD(group), .max_age = 3600 },
+	[PATH_TYPE] = { "zt", ZONE_FIELD(type), .max_age = 3600 },
+	[PATH_TEXT] = { "text", .max_age = 3600, .flags = GE_VAR_FLAG_TEXT, .handler = (ge_var_handler_t)&zone_text_handler },
+	[PATH_LAST_TRIPPED] = { "last-tripped", ZONE_FIELD(last_tripped), .max_age = 60*5, .flags = GE_VAR_FLAG_OBSERVABLE },
+	[PATH_STATUS_TRIPPED] = { "zs.tripped", ZONE_FIELD(status), .mask = GE_RS232_ZONE_STATUS_TRIPPED, .max_age = 60*5, .flags = ZONE_STATUS_FLAGS },
+	[PATH_STATUS_FAULT] = { "zs.fault", ZONE_FIELD(status), .mask = GE_RS232_ZONE_STATUS_FAULT, .max_age = 60*5, .flags = ZONE_STATUS_FLAGS },
+	[PATH_STATUS_ALARM] = { "zs.alarm", ZONE_FIELD(status), .mask = GE_RS232_ZONE_STATUS_ALARM, .max_age = 60*5, .flags = ZONE_STATUS_FLAGS },
+	[PATH_STATUS_TROUBLE] = { "zs.trouble", ZONE_FIELD(status), .mask = GE_RS232_ZONE_STATUS_TROUBLE, .max_age = 60*5, .flags = ZONE_STATUS_FLAGS },
+	[PATH_STATUS_BYPASS] = { "zs.bypass", ZONE_FIELD(status), .mask = GE_RS232_ZONE_STATUS_BYPASSED, .max_age = 60*5, .flags = ZONE_STATUS_FLAGS },
+};
+
+static smcp_status_t
+zone_node_var_func(
+	struct ge_zone_s *node,
+	uint8_t action,
+	uint8_t path,
+	char* value
+) {
+	return ge_var_node_func(node,&node->cache,node->version,zone_vars,PATH_ZONE_COUNT,action,path,value);
+}
+
+static smcp_status_t
+zone_request_handler(struct ge_zone_s *node, smcp_method_t method) {
+	return ge_conditional_request_handler(&node->node,method,node->version);
+}
+
+#pragma mark - System variables
+
+	enum {
+		PATH_SYS_VERSION=0,
+		PATH_SYS_LATENCY_ARM,
+		PATH_SYS_LATENCY_FEATURES,
+		PATH_SYS_LATENCY_LIGHTS,
+		PATH_SYS_QUEUE_DEPTH,
+		PATH_SYS_QUEUE_MAX_DEPTH,
+		PATH_SYS_QUEUE_REJECTED,
+		PATH_SYS_QUEUE_COALESCED,
+		PATH_SYS_SRTT,
+		PATH_SYS_RTTVAR,
+		PATH_SYS_RTO,
+		PATH_SYS_RETRANSMITS,
+		PATH_SYS_PROCESS_CALLS,
+		PATH_SYS_PROCESS_FRAMES,
+		PATH_SYS_PROCESS_TIME_US,
+		PATH_SYS_PROCESS_MAX_US,
+		PATH_SYS_HOOK_STARTED,
+		PATH_SYS_HOOK_FAILED,
+		PATH_SYS_HOOK_TIMEOUTS,
+		PATH_SYS_HOOK_DROPPED,
+		PATH_SYS_HOOK_MAX_WAIT_US,
+		PATH_SYS_HOOK_MAX_RUN_US,
+		PATH_SYS_RULE_EVALUATIONS,
+		PATH_SYS_RULE_FIRED,
+#if GE_QUEUE_THREADS
+		PATH_SYS_QUEUE_INBOX_FULL,
+		PATH_SYS_FRAMES_DROPPED,
+#endif
+
+		PATH_SYS_COUNT,
+	};
+
+// Command-to-confirmation latency as "<unconfirmed> <ms>:<count> ...",
+// where each bucket counts latencies below its power-of-two bound.
+static smcp_status_t
+system_latency_handler(struct ge_system_node_s *self, uint8_t action, uint8_t path, char* value) {
+	uint8_t kind = GE_PENDING_ARM+path-PATH_SYS_LATENCY_ARM;
+	size_t len;
+	int i;
+
+	if(action!=SMCP_VAR_GET_VALUE)
+		return SMCP_STATUS_NOT_IMPLEMENTED;
+
+	len = snprintf(value,SMCP_VARIABLE_MAX_VALUE_LENGTH+1,"%u",self->unconfirmed[kind]);
+
+	for(i=0;i<GE_LATENCY_BUCKETS && len<SMCP_VARIABLE_MAX_VALUE_LENGTH;i++) {
+		if(!self->latency[kind][i])
+			continue;
+		len += snprintf(value+len,SMCP_VARIABLE_MAX_VALUE_LENGTH+1-len," %u:%u",1u<<i,self->latency[kind][i]);
+	}
+
+	return SMCP_STATUS_OK;
+}
+
+// Only call from whichever thread owns the interface and the queue.
+static void
+ge_link_stats_collect(struct ge_system_node_s *self, struct ge_link_stats_s* stats) {
+	stats->queue_depth = ge_queue_depth(&self->qinterface);
+	stats->queue_max_depth = self->qinterface.max_depth;
+	stats->queue_rejected = self->qinterface.rejected;
+	stats->queue_coalesced = self->qinterface.coalesced;
+	stats->srtt = self->interface.srtt;
+	stats->rttvar = self->interface.rttvar;
+	stats->rto = self->interface.rto;
+	stats->retransmits = self->interface.retransmits;
+}
+
+static void
+ge_link_stats_get(struct ge_system_node_s *self, struct ge_link_stats_s* stats) {
+#if GE_QUEUE_THREADS
+	if(ge_serial_is_threaded(self)) {
+		ge_seqlock_read(&self->serial_thread.link_lock,stats,&self->serial_thread.link,sizeof(*stats));
+		return;
+	}
+#endif
+	ge_link_stats_collect(self,stats);
+}
+
+static smcp_status_t
+system_link_handler(struct ge_system_node_s *self, uint8_t action, uint8_t path, char* value) {
+	struct ge_link_stats_s stats;
+	uint32_t v = 0;
+
+	if(action!=SMCP_VAR_GET_VALUE)
+		return SMCP_STATUS_NOT_IMPLEMENTED;
+
+	ge_link_stats_get(self,&stats);
+
+	switch(path) {
+		case PATH_SYS_QUEUE_DEPTH: v = stats.queue_depth; break;
+		case PATH_SYS_QUEUE_MAX_DEPTH: v = stats.queue_max_depth; break;
+		case PATH_SYS_QUEUE_REJECTED: v = stats.queue_rejected; break;
+		case PATH_SYS_QUEUE_COALESCED: v = stats.queue_coalesced; break;
+		case PATH_SYS_SRTT: v = stats.srtt; break;
+		case PATH_SYS_RTTVAR: v = stats.rttvar; break;
+		case PATH_SYS_RTO: v = stats.rto; break;
+		case PATH_SYS_RETRANSMITS: v = stats.retransmits; break;
+	}
+
+	sprintf(value,"%u",v);
+	return SMCP_STATUS_OK;
+}
+
+#if GE_QUEUE_THREADS
+static smcp_status_t
+system_queue_inbox_full_handler(struct ge_system_node_s *self, uint8_t action, uint8_t path, char* value) {
+	if(action!=SMCP_VAR_GET_VALUE)
+		return SMCP_STATUS_NOT_IMPLEMENTED;
+	sprintf(value,"%u",atomic_load_explicit(&self->qinterface.inbox_full,memory_order_relaxed));
+	return SMCP_STATUS_OK;
+}
+
+static smcp_status_t
+system_frames_dropped_handler(struct ge_system_node_s *self, uint8_t action, uint8_t path, char* value) {
+	if(action!=SMCP_VAR_GET_VALUE)
+		return SMCP_STATUS_NOT_IMPLEMENTED;
+	sprintf(value,"%u",atomic_load_explicit(&self->serial_thread.frames_dropped,memory_order_relaxed));
+	return SMCP_STATUS_OK;
+}
+#endif
+
+static const struct ge_var_desc_s system_vars[PATH_SYS_COUNT] = {
+	[PATH_SYS_VERSION] = { "version", GE_VAR_FIELD(struct ge_system_node_s,version) },
+	[PATH_SYS_LATENCY_ARM] = { "latency-arm", .handler = (ge_var_handler_t)&system_latency_handler },
+	[PATH_SYS_LATENCY_FEATURES] = { "latency-features", .handler = (ge_var_handler_t)&system_latency_handler },
+	[PATH_SYS_LATENCY_LIGHTS] = { "latency-lights", .handler = (ge_var_handler_t)&system_latency_handler },
+	[PATH_SYS_QUEUE_DEPTH] = { "queue-depth", .handler = (ge_var_handler_t)&system_link_handler },
+	[PATH_SYS_QUEUE_MAX_DEPTH] = { "queue-max-depth", .handler = (ge_var_handler_t)&system_link_handler },
+	[PATH_SYS_QUEUE_REJECTED] = { "queue-rejected", .handler = (ge_var_handler_t)&system_link_handler },
+	[PATH_SYS_QUEUE_COALESCED] = { "queue-coalesced", .handler = (ge_var_handler_t)&system_link_handler },
+	[PATH_SYS_SRTT] = { "srtt", .handler = (ge_var_handler_t)&system_link_handler },
+	[PATH_SYS_RTTVAR] = { "rttvar", .handler = (ge_var_handler_t)&system_link_handler },
+	[PATH_SYS_RTO] = { "rto", .handler = (ge_var_handler_t)&system_link_handler },
+	[PATH_SYS_RETRANSMITS] = { "retransmits", .handler = (ge_var_handler_t)&system_link_handler },
+	[PATH_SYS_PROCESS_CALLS] = { "process-calls", GE_VAR_FIELD(struct ge_system_node_s,stats.calls) },
+	[PATH_SYS_PROCESS_FRAMES] = { "process-frames", GE_VAR_FIELD(struct ge_system_node_s,stats.frames) },
+	[PATH_SYS_PROCESS_TIME_US] = { "process-time-us", GE_VAR_FIELD(struct ge_system_node_s,stats.time_us) },
+	[PATH_SYS_PROCESS_MAX_US] = { "process-max-us", GE_VAR_FIELD(struct ge_system_node_s,stats.max_us) },
+	[PATH_SYS_HOOK_STARTED] = { "hook-started", GE_VAR_FIELD(struct ge_system_node_s,hooks.stats.started) },
+	[PATH_SYS_HOOK_FAILED] = { "hook-failed", GE_VAR_FIELD(struct ge_system_node_s,hooks.stats.failed) },
+	[PATH_SYS_HOOK_TIMEOUTS] = { "hook-timeouts", GE_VAR_FIELD(struct ge_system_node_s,hooks.stats.timed_out) },
+	[PATH_SYS_HOOK_DROPPED] = { "hook-dropped", GE_VAR_FIELD(struct ge_system_node_s,hooks.stats.dropped) },
+	[PATH_SYS_HOOK_MAX_WAIT_US] = { "hook-max-wait-us", GE_VAR_FIELD(struct ge_system_node_s,hooks.stats.max_wait_us) },
+	[PATH_SYS_HOOK_MAX_RUN_US] = { "hook-max-run-us", GE_VAR_FIELD(struct ge_system_node_s,hooks.stats.max_run_us) },
+	[PATH_SYS_RULE_EVALUATIONS] = { "rule-evaluations", GE_VAR_FIELD(struct ge_system_node_s,stats.rule_evaluations) },
+	[PATH_SYS_RULE_FIRED] = { "rule-fired", GE_VAR_FIELD(struct ge_system_node_s,stats.rules_fired) },
+#if GE_QUEUE_THREADS
+	[PATH_SYS_QUEUE_INBOX_FULL] = { "queue-inbox-full", .handler = (ge_var_handler_t)&system_queue_inbox_full_handler },
+	[PATH_SYS_FRAMES_DROPPED] = { "frames-dropped", .handler = (ge_var_handler_t)&system_frames_dropped_handler },
+#endif
+};
+
+static smcp_status_t
+system_node_var_func(
+	smcp_variable_node_t node,
+	uint8_t action,
+	uint8_t path,
+	char* value
+) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)node->node.parent;
+
+	// The stats change without bumping the version, so only the
+	// version itself can be tagged with it.
+	if(action==SMCP_VAR_GET_ETAG && path!=PATH_SYS_VERSION)
+		return SMCP_STATUS_NOT_ALLOWED;
+
+	return ge_var_node_func(self,NULL,self->version,system_vars,PATH_SYS_COUNT,action,path,value);
+}
+
+static smcp_status_t
+system_request_handler(smcp_variable_node_t node, smcp_method_t method) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)node->node.parent;
+
+	if(!ge_inbound_last_path_is(system_vars[PATH_SYS_VERSION].name))
+		return smcp_variable_node_request_handler(node,method);
+
+	return ge_conditional_request_handler(node,method,self->version);
+}
+
+struct ge_zone_s *
+ge_get_zone(struct ge_system_node_s *node,int zonei) {
+	struct ge_zone_s *zone = NULL;
+	if(zonei && (zonei<=GE_RS232_MAX_ZONES)) {
+		zone = &node->zone[zonei-1];
+		if(!zone->node.node.parent) {
+			// Bring this zone to life.
+			char* label = NULL;
+			asprintf(&label,"zone-%d",zonei);
+			smcp_variable_node_init(&zone->node,&node->node,label);
+			zone->node.func = (smcp_variable_node_func)&zone_node_var_func;
+			zone->node.node.request_handler = (void*)&zone_request_handler;
+			zone->cache.slot = zone->cache_slot;
+			zone->zone_number = zonei;
+			node->snapshot_dirty_zones[(zonei-1)/32] |= 1u<<((zonei-1)%32);
+		}
+	}
+	return zone;
+}
+
+struct ge_partition_s *
+ge_get_partition(struct ge_system_node_s *node,int partitioni) {
+	struct ge_partition_s *partition = NULL;
+	if(partitioni && (partitioni<=GE_RS232_MAX_PARTITIONS)) {
+		partition = &node->partition[partitioni-1];
+		if(!partition->node.node.parent) {
+			// Bring this partition to life.
+			char* label = NULL;
+			asprintf(&label,"p-%d",partitioni);
+			smcp_variable_node_init(&partition->node,&node->node,label);
+			partition->node.func = (smcp_variable_node_func)&partition_node_var_func;
+			partition->node.node.request_handler = (void*)&partition_request_handler;
+			partition->cache.slot = partition->cache_slot;
+			partition->partition_number = partitioni;
+			partition->ready_to_arm = true;
+			node->snapshot_dirty_partitions |= 1u<<(partitioni-1);
+		}
+	}
+	return partition;
+}
+
+#pragma mark - Change tracking
+
+static void
+ge_changelog_record(
+	struct ge_system_node_s* self,
+	uint8_t entity_type,
+	uint8_t entity,
+	uint8_t path,
+	const struct ge_var_desc_s* desc,
+	const void* object
+) {
+	struct ge_changelog_s* changelog = &self->changelog;
+	struct ge_change_s* change = &changelog->entry[changelog->head];
+
+	if(changelog->count==GE_CHANGELOG_SIZE)
+		changelog->dropped_version = change->version;
+	else
+		changelog->count++;
+
+	change->version = self->version;
+	change->entity_type = entity_type;
+	change->entity = entity;
+	change->path = path;
+	change->has_value = (desc->width!=0);
+	change->value = change->has_value?(int32_t)ge_var_read_field(object,desc):0;
+
+	changelog->head = (changelog->head+1)%GE_CHANGELOG_SIZE;
+}
+
+static void
+ge_zone_field_changed(struct ge_zone_s* zone, uint8_t path) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)zone->node.node.parent;
+
+	ge_value_cache_invalidate(&zone->cache,path);
+	zone->version = ++self->version;
+	self->snapshot_dirty_zones[(zone->zone_number-1)/32] |= 1u<<((zone->zone_number-1)%32);
+	ge_changelog_record(self,GE_ENTITY_ZONE,zone->zone_number,path,&zone_vars[path],zone);
+}
+
+static void
+ge_partition_field_changed(struct ge_partition_s* partition, uint8_t path) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)partition->node.node.parent;
+
+	ge_value_cache_invalidate(&partition->cache,path);
+	partition->version = ++self->version;
+	self->snapshot_dirty_partitions |= 1u<<(partition->partition_number-1);
+	ge_changelog_record(self,GE_ENTITY_PARTITION,partition->partition_number,path,&partition_vars[path],partition);
+}
+
+static bool
+ge_inbound_get_query_uint(const char* key, uint32_t* value_out) {
+	coap_option_key_t option;
+	const uint8_t* value;
+	size_t len;
+	size_t key_len = strlen(key);
+	bool ret = false;
+
+	while((option = smcp_inbound_next_option(&value,&len))!=COAP_OPTION_INVALID) {
+		char buffer[16];
+		if(option!=COAP_OPTION_URI_QUERY
+			|| len<=key_len
+			|| len-key_len>=sizeof(buffer)
+			|| 0!=memcmp(value,key,key_len)
+			|| value[key_len]!='='
+		) {
+			continue;
+		}
+		memcpy(buffer,value+key_len+1,len-key_len-1);
+		buffer[len-key_len-1] = 0;
+		*value_out = strtoul(buffer,NULL,10);
+		ret = true;
+		break;
+	}
+
+	smcp_inbound_reset_next_option();
+
+	return ret;
+}
+
+// Responds with every change newer than the "since" query parameter,
+// one per line as "<version> <node>/<variable>[ <value>]". The first
+// line gives the version to ask for next time, followed by "more" if
+// the response was truncated, or is "resync" if the requested version
+// has already aged out of the changelog.
+static smcp_status_t
+changes_request_handler(smcp_node_t node, smcp_method_t method) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)node->parent;
+	struct ge_changelog_s* changelog = &self->changelog;
+	smcp_status_t ret = 0;
+	uint32_t since = 0;
+	uint32_t next = self->version;
+	char* content;
+	size_t max_len = 0;
+	size_t len = 0;
+	int i;
+
+	if(method!=COAP_METHOD_GET)
+		return SMCP_STATUS_NOT_ALLOWED;
+
+	ge_inbound_get_query_uint("since",&since);
+
+	ret = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE,COAP_CONTENT_TYPE_TEXT_PLAIN);
+	require_noerr(ret,bail);
+
+	content = smcp_outbound_get_content_ptr(&max_len);
+	require_action(content!=NULL,bail,ret=SMCP_STATUS_FAILURE);
+
+	if(since<changelog->dropped_version || since>self->version) {
+		len = snprintf(content,max_len,"resync v=%u\n",self->version);
+	} else {
+		// Leave room for the header line, which is written last.
+		const size_t header_len = 32;
+		bool truncated = false;
+		char* body = content+header_len;
+		size_t body_len = 0;
+		int first = (changelog->head+GE_CHANGELOG_SIZE-changelog->count)%GE_CHANGELOG_SIZE;
+
+		for(i=0;i<changelog->count;i++) {
+			const struct ge_change_s* change = &changelog->entry[(first+i)%GE_CHANGELOG_SIZE];
+			const struct ge_var_desc_s* desc;
+			char line[64];
+			int line_len;
+
+			if(change->version<=since)
+				continue;
+
+			desc = (change->entity_type==GE_ENTITY_ZONE)?&zone_vars[change->path]:&partition_vars[change->path];
+
+			if(change->has_value) {
+				line_len = snprintf(line,sizeof(line),"%u %s-%d/%s %d\n",
+					change->version,
+					(change->entity_type==GE_ENTITY_ZONE)?"zone":"p",
+					change->entity,
+					desc->name,
+					change->value
+				);
+			} else {
+				line_len = snprintf(line,sizeof(line),"%u %s-%d/%s\n",
+					change->version,
+					(change->entity_type==GE_ENTITY_ZONE)?"zone":"p",
+					change->entity,
+					desc->name
+				);
+			}
+
+			if(header_len+body_len+line_len>max_len) {
+				truncated = true;
+				break;
+			}
+
+			memcpy(body+body_len,line,line_len);
+			body_len += line_len;
+			next = change->version;
+		}
+
+		len = snprintf(content,header_len,"v=%u%s\n",next,truncated?" more":"");
+		memmove(content+len,body,body_len);
+		len += body_len;
+	}
+
+	ret = smcp_outbound_set_content_len(len);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_send();
+
+bail:
+	return ret;
+}
+
+#pragma mark - State document
+
+#define GE_STATE_FORMAT_JSON	(0)
+#define GE_STATE_FORMAT_CBOR	(1)
+#define GE_STATE_FORMAT_COUNT	(2)
+
+struct ge_buffer_s {
+	uint8_t* data;
+	size_t len;
+	size_t size;
+};
+
+// Serialized form of one zone or partition, regenerated only when the
+// entity's version moves past the one it was built from.
+struct ge_fragment_s {
+	bool valid;
+	uint32_t version;
+	struct ge_buffer_s buffer;
+};
+
+struct ge_state_doc_s {
+	struct ge_fragment_s zone[GE_RS232_MAX_ZONES][GE_STATE_FORMAT_COUNT];
+	struct ge_fragment_s partition[GE_RS232_MAX_PARTITIONS][GE_STATE_FORMAT_COUNT];
+
+	bool doc_valid[GE_STATE_FORMAT_COUNT];
+	uint32_t doc_version[GE_STATE_FORMAT_COUNT];
+	struct ge_buffer_s doc[GE_STATE_FORMAT_COUNT];
+};
+
+static bool
+ge_buffer_append(struct ge_buffer_s* buffer, const void* data, size_t len) {
+	if(buffer->len+len>buffer->size) {
+		size_t size = buffer->size?buffer->size:64;
+		uint8_t* new_data;
+		while(size<buffer->len+len)
+			size *= 2;
+		new_data = realloc(buffer->data,size);
+		if(!new_data)
+			return false;
+		buffer->data = new_data;
+		buffer->size = size;
+	}
+	memcpy(buffer->data+buffer->len,data,len);
+	buffer->len += len;
+	return true;
+}
+
+static bool
+ge_buffer_append_cstr(struct ge_buffer_s* buffer, const char* str) {
+	return ge_buffer_append(buffer,str,strlen(str));
+}
+
+static void
+ge_buffer_free(struct ge_buffer_s* buffer) {
+	free(buffer->data);
+	memset(buffer,0,sizeof(*buffer));
+}
+
+static bool
+ge_json_append_string(struct ge_buffer_s* buffer, const char* str) {
+	bool ret = ge_buffer_append(buffer,"\"",1);
+	for(;ret && *str;str++) {
+		if(*str=='"' || *str=='\\') {
+			char escaped[] = { '\\', *str };
+			ret = ge_buffer_append(buffer,escaped,2);
+		} else if((uint8_t)*str<0x20) {
+			char escaped[8];
+			snprintf(escaped,sizeof(escaped),"\\u%04x",*str);
+			ret = ge_buffer_append_cstr(buffer,escaped);
+		} else {
+			ret = ge_buffer_append(buffer,str,1);
+		}
+	}
+	return ret && ge_buffer_append(buffer,"\"",1);
+}
+
+static bool
+ge_cbor_append_head(struct ge_buffer_s* buffer, uint8_t major, uint64_t value) {
+	uint8_t head[9];
+	size_t len = 1;
+	int i;
+
+	if(value<24) {
+		head[0] = (major<<5)|value;
+	} else if(value<=0xFF) {
+		head[0] = (major<<5)|24;
+		len += 1;
+	} else if(value<=0xFFFF) {
+		head[0] = (major<<5)|25;
+		len += 2;
+	} else if(value<=0xFFFFFFFF) {
+		head[0] = (major<<5)|26;
+		len += 4;
+	} else {
+		head[0] = (major<<5)|27;
+		len += 8;
+	}
+
+	for(i=len-1;i>0;i--,value>>=8)
+		head[i] = value&0xFF;
+
+	return ge_buffer_append(buffer,head,len);
+}
+
+// Opens an indefinite-length array or map, closed by ge_cbor_append_break().
+static bool
+ge_cbor_append_indefinite(struct ge_buffer_s* buffer, uint8_t major) {
+	uint8_t head = (major<<5)|31;
+	return ge_buffer_append(buffer,&head,1);
+}
+
+static bool
+ge_cbor_append_break(struct ge_buffer_s* buffer) {
+	return ge_buffer_append(buffer,"\xFF",1);
+}
+
+static bool
+ge_cbor_append_int(struct ge_buffer_s* buffer, int64_t value) {
+	if(value<0)
+		return ge_cbor_append_head(buffer,1,-1-value);
+	return ge_cbor_append_head(buffer,0,value);
+}
+
+static bool
+ge_cbor_append_string(struct ge_buffer_s* buffer, const char* str) {
+	size_t len = strlen(str);
+	return ge_cbor_append_head(buffer,3,len) && ge_buffer_append(buffer,str,len);
+}
+
+#if DEBUG
+// Decodes the one CBOR data item at the start of `data`, as far as
+// needed to find where it ends. Returns its length, or 0 if it is
+// malformed or truncated. Only covers what the encoders above produce.
+static size_t
+ge_cbor_check(const uint8_t* data, size_t len) {
+	size_t used = 1;
+	uint8_t major, info;
+	uint64_t value = 0;
+	int i;
+
+	if(!len)
+		return 0;
+
+	major = data[0]>>5;
+	info = data[0]&31;
+
+	if(info==31) {
+		// Indefinite length: items (pairs, for a map) up to a break.
+		if(major!=4 && major!=5)
+			return 0;
+		while(used<len && data[used]!=0xFF) {
+			size_t item = ge_cbor_check(data+used,len-used);
+			if(!item)
+				return 0;
+			used += item;
+			if(major==5) {
+				item = ge_cbor_check(data+used,len-used);
+				if(!item)
+					return 0;
+				used += item;
+			}
+		}
+		return (used<len)?used+1:0;
+	}
+
+	if(info<24) {
+		value = info;
+	} else if(info<=27) {
+		size_t size = 1<<(info-24);
+		if(len<used+size)
+			return 0;
+		for(i=0;i<size;i++)
+			value = (value<<8)|data[used++];
+	} else {
+		return 0;
+	}
+
+	switch(major) {
+	case 0: case 1:
+		return used;
+	case 2: case 3:
+		return (len-used>=value)?used+value:0;
+	case 4: case 5:
+		for(value*=(major==5)?2:1;value;value--) {
+			size_t item = ge_cbor_check(data+used,len-used);
+			if(!item)
+				return 0;
+			used += item;
+		}
+		return used;
+	default:
+		return 0;
+	}
+}
+#endif
+
+// Serializes `"name":{...}` (JSON) or `name {...}` (CBOR) for one
+// zone or partition, with every readable variable in its table.
+static bool
+ge_fragment_build(
+	struct ge_buffer_s* buffer,
+	uint8_t format,
+	smcp_variable_node_t node,
+	const struct ge_var_desc_s* table,
+	uint8_t count
+) {
+	char value[SMCP_VARIABLE_MAX_VALUE_LENGTH+1];
+	struct ge_buffer_s pairs = { };
+	uint8_t pair_count = 0;
+	bool ret = true;
+	uint8_t path;
+
+	buffer->len = 0;
+
+	for(path=0;ret && path<count;path++) {
+		const struct ge_var_desc_s* desc = &table[path];
+
+		if(!desc->width && !(desc->flags&GE_VAR_FLAG_TEXT))
+			continue;
+
+		if(0!=node->func(node,SMCP_VAR_GET_VALUE,path,value))
+			continue;
+
+		if(format==GE_STATE_FORMAT_JSON) {
+			ret = (!pair_count || ge_buffer_append(&pairs,",",1))
+				&& ge_json_append_string(&pairs,desc->name)
+				&& ge_buffer_append(&pairs,":",1)
+				&& ((desc->flags&GE_VAR_FLAG_TEXT)
+					? ge_json_append_string(&pairs,value)
+					: ge_buffer_append_cstr(&pairs,value));
+		} else {
+			ret = ge_cbor_append_string(&pairs,desc->name)
+				&& ((desc->flags&GE_VAR_FLAG_TEXT)
+					? ge_cbor_append_string(&pairs,value)
+					: ge_cbor_append_int(&pairs,strtoll(value,NULL,10)));
+		}
+		pair_count++;
+	}
+
+	if(format==GE_STATE_FORMAT_JSON) {
+		ret = ret
+			&& ge_json_append_string(buffer,node->node.name)
+			&& ge_buffer_append(buffer,":{",2)
+			&& ge_buffer_append(buffer,pairs.data,pairs.len)
+			&& ge_buffer_append(buffer,"}",1);
+	} else {
+		ret = ret
+			&& ge_cbor_append_string(buffer,node->node.name)
+			&& ge_cbor_append_head(buffer,5,pair_count)
+			&& ge_buffer_append(buffer,pairs.data,pairs.len);
+	}
+
+	ge_buffer_free(&pairs);
+
+	return ret;
+}
+
+static struct ge_buffer_s*
+ge_fragment_get(
+	struct ge_fragment_s* fragment,
+	uint32_t version,
+	uint8_t format,
+	smcp_variable_node_t node,
+	const struct ge_var_desc_s* table,
+	uint8_t count
+) {
+	if(!fragment->valid || fragment->version!=version) {
+		fragment->valid = ge_fragment_build(&fragment->buffer,format,node,table,count);
+		fragment->version = version;
+	}
+	return fragment->valid?&fragment->buffer:NULL;
+}
+
+static bool
+ge_state_doc_build(struct ge_system_node_s* self, uint8_t format) {
+	struct ge_state_doc_s* state = self->state_doc;
+	struct ge_buffer_s* doc = &state->doc[format];
+	bool json = (format==GE_STATE_FORMAT_JSON);
+	bool ret = true;
+	bool first;
+	char number[24];
+	int i;
+
+	doc->len = 0;
+
+	if(json) {
+		snprintf(number,sizeof(number),"%u",self->version);
+		ret = ge_buffer_append_cstr(doc,"{\"version\":")
+			&& ge_buffer_append_cstr(doc,number)
+			&& ge_buffer_append_cstr(doc,",\"panel\":{\"type\":");
+		snprintf(number,sizeof(number),"%d",self->panel_type);
+		ret = ret && ge_buffer_append_cstr(doc,number)
+			&& ge_buffer_append_cstr(doc,",\"hw-rev\":");
+		snprintf(number,sizeof(number),"%d",self->hardware_rev);
+		ret = ret && ge_buffer_append_cstr(doc,number)
+			&& ge_buffer_append_cstr(doc,",\"sw-rev\":");
+		snprintf(number,sizeof(number),"%d",self->software_rev);
+		ret = ret && ge_buffer_append_cstr(doc,number)
+			&& ge_buffer_append_cstr(doc,",\"serial\":");
+		snprintf(number,sizeof(number),"%u",self->serial);
+		ret = ret && ge_buffer_append_cstr(doc,number)
+			&& ge_buffer_append_cstr(doc,"},\"partitions\":{");
+	} else {
+		ret = ge_cbor_append_head(doc,5,4)
+			&& ge_cbor_append_string(doc,"version")
+			&& ge_cbor_append_int(doc,self->version)
+			&& ge_cbor_append_string(doc,"panel")
+			&& ge_cbor_append_head(doc,5,4)
+			&& ge_cbor_append_string(doc,"type") && ge_cbor_append_int(doc,self->panel_type)
+			&& ge_cbor_append_string(doc,"hw-rev") && ge_cbor_append_int(doc,self->hardware_rev)
+			&& ge_cbor_append_string(doc,"sw-rev") && ge_cbor_append_int(doc,self->software_rev)
+			&& ge_cbor_append_string(doc,"serial") && ge_cbor_append_int(doc,self->serial)
+			&& ge_cbor_append_string(doc,"partitions")
+			&& ge_cbor_append_indefinite(doc,5);
+	}
+
+	for(i=0,first=true;ret && i<GE_RS232_MAX_PARTITIONS;i++) {
+		struct ge_partition_s* partition = &self->partition[i];
+		struct ge_buffer_s* fragment;
+
+		if(!partition->node.node.parent)
+			continue;
+
+		fragment = ge_fragment_get(&state->partition[i][format],partition->version,format,&partition->node,partition_vars,PATH_COUNT);
+
+		ret = fragment
+			&& (!json || first || ge_buffer_append(doc,",",1))
+			&& ge_buffer_append(doc,fragment->data,fragment->len);
+		first = false;
+	}
+
+	if(json) {
+		ret = ret && ge_buffer_append_cstr(doc,"},\"zones\":{");
+	} else {
+		ret = ret
+			&& ge_cbor_append_break(doc)
+			&& ge_cbor_append_string(doc,"zones")
+			&& ge_cbor_append_indefinite(doc,5);
+	}
+
+	for(i=0,first=true;ret && i<GE_RS232_MAX_ZONES;i++) {
+		struct ge_zone_s* zone = &self->zone[i];
+		struct ge_buffer_s* fragment;
+
+		if(!zone->node.node.parent)
+			continue;
+
+		fragment = ge_fragment_get(&state->zone[i][format],zone->version,format,&zone->node,zone_vars,PATH_ZONE_COUNT);
+
+		ret = fragment
+			&& (!json || first || ge_buffer_append(doc,",",1))
+			&& ge_buffer_append(doc,fragment->data,fragment->len);
+		first = false;
+	}
+
+	if(json) {
+		ret = ret && ge_buffer_append_cstr(doc,"}}");
+	} else {
+		ret = ret && ge_cbor_append_break(doc);
+	}
+
+#if DEBUG
+	if(ret && !json && ge_cbor_check(doc->data,doc->len)!=doc->len) {
+		log_msg(LOG_LEVEL_ERROR,"Malformed CBOR state document");
+		ret = false;
+	}
+#endif
+
+	return ret;
+}
+
+static void
+ge_state_doc_free(struct ge_state_doc_s* state) {
+	int i, format;
+
+	if(!state)
+		return;
+
+	for(format=0;format<GE_STATE_FORMAT_COUNT;format++) {
+		for(i=0;i<GE_RS232_MAX_ZONES;i++)
+			ge_buffer_free(&state->zone[i][format].buffer);
+		for(i=0;i<GE_RS232_MAX_PARTITIONS;i++)
+			ge_buffer_free(&state->partition[i][format].buffer);
+		ge_buffer_free(&state->doc[format]);
+	}
+
+	free(state);
+}
+
+static bool
+ge_inbound_get_option_uint(coap_option_key_t key, uint32_t* value_out) {
+	coap_option_key_t option;
+	const uint8_t* value;
+	size_t len;
+	bool ret = false;
+
+	while((option = smcp_inbound_next_option(&value,&len))!=COAP_OPTION_INVALID) {
+		if(option!=key || len>4)
+			continue;
+		*value_out = 0;
+		while(len--)
+			*value_out = (*value_out<<8)+*value++;
+		ret = true;
+		break;
+	}
+
+	smcp_inbound_reset_next_option();
+
+	return ret;
+}
+
+// Returns the whole state of the system as one document, in CBOR if
+// the client asks for it and JSON otherwise. Large documents are sent
+// using block-wise transfer, with the system version as the ETag so
+// the client can tell if the state changed between blocks.
+static smcp_status_t
+state_request_handler(smcp_node_t node, smcp_method_t method) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)node->parent;
+	smcp_status_t ret = 0;
+	uint32_t accept = COAP_CONTENT_TYPE_APPLICATION_JSON;
+	uint32_t block2 = 0;
+	uint8_t format;
+	struct ge_buffer_s* doc;
+	size_t max_len = 0;
+	size_t block_size;
+	size_t offset;
+	size_t chunk;
+	uint8_t szx = 6;
+	char* content;
+
+	if(method!=COAP_METHOD_GET)
+		return SMCP_STATUS_NOT_ALLOWED;
+
+	ge_inbound_get_option_uint(COAP_OPTION_ACCEPT,&accept);
+
+	if(accept==COAP_CONTENT_TYPE_APPLICATION_CBOR) {
+		format = GE_STATE_FORMAT_CBOR;
+	} else if(accept==COAP_CONTENT_TYPE_APPLICATION_JSON) {
+		format = GE_STATE_FORMAT_JSON;
+	} else {
+		ret = smcp_outbound_begin_response(COAP_RESULT_406_NOT_ACCEPTABLE);
+		require_noerr(ret,bail);
+		ret = smcp_outbound_send();
+		goto bail;
+	}
+
+	if(!self->state_doc)
+		self->state_doc = calloc(1,sizeof(*self->state_doc));
+	require_action(self->state_doc!=NULL,bail,ret=SMCP_STATUS_FAILURE);
+
+	if(!self->state_doc->doc_valid[format]
+		|| self->state_doc->doc_version[format]!=self->version
+	) {
+		self->state_doc->doc_valid[format] = ge_state_doc_build(self,format);
+		self->state_doc->doc_version[format] = self->version;
+	}
+	require_action(self->state_doc->doc_valid[format],bail,ret=SMCP_STATUS_FAILURE);
+
+	doc = &self->state_doc->doc[format];
+
+	ret = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(ret,bail);
+
+	content = smcp_outbound_get_content_ptr(&max_len);
+	require_action(content!=NULL,bail,ret=SMCP_STATUS_FAILURE);
+
+	while(szx && (16u<<szx)>max_len)
+		szx--;
+
+	if(ge_inbound_get_option_uint(COAP_OPTION_BLOCK2,&block2) && (block2&0x7)<szx)
+		szx = block2&0x7;
+
+	block_size = 16u<<szx;
+	offset = (size_t)(block2>>4)<<(szx+4);
+
+	if(offset && offset>=doc->len) {
+		ret = smcp_outbound_begin_response(COAP_RESULT_400_BAD_REQUEST);
+		require_noerr(ret,bail);
+		ret = smcp_outbound_send();
+		goto bail;
+	}
+
+	chunk = MIN(block_size,doc->len-offset);
+
+	ret = smcp_outbound_add_option_uint(COAP_OPTION_ETAG,self->version);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE,accept);
+	require_noerr(ret,bail);
+
+	if(offset || offset+chunk<doc->len) {
+		ret = smcp_outbound_add_option_uint(
+			COAP_OPTION_BLOCK2,
+			((block2>>4)<<4)|((offset+chunk<doc->len)?(1<<3):0)|szx
+		);
+		require_noerr(ret,bail);
+	}
+
+	memcpy(content,doc->data+offset,chunk);
+
+	ret = smcp_outbound_set_content_len(chunk);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_send();
+
+bail:
+	return ret;
+}
+
+#pragma mark - Zone status sets
+
+static const char* const zone_set_names[GE_ZONE_SET_COUNT] = {
+	[GE_ZONE_SET_TRIPPED] = "tripped",
+	[GE_ZONE_SET_FAULT] = "fault",
+	[GE_ZONE_SET_ALARM] = "alarm",
+	[GE_ZONE_SET_TROUBLE] = "trouble",
+	[GE_ZONE_SET_BYPASSED] = "bypassed",
+};
+
+// The zone status bits are laid out in the same order as the sets.
+static void
+ge_zone_sets_update(struct ge_system_node_s* self, int zonei, uint8_t status) {
+	uint32_t mask = (1u<<((zonei-1)%32));
+	int word = (zonei-1)/32;
+	int set;
+
+	for(set=0;set<GE_ZONE_SET_COUNT;set++) {
+		if(status&(1<<set))
+			self->zone_sets[set][word] |= mask;
+		else
+			self->zone_sets[set][word] &= ~mask;
+	}
+}
+
+static int
+ge_zone_set_count(const uint32_t* bits) {
+	int count = 0;
+	int i;
+	for(i=0;i<GE_ZONE_SET_WORDS;i++)
+		count += __builtin_popcount(bits[i]);
+	return count;
+}
+
+// Responds with the number of zones in each set, one per line.
+static smcp_status_t
+zones_request_handler(smcp_node_t node, smcp_method_t method) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)node->parent;
+	smcp_status_t ret = 0;
+	char* content;
+	size_t max_len = 0;
+	size_t len = 0;
+	int set;
+
+	if(method!=COAP_METHOD_GET)
+		return SMCP_STATUS_NOT_ALLOWED;
+
+	if(ge_inbound_has_etag(self->version)) {
+		ret = smcp_outbound_begin_response(COAP_RESULT_203_VALID);
+		require_noerr(ret,bail);
+		ret = smcp_outbound_add_option_uint(COAP_OPTION_ETAG,self->version);
+		require_noerr(ret,bail);
+		ret = smcp_outbound_send();
+		goto bail;
+	}
+
+	ret = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_add_option_uint(COAP_OPTION_ETAG,self->version);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE,COAP_CONTENT_TYPE_TEXT_PLAIN);
+	require_noerr(ret,bail);
+
+	content = smcp_outbound_get_content_ptr(&max_len);
+	require_action(content!=NULL,bail,ret=SMCP_STATUS_FAILURE);
+
+	for(set=0;set<GE_ZONE_SET_COUNT && len<max_len;set++) {
+		len += snprintf(content+len,max_len-len,"%s %d\n",
+			zone_set_names[set],
+			ge_zone_set_count(self->zone_sets[set])
+		);
+	}
+	require_action(len<max_len,bail,ret=SMCP_STATUS_MESSAGE_TOO_BIG);
+
+	ret = smcp_outbound_set_content_len(len);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_send();
+
+bail:
+	return ret;
+}
+
+// Responds with the zones in one set, as a comma separated list of zone
+// numbers, or as a raw bitmap (zone 1 is the low bit of the first byte)
+// if the client accepts application/octet-stream.
+static smcp_status_t
+zone_set_request_handler(smcp_node_t node, smcp_method_t method) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)node->parent->parent;
+	const uint32_t* bits = self->zone_sets[node-self->zone_set_node];
+	smcp_status_t ret = 0;
+	uint32_t accept = COAP_CONTENT_TYPE_TEXT_PLAIN;
+	uint32_t etag;
+	char* content;
+	size_t max_len = 0;
+	size_t len = 0;
+	int i;
+
+	if(method!=COAP_METHOD_GET)
+		return SMCP_STATUS_NOT_ALLOWED;
+
+	ge_inbound_get_option_uint(COAP_OPTION_ACCEPT,&accept);
+
+	if(accept!=COAP_CONTENT_TYPE_APPLICATION_OCTET_STREAM)
+		accept = COAP_CONTENT_TYPE_TEXT_PLAIN;
+
+	// Each representation needs its own ETag.
+	etag = (self->version<<1)|(accept==COAP_CONTENT_TYPE_APPLICATION_OCTET_STREAM);
+
+	if(ge_inbound_has_etag(etag)) {
+		ret = smcp_outbound_begin_response(COAP_RESULT_203_VALID);
+		require_noerr(ret,bail);
+		ret = smcp_outbound_add_option_uint(COAP_OPTION_ETAG,etag);
+		require_noerr(ret,bail);
+		ret = smcp_outbound_send();
+		goto bail;
+	}
+
+	ret = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_add_option_uint(COAP_OPTION_ETAG,etag);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE,accept);
+	require_noerr(ret,bail);
+
+	content = smcp_outbound_get_content_ptr(&max_len);
+	require_action(content!=NULL,bail,ret=SMCP_STATUS_FAILURE);
+
+	if(accept==COAP_CONTENT_TYPE_APPLICATION_OCTET_STREAM) {
+		require_action(max_len>=(GE_RS232_MAX_ZONES+7)/8,bail,ret=SMCP_STATUS_MESSAGE_TOO_BIG);
+		for(len=0;len<(GE_RS232_MAX_ZONES+7)/8;len++)
+			content[len] = (bits[len/4]>>((len%4)*8))&0xFF;
+	} else {
+		for(i=0;i<GE_ZONE_SET_WORDS;i++) {
+			uint32_t word = bits[i];
+			while(word && len<max_len) {
+				len += snprintf(content+len,max_len-len,"%s%d",
+					len?",":"",
+					i*32+__builtin_ctz(word)+1
+				);
+				word &= word-1;
+			}
+		}
+		require_action(len<max_len,bail,ret=SMCP_STATUS_MESSAGE_TOO_BIG);
+	}
+
+	ret = smcp_outbound_set_content_len(len);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_send();
+
+bail:
+	return ret;
+}
+
+#pragma mark - Snapshots
+
+static void
+ge_zone_publish(struct ge_zone_s* zone) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)zone->node.node.parent;
+	struct ge_zone_snapshot_s snapshot = {
+		.version = zone->version,
+		.zone_number = zone->zone_number,
+		.partition = zone->partition,
+		.area = zone->area,
+		.group = zone->group,
+		.type = zone->type,
+		.status = zone->status,
+		.label_len = zone->label_len,
+		.last_tripped = zone->last_tripped,
+		.trip_count = zone->trip_count,
+	};
+
+	memcpy(snapshot.label,zone->label,sizeof(snapshot.label));
+	ge_seqlock_write(&zone->snapshot_lock,&zone->snapshot,&snapshot,sizeof(snapshot));
+
+	if(self->shm.state) {
+		struct ge_shm_zone_state_s state = {
+			.version = snapshot.version,
+			.zone_number = snapshot.zone_number,
+			.partition = snapshot.partition,
+			.area = snapshot.area,
+			.group = snapshot.group,
+			.type = snapshot.type,
+			.status = snapshot.status,
+			.label_len = snapshot.label_len,
+			.last_tripped = snapshot.last_tripped,
+		};
+
+		memcpy(state.label,snapshot.label,sizeof(state.label));
+		ge_shm_write_zone(&self->shm,&state);
+	}
+}
+
+static void
+ge_partition_publish(struct ge_partition_s* partition) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)partition->node.node.parent;
+	struct ge_partition_snapshot_s snapshot = {
+		.version = partition->version,
+		.partition_number = partition->partition_number,
+		.arming_level = partition->arming_level,
+		.armed_by = partition->armed_by,
+		.arm_date = partition->arm_date,
+		.feature_state = partition->feature_state,
+		.light_state = partition->light_state,
+		.ready_to_arm = partition->ready_to_arm,
+		.open_count = partition->open_count,
+		.fault_count = partition->fault_count,
+		.trouble_count = partition->trouble_count,
+		.touchpad_lcd_len = partition->touchpad_lcd_len,
+	};
+
+	memcpy(snapshot.touchpad_lcd,partition->touchpad_lcd,sizeof(snapshot.touchpad_lcd));
+	ge_seqlock_write(&partition->snapshot_lock,&partition->snapshot,&snapshot,sizeof(snapshot));
+
+	if(self->shm.state) {
+		struct ge_shm_partition_state_s state = {
+			.version = snapshot.version,
+			.partition_number = snapshot.partition_number,
+			.arming_level = snapshot.arming_level,
+			.armed_by = snapshot.armed_by,
+			.arm_date = snapshot.arm_date,
+			.light_state = snapshot.light_state,
+			.feature_state = snapshot.feature_state,
+			.ready_to_arm = snapshot.ready_to_arm,
+		};
+
+		ge_text_to_ascii(state.touchpad,sizeof(state.touchpad),(const uint8_t*)snapshot.touchpad_lcd,snapshot.touchpad_lcd_len);
+		state.touchpad_len = strlen(state.touchpad);
+		ge_shm_write_partition(&self->shm,&state);
+	}
+}
+
+// Republishes whatever changed since last time. Snapshots are built on
+// the stack first, so each seqlock is only held for one memcpy.
+static void
+ge_snapshot_publish(struct ge_system_node_s* self) {
+	bool changed = self->snapshot_dirty_partitions!=0;
+	int i;
+
+	for(i=0;i<GE_ZONE_SET_WORDS;i++)
+		changed |= self->snapshot_dirty_zones[i]!=0;
+
+	if(!changed)
+		return;
+
+	for(i=0;i<GE_ZONE_SET_WORDS;i++) {
+		while(self->snapshot_dirty_zones[i]) {
+			int bit = __builtin_ctz(self->snapshot_dirty_zones[i]);
+			self->snapshot_dirty_zones[i] &= ~(1u<<bit);
+			ge_zone_publish(&self->zone[i*32+bit]);
+		}
+	}
+
+	while(self->snapshot_dirty_partitions) {
+		int bit = __builtin_ctz(self->snapshot_dirty_partitions);
+		self->snapshot_dirty_partitions &= ~(1u<<bit);
+		ge_partition_publish(&self->partition[bit]);
+	}
+
+	if(self->shm.state)
+		ge_shm_commit(&self->shm);
+}
+
+// "<prefix>-<node name>", with anything a POSIX shared-memory name
+// can't hold replaced, so that each panel of a gateway gets its own
+// segment.
+static const char*
+ge_shm_name_for_node(ge_system_node_t self, const char* prefix, char* name, size_t size) {
+	char* p;
+
+	snprintf(name,size,"%s-%s",prefix,self->node.name?self->node.name:"");
+	for(p=name+strlen(prefix)+1;*p;p++) {
+		if(!isalnum((unsigned char)*p) && *p!='-' && *p!='_' && *p!='.')
+			*p = '_';
+	}
+	return name;
+}
+
+smcp_status_t
+smcp_ge_system_node_export_shm(ge_system_node_t self, const char* name) {
+	char default_name[GE_SHM_NAME_LENGTH];
+	int i;
+
+	if(!name)
+		name = ge_shm_name_for_node(self,GE_SHM_DEFAULT_NAME,default_name,sizeof(default_name));
+
+	ge_shm_close(&self->shm);
+
+	if(0!=ge_shm_create(&self->shm,name)) {
+		log_msg(LOG_LEVEL_ERROR,"Unable to export state to \"%s\"",name);
+		return SMCP_STATUS_FAILURE;
+	}
+
+	// Everything we know about so far needs to go out.
+	for(i=0;i<GE_RS232_MAX_ZONES;i++) {
+		if(self->zone[i].node.node.parent)
+			self->snapshot_dirty_zones[i/32] |= 1u<<(i%32);
+	}
+	for(i=0;i<GE_RS232_MAX_PARTITIONS;i++) {
+		if(self->partition[i].node.node.parent)
+			self->snapshot_dirty_partitions |= 1u<<i;
+	}
+	ge_snapshot_publish(self);
+
+	log_msg(LOG_LEVEL_NOTICE,"Exporting state to \"%s\"",name);
+
+	return SMCP_STATUS_OK;
+}
+
+bool
+ge_zone_snapshot(struct ge_system_node_s *node,int zonei,struct ge_zone_snapshot_s* snapshot) {
+	if(!zonei || zonei>GE_RS232_MAX_ZONES)
+		return false;
+
+	ge_seqlock_read(&node->zone[zonei-1].snapshot_lock,snapshot,&node->zone[zonei-1].snapshot,sizeof(*snapshot));
+
+	return snapshot->zone_number!=0;
+}
+
+bool
+ge_partition_snapshot(struct ge_system_node_s *node,int partitioni,struct ge_partition_snapshot_s* snapshot) {
+	if(!partitioni || partitioni>GE_RS232_MAX_PARTITIONS)
+		return false;
+
+	ge_seqlock_read(&node->partition[partitioni-1].snapshot_lock,snapshot,&node->partition[partitioni-1].snapshot,sizeof(*snapshot));
+
+	return snapshot->partition_number!=0;
+}
+
+#pragma mark - Events
+
+static void
+ge_event_emit(struct ge_system_node_s *self, struct ge_event_s* event) {
+	if(self->events.state)
+		ge_events_publish(&self->events,event);
+}
+
+smcp_status_t
+smcp_ge_system_node_export_events(ge_system_node_t self, const char* name) {
+	char default_name[GE_EVENTS_NAME_LENGTH];
+
+	if(!name)
+		name = ge_shm_name_for_node(self,GE_EVENTS_DEFAULT_NAME,default_name,sizeof(default_name));
+
+	ge_events_close(&self->events);
+
+	if(0!=ge_events_create(&self->events,name)) {
+		log_msg(LOG_LEVEL_ERROR,"Unable to export events to \"%s\"",name);
+		return SMCP_STATUS_FAILURE;
+	}
+
+	log_msg(LOG_LEVEL_NOTICE,"Exporting events to \"%s\"",name);
+
+	return SMCP_STATUS_OK;
+}
+
+#pragma mark - Hooks
+
+static void
+ge_hook_finished(void* context, uint8_t hook, int status, uint32_t run_us) {
+	struct ge_system_node_s *self = context;
+	const char* path = self->hooks.hook[hook].path;
+
+	if(status<0) {
+		log_msg(LOG_LEVEL_ERROR,"Unable to run \"%s\"",path);
+	} else if(WIFSIGNALED(status)) {
+		log_msg(LOG_LEVEL_ERROR,"\"%s\" killed by signal %d after %dms",path,WTERMSIG(status),run_us/1000);
+	} else if(WEXITSTATUS(status)) {
+		log_msg(LOG_LEVEL_WARNING,"\"%s\" exited with %d after %dms",path,WEXITSTATUS(status),run_us/1000);
+	} else {
+		log_msg(LOG_LEVEL_DEBUG,"\"%s\" finished after %dms",path,run_us/1000);
+	}
+}
+
+smcp_status_t
+smcp_ge_system_node_set_alarm_hook(ge_system_node_t self, const char* path, int32_t timeout_ms) {
+	if(0!=ge_hook_configure(&self->hooks,GE_HOOK_ALARM,path,timeout_ms))
+		return SMCP_STATUS_INVALID_ARGUMENT;
+	return SMCP_STATUS_OK;
+}
+
+#pragma mark - Observer notifications
+
+static void
+ge_zone_did_change(struct ge_zone_s* zone, uint8_t path) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)zone->node.node.parent;
+	int zonei = zone->zone_number-1;
+
+	ge_zone_field_changed(zone,path);
+	zone->notify_dirty |= (1u<<path);
+	self->notify.zone_dirty[zonei/32] |= (1u<<(zonei%32));
+	self->notify.pending = true;
+	self->notify.held = false;
+}
+
+static void
+ge_partition_did_change(struct ge_partition_s* partition, uint8_t path) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)partition->node.node.parent;
+
+	ge_partition_field_changed(partition,path);
+	partition->notify_dirty |= (1u<<path);
+	self->notify.partition_dirty |= (1u<<(partition->partition_number-1));
+	self->notify.pending = true;
+	self->notify.held = false;
+}
+
+static void
+ge_notify_path(smcp_variable_node_t node, uint8_t path, bool with_value) {
+	char suffix[SMCP_VARIABLE_MAX_VALUE_LENGTH+3] = "v=";
+
+	if(with_value && 0==node->func(node,SMCP_VAR_GET_VALUE,path,suffix+2)) {
+		smcp_variable_node_did_change(node,path,suffix);
 	} else {
-		ret = SMCP_STATUS_NOT_IMPLEMENTED;
+		smcp_variable_node_did_change(node,path,NULL);
+	}
+}
+
+static void
+ge_notify_flush(struct ge_system_node_s *self) {
+	uint32_t now = get_time_ms();
+	uint8_t partition_dirty = self->notify.partition_dirty;
+	int i;
+
+	self->notify.pending = false;
+	self->notify.held = false;
+	self->notify.partition_dirty = 0;
+	ge_timer_cancel(&self->notify_timer);
+
+	for(i=0;i<sizeof(self->notify.zone_dirty)/sizeof(*self->notify.zone_dirty);i++) {
+		uint32_t zones = self->notify.zone_dirty[i];
+		self->notify.zone_dirty[i] = 0;
+		while(zones) {
+			struct ge_zone_s* zone = &self->zone[i*32+__builtin_ctz(zones)];
+			uint32_t paths = zone->notify_dirty;
+			zones &= zones-1;
+			zone->notify_dirty = 0;
+			while(paths) {
+				uint8_t path = __builtin_ctz(paths);
+				paths &= paths-1;
+				ge_notify_path(&zone->node,path,!!(zone_vars[path].flags&GE_VAR_FLAG_VALUE_SUFFIX));
+			}
+		}
+	}
+
+	for(i=0;partition_dirty;i++,partition_dirty>>=1) {
+		struct ge_partition_s* partition = &self->partition[i];
+		uint32_t paths = partition->notify_dirty;
+		uint32_t held = 0;
+
+		if(!(partition_dirty&1))
+			continue;
+
+		while(paths) {
+			uint8_t path = __builtin_ctz(paths);
+			uint16_t min_interval = partition_vars[path].min_interval_ms;
+			paths &= paths-1;
+
+			if(min_interval && (int32_t)(now-partition->notify_last[path])<min_interval) {
+				uint32_t deadline = partition->notify_last[path]+min_interval;
+				if(!self->notify.held || (int32_t)(deadline-self->notify.deadline)<0)
+					self->notify.deadline = deadline;
+				self->notify.held = true;
+				held |= (1u<<path);
+				continue;
+			}
+
+			partition->notify_last[path] = now;
+			ge_notify_path(&partition->node,path,!!(partition_vars[path].flags&GE_VAR_FLAG_VALUE_SUFFIX));
+		}
+
+		partition->notify_dirty = held;
+		if(held) {
+			self->notify.partition_dirty |= (1u<<i);
+			self->notify.pending = true;
+		}
+	}
+
+	if(self->notify.held)
+		ge_timer_schedule(&self->timers,&self->notify_timer,self->notify.deadline);
+}
+
+static void
+ge_notify_held_expired(void* context, ge_timer_t timer) {
+	ge_notify_flush(context);
+}
+
+#pragma mark - Arm readiness
+
+#define GE_ZONE_STATUS_BLOCKING		(GE_RS232_ZONE_STATUS_TRIPPED|GE_RS232_ZONE_STATUS_FAULT|GE_RS232_ZONE_STATUS_TROUBLE)
+
+static void
+ge_partition_count_zone(struct ge_system_node_s* self, uint8_t partitioni, uint8_t status, int delta) {
+	struct ge_partition_s* partition = ge_get_partition(self,partitioni);
+
+	if(!partition
+		|| (status&GE_RS232_ZONE_STATUS_BYPASSED)
+		|| !(status&GE_ZONE_STATUS_BLOCKING)
+	) {
+		return;
+	}
+
+	if(status&GE_RS232_ZONE_STATUS_TRIPPED)
+		partition->open_count += delta;
+	if(status&GE_RS232_ZONE_STATUS_FAULT)
+		partition->fault_count += delta;
+	if(status&GE_RS232_ZONE_STATUS_TROUBLE)
+		partition->trouble_count += delta;
+
+	if(partition->ready_to_arm != !(partition->open_count|partition->fault_count|partition->trouble_count)) {
+		partition->ready_to_arm = !partition->ready_to_arm;
+		ge_partition_did_change(partition,PATH_READY_TO_ARM);
+	}
+	ge_partition_did_change(partition,PATH_BLOCKING_ZONES);
+}
+
+// Moves a zone's contribution to the arm readiness counts. Called
+// whenever a zone's partition or status changes, so the counts never
+// need to be recomputed from scratch.
+static void
+ge_partition_update_zone(
+	struct ge_system_node_s* self,
+	uint8_t old_partition,
+	uint8_t old_status,
+	uint8_t new_partition,
+	uint8_t new_status
+) {
+	const uint8_t mask = GE_ZONE_STATUS_BLOCKING|GE_RS232_ZONE_STATUS_BYPASSED;
+
+	if(old_partition==new_partition && (old_status&mask)==(new_status&mask))
+		return;
+
+	ge_partition_count_zone(self,old_partition,old_status,-1);
+	ge_partition_count_zone(self,new_partition,new_status,1);
+}
+
+static void
+ge_zone_set_location(struct ge_zone_s* zone, uint8_t partition, uint8_t area) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)zone->node.node.parent;
+	int zonei = zone->zone_number-1;
+
+	if(zone->partition != partition) {
+		if(zone->partition && zone->partition<=GE_RS232_MAX_PARTITIONS)
+			self->partition[zone->partition-1].zones[zonei/32] &= ~(1u<<(zonei%32));
+		if(partition && partition<=GE_RS232_MAX_PARTITIONS)
+			self->partition[partition-1].zones[zonei/32] |= (1u<<(zonei%32));
+		ge_partition_update_zone(self,zone->partition,zone->status,partition,zone->status);
+		zone->partition = partition;
+		ge_zone_field_changed(zone,PATH_PARTITION);
+	}
+	if(zone->area != area) {
+		zone->area = area;
+		ge_zone_field_changed(zone,PATH_AREA);
+	}
+}
+
+static void
+ge_zone_apply_status(struct ge_zone_s* zone, uint8_t status) {
+	static const struct {
+		uint8_t bit;
+		uint8_t path;
+	} status_paths[] = {
+		{ GE_RS232_ZONE_STATUS_TRIPPED, PATH_STATUS_TRIPPED },
+		{ GE_RS232_ZONE_STATUS_FAULT, PATH_STATUS_FAULT },
+		{ GE_RS232_ZONE_STATUS_ALARM, PATH_STATUS_ALARM },
+		{ GE_RS232_ZONE_STATUS_TROUBLE, PATH_STATUS_TROUBLE },
+		{ GE_RS232_ZONE_STATUS_BYPASSED, PATH_STATUS_BYPASS },
+	};
+	struct ge_system_node_s* self = (struct ge_system_node_s*)zone->node.node.parent;
+	uint8_t changed = zone->status^status;
+	int i;
+
+	ge_partition_update_zone(self,zone->partition,zone->status,zone->partition,status);
+	zone->status = status;
+	ge_zone_sets_update(self,zone->zone_number,status);
+	if(changed)
+		ge_rules_zone_changed(self,zone->zone_number,changed);
+
+	if((changed&status)&GE_RS232_ZONE_STATUS_TRIPPED) {
+		zone->last_tripped = time(NULL);
+		zone->trip_count++;
+		ge_zone_did_change(zone,PATH_LAST_TRIPPED);
+	}
+
+	for(i=0;i<sizeof(status_paths)/sizeof(*status_paths);i++) {
+		if(changed&status_paths[i].bit)
+			ge_zone_did_change(zone,status_paths[i].path);
+	}
+
+	if(changed) {
+		struct ge_event_s event = {
+			.type = GE_EVENT_ZONE_STATUS,
+			.partition = zone->partition,
+			.area = zone->area,
+			.zone = zone->zone_number,
+			.u.zone_status = { .status = status, .previous = status^changed },
+		};
+		ge_event_emit(self,&event);
+	}
+}
+
+static void
+ge_partition_apply_arming(struct ge_partition_s* partition, uint8_t arming_level, uint16_t armed_by) {
+	struct ge_system_node_s* self = (struct ge_system_node_s*)partition->node.node.parent;
+	struct ge_event_s event = {
+		.type = GE_EVENT_ARMING,
+		.partition = partition->partition_number,
+		.u.arming = { .level = arming_level, .user = armed_by },
+	};
+
+	if(partition->arming_level == arming_level && partition->armed_by == armed_by)
+		return;
+
+	ge_pending_confirm(self,GE_PENDING_ARM,partition->partition_number,arming_level);
+
+	partition->arming_level = arming_level;
+	partition->armed_by = armed_by;
+	partition->arm_date = time(NULL);
+	ge_rules_partition_changed(self,partition->partition_number);
+	ge_partition_did_change(partition,PATH_ARM_LEVEL);
+	ge_partition_did_change(partition,PATH_ARM_DATE);
+	ge_partition_did_change(partition,PATH_ARMED_BY);
+	ge_event_emit(self,&event);
+}
+
+static void
+ge_partition_apply_features(struct ge_partition_s* partition, uint8_t feature_state) {
+	uint8_t changed = partition->feature_state^feature_state;
+	int i;
+
+	partition->feature_state = feature_state;
+	ge_pending_confirm((struct ge_system_node_s*)partition->node.node.parent,GE_PENDING_FEATURES,partition->partition_number,feature_state);
+
+	for(i=0;i<=PATH_FS_QUICK_ARM-PATH_FS_CHIME;i++) {
+		if(changed&(1<<i))
+			ge_partition_did_change(partition,PATH_FS_CHIME+i);
+	}
+
+	if(changed) {
+		struct ge_event_s event = {
+			.type = GE_EVENT_FEATURES,
+			.partition = partition->partition_number,
+			.u.bits = { .state = feature_state, .previous = feature_state^changed },
+		};
+		ge_event_emit((struct ge_system_node_s*)partition->node.node.parent,&event);
+	}
+}
+
+static void
+ge_partition_apply_lights(struct ge_partition_s* partition, uint16_t light_state) {
+	uint16_t changed = partition->light_state^light_state;
+	int i;
+
+	partition->light_state = light_state;
+	ge_pending_confirm((struct ge_system_node_s*)partition->node.node.parent,GE_PENDING_LIGHTS,partition->partition_number,light_state);
+
+	for(i=0;i<=PATH_LIGHT_9-PATH_LIGHT_ALL;i++) {
+		if(changed&(1<<i))
+			ge_partition_did_change(partition,PATH_LIGHT_ALL+i);
 	}
 
-	return ret;
+	if(changed) {
+		struct ge_event_s event = {
+			.type = GE_EVENT_LIGHTS,
+			.partition = partition->partition_number,
+			.u.bits = { .state = light_state, .previous = light_state^changed },
+		};
+		ge_event_emit((struct ge_system_node_s*)partition->node.node.parent,&event);
+	}
 }
 
-struct ge_zone_s *
-ge_get_zone(struct ge_system_node_s *node,int zonei) {
-	struct ge_zone_s *zone = NULL;
-	if(zonei && (zonei<=GE_RS232_MAX_ZONES)) {
-		zone = &node->zone[zonei-1];
-		if(!zone->node.node.parent) {
-			// Bring this zone to life.
-			char* label = NULL;
-			asprintf(&label,"zone-%d",zonei);
-			smcp_variable_node_init(&zone->node,&node->node,label);
-			zone->node.func = (smcp_variable_node_func)&zone_node_var_func;
-			zone->zone_number = zonei;
-		}
-	}
-	return zone;
+#pragma mark - Dynamic data refresh bursts
+
+// Pushes the end of the burst out to `delay` from now, but never past
+// GE_REFRESH_MAX_MS from its start.
+static void
+ge_refresh_extend(struct ge_system_node_s *self, uint32_t delay) {
+	uint32_t deadline = get_time_ms()+delay;
+	uint32_t limit = self->refresh.started+GE_REFRESH_MAX_MS;
+
+	if((int32_t)(deadline-limit)>0)
+		deadline = limit;
+	ge_timer_schedule(&self->timers,&self->refresh_timer,deadline);
 }
 
-struct ge_partition_s *
-ge_get_partition(struct ge_system_node_s *node,int partitioni) {
-	struct ge_partition_s *partition = NULL;
-	if(partitioni && (partitioni<=GE_RS232_MAX_PARTITIONS)) {
-		partition = &node->partition[partitioni-1];
-		if(!partition->node.node.parent) {
-			// Bring this partition to life.
-			char* label = NULL;
-			asprintf(&label,"p-%d",partitioni);
-			smcp_variable_node_init(&partition->node,&node->node,label);
-			partition->node.func = (smcp_variable_node_func)&partition_node_var_func;
-			partition->partition_number = partitioni;
-		}
+static void
+ge_refresh_begin(struct ge_system_node_s *self) {
+	if(!self->refresh.active) {
+		memset(&self->refresh,0,sizeof(self->refresh));
+		self->refresh.active = true;
+		self->refresh.started = get_time_ms();
 	}
-	return partition;
+	ge_refresh_extend(self,GE_REFRESH_START_TIMEOUT_MS);
 }
 
-bool
-should_bypass_gate(void) {
-	struct tm* local;
-	time_t t;
+// Called for each message staged during a burst. `fresh` is false when
+// the message updates something already staged in this burst: that's a
+// live change rather than part of the refresh. The caller applies it
+// right away, and it doesn't keep the burst open.
+static void
+ge_refresh_touch(struct ge_system_node_s *self, bool fresh) {
+	if(!fresh)
+		return;
+	self->refresh.message_count++;
+	ge_refresh_extend(self,GE_REFRESH_QUIET_MS);
+}
 
-	time(&t);
+static bool
+ge_refresh_zone_is_staged(struct ge_system_node_s *self, int zonei) {
+	return !!(self->refresh.zone_staged[(zonei-1)/32]&(1u<<((zonei-1)%32)));
+}
 
-	local = localtime(&t);
+static void
+ge_zone_set_status(struct ge_system_node_s *self, struct ge_zone_s* zone, uint8_t status) {
+	int zonei = zone->zone_number;
+
+	if(self->refresh.active) {
+		bool fresh = !ge_refresh_zone_is_staged(self,zonei);
+		self->refresh.zone_staged[(zonei-1)/32] |= (1u<<((zonei-1)%32));
+		self->refresh.zone_status[zonei-1] = status;
+		ge_refresh_touch(self,fresh);
+		if(!fresh)
+			ge_zone_apply_status(zone,status);
+	} else {
+		ge_zone_apply_status(zone,status);
+	}
+}
 
-//	return 1;
-	return local->tm_wday==3
-		&& local->tm_hour>=7
-		&& local->tm_hour<=12+5;
+static uint8_t
+ge_zone_get_status(struct ge_system_node_s *self, struct ge_zone_s* zone) {
+	if(self->refresh.active && ge_refresh_zone_is_staged(self,zone->zone_number))
+		return self->refresh.zone_status[zone->zone_number-1];
+	return zone->status;
 }
 
-static time_t next_lawn_care_hack_check;
+static void
+ge_refresh_commit(struct ge_system_node_s *self) {
+	int zone_changes = 0;
+	int partition_changes = 0;
+	int i;
 
-void
-lawn_care_hack_check(struct ge_system_node_s *self) {
-	struct ge_partition_s* partition = ge_get_partition(self,1);
-	struct ge_zone_s* zone = ge_get_zone(self,18);
+	self->refresh.active = false;
+	ge_timer_cancel(&self->refresh_timer);
 
-	ge_rs232_status_t status = ge_rs232_ready_to_send(&self->interface);
-	if(status == GE_RS232_STATUS_WAIT) {
-		next_lawn_care_hack_check = time(NULL)+2;
-		return;
+	for(i=0;i<GE_RS232_MAX_ZONES;i++) {
+		struct ge_zone_s* zone = &self->zone[i];
+		if(!ge_refresh_zone_is_staged(self,i+1))
+			continue;
+		if(zone->status != self->refresh.zone_status[i]) {
+			ge_zone_apply_status(zone,self->refresh.zone_status[i]);
+			zone_changes++;
+		}
 	}
-	static bool did_run;
-
-	if(!did_run && partition->arming_level==2 || partition->arming_level==3) {
-		bool gate_is_bypassed = !!(zone->status&GE_RS232_ZONE_STATUS_BYPASSED);
-		if(gate_is_bypassed^should_bypass_gate()) {
-			const char* code = self->system_code;
-			char bypass_command[40];
-			if(code[0]) {
-//				did_run = 1;
-				snprintf(bypass_command,sizeof(bypass_command),"#%s18",code);
-				//log_msg(LOG_LEVEL_ERROR,"LAWN HACK KEYPRESS: %s",bypass_command);
-				//zone->status|=GE_RS232_ZONE_STATUS_BYPASSED;
-				send_keypress(&self->qinterface,partition->partition_number,0,bypass_command,NULL,NULL);
-			}
+
+	for(i=0;i<GE_RS232_MAX_PARTITIONS;i++) {
+		struct ge_partition_s* partition = &self->partition[i];
+		uint8_t staged = self->refresh.partition[i].staged;
+
+		if((staged&GE_REFRESH_STAGED_ARMING)
+			&& (partition->arming_level!=self->refresh.partition[i].arming_level
+				|| partition->armed_by!=self->refresh.partition[i].armed_by)
+		) {
+			ge_partition_apply_arming(partition,self->refresh.partition[i].arming_level,self->refresh.partition[i].armed_by);
+			partition_changes++;
+		}
+		if((staged&GE_REFRESH_STAGED_FEATURES)
+			&& partition->feature_state!=self->refresh.partition[i].feature_state
+		) {
+			ge_partition_apply_features(partition,self->refresh.partition[i].feature_state);
+			partition_changes++;
+		}
+		if((staged&GE_REFRESH_STAGED_LIGHTS)
+			&& partition->light_state!=self->refresh.partition[i].light_state
+		) {
+			ge_partition_apply_lights(partition,self->refresh.partition[i].light_state);
+			partition_changes++;
 		}
-	} else if(partition->arming_level==1) {
-		did_run = 0;
 	}
 
-	next_lawn_care_hack_check = time(NULL)+60;
+	log_msg(LOG_LEVEL_NOTICE,
+		"[DYNAMIC_DATA_REFRESH] MSGS:%d ZONE-CHANGES:%d PARTITION-CHANGES:%d",
+		self->refresh.message_count,
+		zone_changes,
+		partition_changes
+	);
+}
+
+static void
+ge_refresh_expired(void* context, ge_timer_t timer) {
+	ge_refresh_commit(context);
 }
 
 ge_rs232_status_t
 received_message(struct ge_system_node_s *node, const uint8_t* data, uint8_t len,struct ge_rs232_s* interface) {
+	char text[GE_RS232_TEXT_MAX_LENGTH];
 
-	static uint8_t last_msg[GE_RS232_MAX_MESSAGE_SIZE];
-	static uint8_t last_msg_len;
+	node->stats.frames++;
 
 	if(data[0]==GE_RS232_PTA_SUBCMD && (
 		data[1]==GE_RS232_PTA_SUBCMD_SIREN_SYNC
@@ -798,15 +3817,16 @@ received_message(struct ge_system_node_s *node, const uint8_t* data, uint8_t len
 		//return GE_RS232_STATUS_OK;
 	}
 
-	if(last_msg_len == len && 0==memcmp(data,last_msg,len)) {
+	if(node->last_msg_len == len && 0==memcmp(data,node->last_msg,len)) {
 		return GE_RS232_STATUS_OK;
 	}
-	memcpy(last_msg,data,len);
-	last_msg_len = len;
+	memcpy(node->last_msg,data,len);
+	node->last_msg_len = len;
 
 	if(data[0]==GE_RS232_PTA_AUTOMATION_EVENT_LOST) {
 		log_msg(LOG_LEVEL_NOTICE,"[AUTOMATION_EVENT_LOST]");
 		ge_rs232_status_t status = dynamic_data_refresh(&node->qinterface,NULL,NULL);
+		ge_refresh_begin(node);
 		len=0;
 		return 0;
 	} else if(data[0]==GE_RS232_PTA_ZONE_STATUS) {
@@ -815,33 +3835,16 @@ received_message(struct ge_system_node_s *node, const uint8_t* data, uint8_t len
 		struct ge_zone_s* zone = ge_get_zone(node,zonei);
 
 		if(zone) {
-			if((zone->status^data[5])&GE_RS232_ZONE_STATUS_TRIPPED) {
-				if((data[5]&GE_RS232_ZONE_STATUS_TRIPPED)) {
-					zone->last_tripped = time(NULL);
-					smcp_variable_node_did_change(&zone->node,PATH_LAST_TRIPPED,NULL);
-				}
-
-				smcp_variable_node_did_change(&zone->node,PATH_STATUS_TRIPPED,(data[5]&GE_RS232_ZONE_STATUS_TRIPPED)?"v=1":"v=0");
-			}
-			if((zone->status^data[5])&GE_RS232_ZONE_STATUS_FAULT)
-				smcp_variable_node_did_change(&zone->node,PATH_STATUS_FAULT,(data[5]&GE_RS232_ZONE_STATUS_FAULT)?"v=1":"v=0");
-			if((zone->status^data[5])&GE_RS232_ZONE_STATUS_TROUBLE)
-				smcp_variable_node_did_change(&zone->node,PATH_STATUS_TROUBLE,(data[5]&GE_RS232_ZONE_STATUS_TROUBLE)?"v=1":"v=0");
-			if((zone->status^data[5])&GE_RS232_ZONE_STATUS_ALARM)
-				smcp_variable_node_did_change(&zone->node,PATH_STATUS_ALARM,(data[5]&GE_RS232_ZONE_STATUS_ALARM)?"v=1":"v=0");
-			if((zone->status^data[5])&GE_RS232_ZONE_STATUS_BYPASSED)
-				smcp_variable_node_did_change(&zone->node,PATH_STATUS_BYPASS,(data[5]&GE_RS232_ZONE_STATUS_BYPASSED)?"v=1":"v=0");
-			zone->partition = data[1];
-			zone->area = data[2];
-			zone->status = data[5];
-			log_msg(LOG_LEVEL_NOTICE,"[ZONE_STATUS] ZONE:%02d STATUS:%s%s%s%s%s TEXT:\"%s\"",
+			ge_zone_set_location(zone,data[1],data[2]);
+			ge_zone_set_status(node,zone,data[5]);
+			log_msg(node->refresh.active?LOG_LEVEL_DEBUG:LOG_LEVEL_NOTICE,"[ZONE_STATUS] ZONE:%02d STATUS:%s%s%s%s%s TEXT:\"%s\"",
 				zonei,
 				data[5]&GE_RS232_ZONE_STATUS_TRIPPED?"T":"-",
 				data[5]&GE_RS232_ZONE_STATUS_FAULT?"F":"-",
 				data[5]&GE_RS232_ZONE_STATUS_ALARM?"A":"-",
 				data[5]&GE_RS232_ZONE_STATUS_TROUBLE?"R":"-",
 				data[5]&GE_RS232_ZONE_STATUS_BYPASSED?"B":"-",
-				ge_text_to_ascii_one_line(zone->label,zone->label_len)
+				ge_text_to_ascii_one_line(text,sizeof(text),(const uint8_t*)zone->label,zone->label_len)
 			);
 		}
 
@@ -853,26 +3856,27 @@ received_message(struct ge_system_node_s *node, const uint8_t* data, uint8_t len
 
 		if(zone) {
 
-			//if((zone->status^data[7])&GE_RS232_ZONE_STATUS_TRIPPED)
-			//	smcp_variable_node_did_change(&zone->node,PATH_STATUS_TRIPPED,NULL);
-			if((zone->status^data[7])&GE_RS232_ZONE_STATUS_FAULT)
-				smcp_variable_node_did_change(&zone->node,PATH_STATUS_FAULT,(data[7]&GE_RS232_ZONE_STATUS_FAULT)?"v=1":"v=0");
-			if((zone->status^data[7])&GE_RS232_ZONE_STATUS_TROUBLE)
-				smcp_variable_node_did_change(&zone->node,PATH_STATUS_TROUBLE,(data[7]&GE_RS232_ZONE_STATUS_TROUBLE)?"v=1":"v=0");
-			if((zone->status^data[7])&GE_RS232_ZONE_STATUS_ALARM)
-				smcp_variable_node_did_change(&zone->node,PATH_STATUS_ALARM,(data[7]&GE_RS232_ZONE_STATUS_ALARM)?"v=1":"v=0");
-			if((zone->status^data[7])&GE_RS232_ZONE_STATUS_BYPASSED)
-				smcp_variable_node_did_change(&zone->node,PATH_STATUS_BYPASS,(data[7]&GE_RS232_ZONE_STATUS_BYPASSED)?"v=1":"v=0");
-			zone->partition = data[1];
-			zone->area = data[2];
-			zone->group = data[3];
-			zone->zone_number = zonei;
-			zone->type = data[6];
-
-			zone->status = data[7];
-
-			zone->label_len = len-8;
-			memcpy(zone->label,data+8,len-8);
+			// Equipment list data doesn't carry the tripped bit.
+			ge_zone_set_status(
+				node,
+				zone,
+				(ge_zone_get_status(node,zone)&GE_RS232_ZONE_STATUS_TRIPPED)
+					| (data[7]&~GE_RS232_ZONE_STATUS_TRIPPED)
+			);
+			ge_zone_set_location(zone,data[1],data[2]);
+			if(zone->group != data[3]) {
+				zone->group = data[3];
+				ge_zone_field_changed(zone,PATH_GROUP);
+			}
+			if(zone->type != data[6]) {
+				zone->type = data[6];
+				ge_zone_field_changed(zone,PATH_TYPE);
+			}
+			if(zone->label_len != len-8 || 0!=memcmp(zone->label,data+8,len-8)) {
+				zone->label_len = len-8;
+				memcpy(zone->label,data+8,len-8);
+				ge_zone_field_changed(zone,PATH_TEXT);
+			}
 		}
 
 		log_msg(LOG_LEVEL_NOTICE,"[EQUIP_LIST_ZONE_INFO] ZONE:%d PN:%d AREA:%d TYPE:%d GROUP:%d STATUS:%s%s%s%s%s TEXT:\"%s\"",
@@ -886,7 +3890,7 @@ received_message(struct ge_system_node_s *node, const uint8_t* data, uint8_t len
 			data[7]&GE_RS232_ZONE_STATUS_ALARM?"A":"-",
 			data[7]&GE_RS232_ZONE_STATUS_TROUBLE?"R":"-",
 			data[7]&GE_RS232_ZONE_STATUS_BYPASSED?"B":"-",
-			ge_text_to_ascii_one_line(data+8,len-8)
+			ge_text_to_ascii_one_line(text,sizeof(text),data+8,len-8)
 
 		);
 		return 0;
@@ -917,10 +3921,14 @@ received_message(struct ge_system_node_s *node, const uint8_t* data, uint8_t len
 			if(strcmp(code,"0000")==0)
 				code[0] = 0;
 
+			// Bypass rules may have been waiting for it.
+			if(code==node->system_code)
+				node->rules.dirty |= node->rules.bypass_rules;
+
 #if DEBUG
 			log_msg(LOG_LEVEL_DEBUG,
 				"[EQUIP_LIST_USER_DATA] USER:\"%s\"(%d) CODE=\"%s\"",
-				ge_user_to_cstr(NULL,user),
+				ge_user_to_cstr(text,user),
 				user,
 				code
 			);
@@ -974,6 +3982,7 @@ received_message(struct ge_system_node_s *node, const uint8_t* data, uint8_t len
 	} else if(data[0]==GE_RS232_PTA_CLEAR_AUTOMATION_DYNAMIC_IMAGE) {
 		log_msg(LOG_LEVEL_NOTICE,"[CLEAR_AUTOMATION_DYNAMIC_IMAGE]");
 		ge_rs232_status_t status = dynamic_data_refresh(&node->qinterface,NULL,NULL);
+		ge_refresh_begin(node);
 		return 0;
 
 	} else if(data[0]==GE_RS232_PTA_PANEL_TYPE) {
@@ -982,28 +3991,24 @@ received_message(struct ge_system_node_s *node, const uint8_t* data, uint8_t len
 		);
 		return 0;
 	} else if(data[0]==GE_RS232_PTA_SUBCMD) {
-		char *str = NULL;
 		switch(data[1]) {
 			case GE_RS232_PTA_SUBCMD_LEVEL:
 				{
 				int partitioni = data[2];
 				struct ge_partition_s* partition = ge_get_partition(node,partitioni);
-				if(partition) {
-					char arm_level_changed[] = { 'v','=','0'+data[6],0 };
-					partition->arming_level = data[6];
-					partition->armed_by = (data[4]<<8)+(data[5]);
-					partition->arm_date = time(NULL);
-					smcp_variable_node_did_change(&partition->node,PATH_ARM_LEVEL,arm_level_changed);
-					smcp_variable_node_did_change(&partition->node,PATH_ARM_DATE,NULL);
-					smcp_variable_node_did_change(&partition->node,PATH_ARMED_BY,NULL);
-					if(partition->arming_level == 1) {
-						lawn_care_hack_check(node);
-					} else {
-						next_lawn_care_hack_check = time(NULL)+60;
-					}
+				if(partition && node->refresh.active) {
+					bool fresh = !(node->refresh.partition[partitioni-1].staged&GE_REFRESH_STAGED_ARMING);
+					node->refresh.partition[partitioni-1].staged |= GE_REFRESH_STAGED_ARMING;
+					node->refresh.partition[partitioni-1].arming_level = data[6];
+					node->refresh.partition[partitioni-1].armed_by = (data[4]<<8)+(data[5]);
+					ge_refresh_touch(node,fresh);
+					if(!fresh)
+						ge_partition_apply_arming(partition,data[6],(data[4]<<8)+(data[5]));
+				} else if(partition) {
+					ge_partition_apply_arming(partition,data[6],(data[4]<<8)+(data[5]));
 				}
 				}
-				log_msg(LOG_LEVEL_NOTICE,
+				log_msg(node->refresh.active?LOG_LEVEL_DEBUG:LOG_LEVEL_NOTICE,
 					"[ARMING_LEVEL] PN:%d AREA:%d USER:%d LEVEL:%d",
 					data[2],
 					data[3],
@@ -1025,19 +4030,41 @@ received_message(struct ge_system_node_s *node, const uint8_t* data, uint8_t len
 					data[9],
 					(data[10]<<8)+data[11]
 				);
+				{
+				struct ge_event_s event = {
+					.type = GE_EVENT_ALARM,
+					.partition = data[2],
+					.area = data[3],
+					.zone = data[5]?0:(data[6]<<8)+data[7],
+					.u.alarm = {
+						.source_type = data[4],
+						.general_type = data[8],
+						.specific_type = data[9],
+						.unit_id = (data[5]<<16)+(data[6]<<8)+data[7],
+						.event_data = (data[10]<<8)+data[11],
+					},
+				};
+				ge_event_emit(node,&event);
+				}
 				switch(data[8]) {
 					case 1: // General Alarm
 					case 2: // Alarm Canceled
-						asprintf(&str,"/home/pi/bin/report-alarm %d %d %d",data[8],data[9],data[7]);
+						{
+						char args[3][8];
+						const char* const argv[] = { args[0], args[1], args[2] };
+						snprintf(args[0],sizeof(args[0]),"%d",data[8]);
+						snprintf(args[1],sizeof(args[1]),"%d",data[9]);
+						snprintf(args[2],sizeof(args[2]),"%d",data[7]);
+						if(ge_hook_is_configured(&node->hooks,GE_HOOK_ALARM)
+							&& 0!=ge_hook_run(&node->hooks,GE_HOOK_ALARM,3,argv)
+						) {
+							log_msg(LOG_LEVEL_ERROR,"Too many hooks queued, dropped alarm report");
+						}
+						}
 						break;
 					case 15: // System Trouble
 					default: break;
 				}
-				if(str) {
-					fprintf(stderr," ");
-					system(str);
-					free(str);
-				}
 				return 0;
 				break;
 			case GE_RS232_PTA_SUBCMD_ENTRY_EXIT_DELAY:
@@ -1060,7 +4087,6 @@ received_message(struct ge_system_node_s *node, const uint8_t* data, uint8_t len
 						partition->entry_delay_active = new_value;
 					}
 				}
-				lawn_care_hack_check(node);
 				return 0;
 				break;
 			case GE_RS232_PTA_SUBCMD_SIREN_SETUP:
@@ -1099,18 +4125,26 @@ received_message(struct ge_system_node_s *node, const uint8_t* data, uint8_t len
 				int partitioni = data[2];
 				struct ge_partition_s* partition = ge_get_partition(node,partitioni);
 				if(partition) {
-					smcp_variable_node_did_change(&partition->node,PATH_TOUCHPAD_TEXT,NULL);
-
 					if(len-5!=partition->touchpad_lcd_len
 						|| 0!=memcmp(data+5,partition->touchpad_lcd,len-5)
 					) {
+						ge_partition_did_change(partition,PATH_TOUCHPAD_TEXT);
 						log_msg((data[2]==1)?LOG_LEVEL_INFO:LOG_LEVEL_DEBUG,
 							"[TOUCHPAD_DISPLAY] PN:%d AREA:%d MT:%d MSG:\"%s\"",
 							data[2],
 							data[3],
 							data[4],
-							ge_text_to_ascii_one_line(data+5,len-5)
+							ge_text_to_ascii_one_line(text,sizeof(text),data+5,len-5)
 						);
+						if(node->events.state) {
+							struct ge_event_s event = {
+								.type = GE_EVENT_TOUCHPAD,
+								.partition = data[2],
+								.area = data[3],
+							};
+							ge_text_to_ascii_one_line(event.u.touchpad.text,sizeof(event.u.touchpad.text),data+5,len-5);
+							ge_event_emit(node,&event);
+						}
 					}
 
 					partition->touchpad_lcd_len = len-5;
@@ -1131,20 +4165,15 @@ received_message(struct ge_system_node_s *node, const uint8_t* data, uint8_t len
 				{
 				int partitioni = data[2];
 				struct ge_partition_s* partition = ge_get_partition(node,partitioni);
-				if(partition) {
-					if((partition->feature_state^data[4])&(1<<0))
-						smcp_variable_node_did_change(&partition->node,PATH_FS_CHIME,(data[4]&(1<<0))?"v=1":"v=0");
-					if((partition->feature_state^data[4])&(1<<1))
-						smcp_variable_node_did_change(&partition->node,PATH_FS_ENERGY_SAVER,(data[4]&(1<<1))?"v=1":"v=0");
-					if((partition->feature_state^data[4])&(1<<2))
-						smcp_variable_node_did_change(&partition->node,PATH_FS_NO_DELAY,(data[4]&(1<<2))?"v=1":"v=0");
-					if((partition->feature_state^data[4])&(1<<3))
-						smcp_variable_node_did_change(&partition->node,PATH_FS_LATCHKEY,(data[4]&(1<<3))?"v=1":"v=0");
-					if((partition->feature_state^data[4])&(1<<4))
-						smcp_variable_node_did_change(&partition->node,PATH_FS_SILENT_ARMING,(data[4]&(1<<4))?"v=1":"v=0");
-					if((partition->feature_state^data[4])&(1<<5))
-						smcp_variable_node_did_change(&partition->node,PATH_FS_QUICK_ARM,(data[4]&(1<<5))?"v=1":"v=0");
-					partition->feature_state = data[4];
+				if(partition && node->refresh.active) {
+					bool fresh = !(node->refresh.partition[partitioni-1].staged&GE_REFRESH_STAGED_FEATURES);
+					node->refresh.partition[partitioni-1].staged |= GE_REFRESH_STAGED_FEATURES;
+					node->refresh.partition[partitioni-1].feature_state = data[4];
+					ge_refresh_touch(node,fresh);
+					if(!fresh)
+						ge_partition_apply_features(partition,data[4]);
+				} else if(partition) {
+					ge_partition_apply_features(partition,data[4]);
 				}
 				log_msg(LOG_LEVEL_DEBUG,
 					"[FEATURE_STATE] PN:%d",
@@ -1179,7 +4208,7 @@ received_message(struct ge_system_node_s *node, const uint8_t* data, uint8_t len
 		char *str = NULL;
 		switch(data[1]) {
 			case GE_RS232_PTA_SUBCMD2_LIGHTS_STATE:
-				log_msg(LOG_LEVEL_INFO,
+				log_msg(node->refresh.active?LOG_LEVEL_DEBUG:LOG_LEVEL_INFO,
 					"[LIGHTS_STATE] PN:%d AREA:%d STATE:%d_%d%d%d%d%d%d%d%d",
 					data[2],
 					data[3],
@@ -1196,28 +4225,15 @@ received_message(struct ge_system_node_s *node, const uint8_t* data, uint8_t len
 				);
 				int partitioni = data[2];
 				struct ge_partition_s* partition = ge_get_partition(node,partitioni);
-				if(partition) {
-					if((partition->light_state^data[4])&(1<<0))
-						smcp_variable_node_did_change(&partition->node,PATH_LIGHT_ALL,(data[4]&(1<<0))?"v=1":"v=0");
-					if((partition->light_state^data[4])&(1<<1))
-						smcp_variable_node_did_change(&partition->node,PATH_LIGHT_1,(data[4]&(1<<1))?"v=1":"v=0");
-					if((partition->light_state^data[4])&(1<<2))
-						smcp_variable_node_did_change(&partition->node,PATH_LIGHT_2,(data[4]&(1<<2))?"v=1":"v=0");
-					if((partition->light_state^data[4])&(1<<3))
-						smcp_variable_node_did_change(&partition->node,PATH_LIGHT_3,(data[4]&(1<<3))?"v=1":"v=0");
-					if((partition->light_state^data[4])&(1<<4))
-						smcp_variable_node_did_change(&partition->node,PATH_LIGHT_4,(data[4]&(1<<4))?"v=1":"v=0");
-					if((partition->light_state^data[4])&(1<<5))
-						smcp_variable_node_did_change(&partition->node,PATH_LIGHT_5,(data[4]&(1<<5))?"v=1":"v=0");
-					if((partition->light_state^data[4])&(1<<6))
-						smcp_variable_node_did_change(&partition->node,PATH_LIGHT_6,(data[4]&(1<<6))?"v=1":"v=0");
-					if((partition->light_state^data[4])&(1<<7))
-						smcp_variable_node_did_change(&partition->node,PATH_LIGHT_7,(data[4]&(1<<7))?"v=1":"v=0");
-					if(((partition->light_state>>8)^data[5])&(1<<0))
-						smcp_variable_node_did_change(&partition->node,PATH_LIGHT_8,(data[4]&(1<<8))?"v=1":"v=0");
-					if(((partition->light_state>>8)^data[5])&(1<<1))
-						smcp_variable_node_did_change(&partition->node,PATH_LIGHT_9,(data[4]&(1<<9))?"v=1":"v=0");
-					partition->light_state = data[4]+(data[5]<<8);
+				if(partition && node->refresh.active) {
+					bool fresh = !(node->refresh.partition[partitioni-1].staged&GE_REFRESH_STAGED_LIGHTS);
+					node->refresh.partition[partitioni-1].staged |= GE_REFRESH_STAGED_LIGHTS;
+					node->refresh.partition[partitioni-1].light_state = data[4]+(data[5]<<8);
+					ge_refresh_touch(node,fresh);
+					if(!fresh)
+						ge_partition_apply_lights(partition,data[4]+(data[5]<<8));
+				} else if(partition) {
+					ge_partition_apply_lights(partition,data[4]+(data[5]<<8));
 				}
 				len=0;
 				break;
@@ -1282,8 +4298,15 @@ ge_system_request_handler(
 
 
 
+static void ge_serial_thread_stop(ge_system_node_t self);
+
 void
 ge_system_node_dealloc(ge_system_node_t x) {
+	ge_serial_thread_stop(x);
+	ge_shm_close(&x->shm);
+	ge_events_close(&x->events);
+	ge_hook_runner_finalize(&x->hooks);
+	ge_state_doc_free(x->state_doc);
 	free(x);
 }
 
@@ -1334,12 +4357,316 @@ reset_serial(ge_system_node_t self, const char* device) {
 	return 0;
 }
 
+static smcp_status_t
+reopen_serial(ge_system_node_t self) {
+	smcp_status_t status = SMCP_STATUS_FAILURE;
+	int i;
+
+	for(i=0;i<self->serial_device_count && SMCP_STATUS_OK!=status;i++)
+		status = reset_serial(self,self->serial_device[i]);
+
+	return status;
+}
+
+static void
+ge_serial_check_timeout(ge_system_node_t self) {
+	if(
+		ge_rs232_ready_to_send(&self->interface)==GE_RS232_STATUS_TIMEOUT
+	) {
+		if(self->interface.output_attempt_count<3) {
+			ge_rs232_resend_last_message(&self->interface);
+		} else if(self->interface.got_response) {
+			self->interface.got_response(self->interface.response_context,&self->interface,false);
+		}
+	}
+}
+
+// Keeps the ACK timer in step with the interface. The serial thread
+// watches its own timeouts, so this only applies without it.
+static void
+ge_serial_arm_timeout(ge_system_node_t self) {
+	int32_t remaining;
+
+	// The interface belongs to the serial thread while it runs.
+	if(ge_serial_is_threaded(self)) {
+		ge_timer_cancel(&self->ack_timer);
+		return;
+	}
+
+	remaining = ge_rs232_get_timeout(&self->interface);
+	if(remaining<0) {
+		ge_timer_cancel(&self->ack_timer);
+	} else {
+		ge_timer_schedule(&self->timers,&self->ack_timer,get_time_ms()+remaining);
+	}
+}
+
+static void
+ge_serial_ack_expired(void* context, ge_timer_t timer) {
+	ge_system_node_t self = context;
+
+	ge_serial_check_timeout(self);
+	ge_serial_arm_timeout(self);
+}
+
+#pragma mark - Serial thread
+
+#if GE_QUEUE_THREADS
+static void
+ge_serial_thread_signal(int fd) {
+	uint64_t one = 1;
+
+	// Only fails if the counter is about to overflow, in which case the
+	// other side has plenty of wakeups pending already.
+	(void)write(fd,&one,sizeof(one));
+}
+
+static void
+ge_serial_thread_wakeup(void* context) {
+	ge_system_node_t self = context;
+	ge_serial_thread_signal(self->serial_thread.wakeup_fd);
+}
+
+// Runs on the serial thread.
+static void
+ge_serial_thread_post(
+	struct ge_executor_s* executor,
+	void (*finished)(void* context,ge_rs232_status_t status),
+	void* context,
+	ge_rs232_status_t status
+) {
+	struct ge_serial_thread_s* thread = (struct ge_serial_thread_s*)executor;
+	struct ge_completion_s completion = { finished, context, status };
+
+	if(!ge_spsc_ring_push(&thread->completions,&completion)) {
+		// The ring is sized for every message the queue and its inbox can
+		// hold, so this means the SMCP thread has stopped draining it.
+		thread->completions_dropped++;
+		log_msg(LOG_LEVEL_ERROR,"Completion ring full, dropped result %d",status);
+		return;
+	}
+
+	ge_serial_thread_signal(thread->event_fd);
+}
+
+// Runs on the serial thread, after the frame has been ACKed.
+static ge_rs232_status_t
+ge_serial_thread_received_message(ge_system_node_t self, const uint8_t* data, uint8_t len,struct ge_rs232_s* interface) {
+	struct ge_frame_s frame;
+
+	frame.len = len;
+	memcpy(frame.data,data,len);
+
+	if(!ge_spsc_ring_push(&self->serial_thread.frames,&frame)) {
+		atomic_fetch_add_explicit(&self->serial_thread.frames_dropped,1,memory_order_relaxed);
+		if(!atomic_exchange(&self->serial_thread.frames_lost,true))
+			log_msg(LOG_LEVEL_ERROR,"Frame ring full, dropping panel messages");
+		ge_serial_thread_signal(self->serial_thread.event_fd);
+		return GE_RS232_STATUS_QUEUE_FULL;
+	}
+
+	ge_serial_thread_signal(self->serial_thread.event_fd);
+
+	return GE_RS232_STATUS_OK;
+}
+
+static void*
+ge_serial_thread_main(void* context) {
+	ge_system_node_t self = context;
+	struct ge_serial_thread_s* thread = &self->serial_thread;
+	uint8_t buffer[64];
+
+	// Wait until the queue has been handed over to us.
+	pthread_mutex_lock(&thread->startup);
+	pthread_mutex_unlock(&thread->startup);
+
+	while(!atomic_load(&thread->stop)) {
+		struct pollfd polltable[] = {
+			{ fileno(self->serial_in), POLLIN, 0 },
+			{ thread->wakeup_fd, POLLIN, 0 },
+		};
+		struct ge_link_stats_s link;
+		ssize_t i, len;
+
+		// Publish what the last round did, before possibly sleeping.
+		ge_link_stats_collect(self,&link);
+		ge_seqlock_write(&thread->link_lock,&thread->link,&link,sizeof(link));
+
+		if(poll(polltable,2,ge_rs232_get_timeout(&self->interface))<0 && errno!=EINTR) {
+			log_msg(LOG_LEVEL_CRITICAL,"Serial thread poll failed: %s",strerror(errno));
+			break;
+		}
+
+		if(polltable[1].revents&POLLIN) {
+			uint64_t count;
+			(void)read(thread->wakeup_fd,&count,sizeof(count));
+		}
+
+		if(polltable[0].revents) {
+			len = read(fileno(self->serial_in),buffer,sizeof(buffer));
+
+			if(len==0 || (len<0 && errno!=EAGAIN && errno!=EINTR)) {
+				if(SMCP_STATUS_OK!=reopen_serial(self))
+					sleep(1);
+				continue;
+			}
+
+			for(i=0;i<len;i++)
+				ge_rs232_receive_byte(&self->interface,buffer[i]);
+		}
+
+		ge_queue_update(&self->qinterface);
+		ge_serial_check_timeout(self);
+	}
+
+	return NULL;
+}
+
+// Handles whatever the serial thread has passed back. Runs on the SMCP
+// thread.
+static void
+ge_serial_thread_drain(ge_system_node_t self) {
+	struct ge_serial_thread_s* thread = &self->serial_thread;
+	struct ge_frame_s frame;
+	struct ge_completion_s completion;
+	uint64_t count;
+
+	if(!thread->running)
+		return;
+
+	(void)read(thread->event_fd,&count,sizeof(count));
+
+	while(ge_spsc_ring_pop(&thread->frames,&frame))
+		received_message(self,frame.data,frame.len,&self->interface);
+
+	// Whatever was dropped is gone, so get the panel to send it all
+	// again, as for AUTOMATION_EVENT_LOST.
+	if(atomic_exchange(&thread->frames_lost,false)) {
+		log_msg(LOG_LEVEL_WARNING,"Panel messages were dropped (%u so far), refreshing",
+			atomic_load_explicit(&thread->frames_dropped,memory_order_relaxed)
+		);
+		dynamic_data_refresh(&self->qinterface,NULL,NULL);
+		ge_refresh_begin(self);
+	}
+
+	while(ge_spsc_ring_pop(&thread->completions,&completion))
+		(*completion.finished)(completion.context,completion.status);
+}
+
+smcp_status_t
+smcp_ge_system_node_start_serial_thread(ge_system_node_t self, int rt_priority) {
+	struct ge_serial_thread_s* thread = &self->serial_thread;
+	smcp_status_t ret = SMCP_STATUS_FAILURE;
+	pthread_attr_t attr;
+	int err;
+
+	if(thread->running)
+		return SMCP_STATUS_OK;
+
+	ge_spsc_ring_init(&thread->frames,thread->frame_storage,sizeof(struct ge_frame_s),GE_FRAME_RING_SIZE);
+	ge_spsc_ring_init(&thread->completions,thread->completion_storage,sizeof(struct ge_completion_s),GE_COMPLETION_RING_SIZE);
+	thread->executor.post = &ge_serial_thread_post;
+	atomic_init(&thread->stop,false);
+	atomic_init(&thread->frames_lost,false);
+	ge_seqlock_init(&thread->link_lock);
+	ge_link_stats_collect(self,&thread->link);
+
+	thread->wakeup_fd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	thread->event_fd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	require(thread->wakeup_fd>=0 && thread->event_fd>=0, bail);
+
+	pthread_mutex_init(&thread->startup,NULL);
+	pthread_mutex_lock(&thread->startup);
+
+	pthread_attr_init(&attr);
+	if(rt_priority>0) {
+		struct sched_param param = { .sched_priority = rt_priority };
+		pthread_attr_setinheritsched(&attr,PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr,SCHED_FIFO);
+		pthread_attr_setschedparam(&attr,&param);
+	}
+
+	err = pthread_create(&thread->thread,&attr,&ge_serial_thread_main,self);
+
+	if(err==EPERM && rt_priority>0) {
+		log_msg(LOG_LEVEL_WARNING,"Not permitted to use SCHED_FIFO, serial thread will run at normal priority");
+		pthread_attr_setinheritsched(&attr,PTHREAD_INHERIT_SCHED);
+		err = pthread_create(&thread->thread,&attr,&ge_serial_thread_main,self);
+	}
+
+	pthread_attr_destroy(&attr);
+
+	if(!err) {
+		self->interface.received_message = (void*)&ge_serial_thread_received_message;
+		ge_queue_set_owner(
+			&self->qinterface,
+			thread->thread,
+			&ge_serial_thread_wakeup,
+			self,
+			&thread->executor
+		);
+		thread->running = true;
+		ret = SMCP_STATUS_OK;
+	} else {
+		log_msg(LOG_LEVEL_ERROR,"Unable to start serial thread: %s",strerror(err));
+	}
+
+	pthread_mutex_unlock(&thread->startup);
+
+	if(!thread->running)
+		pthread_mutex_destroy(&thread->startup);
+
+bail:
+	if(!thread->running) {
+		if(thread->wakeup_fd>=0)
+			close(thread->wakeup_fd);
+		if(thread->event_fd>=0)
+			close(thread->event_fd);
+	}
+	return ret;
+}
+
+static void
+ge_serial_thread_stop(ge_system_node_t self) {
+	struct ge_serial_thread_s* thread = &self->serial_thread;
+
+	if(!thread->running)
+		return;
+
+	atomic_store(&thread->stop,true);
+	ge_serial_thread_signal(thread->wakeup_fd);
+	pthread_join(thread->thread,NULL);
+
+	close(thread->wakeup_fd);
+	close(thread->event_fd);
+	pthread_mutex_destroy(&thread->startup);
+	thread->running = false;
+}
+#else
+static void
+ge_serial_thread_stop(ge_system_node_t self) {
+}
+#endif
+
 ge_system_node_t
 smcp_ge_system_node_init(
 	ge_system_node_t self,
 	smcp_node_t parent,
 	const char* name
 ) {
+	return smcp_ge_system_node_init_with_devices(self,parent,name,NULL);
+}
+
+ge_system_node_t
+smcp_ge_system_node_init_with_devices(
+	ge_system_node_t self,
+	smcp_node_t parent,
+	const char* name,
+	const char* const* devices
+) {
+	static const char* const default_devices[] = { GE_SERIAL_DEFAULT_DEVICES, NULL };
+	int i;
+
 	require(self || (self = ge_system_node_alloc()), bail);
 
 	require(smcp_node_init(
@@ -1348,27 +4675,75 @@ smcp_ge_system_node_init(
 		name
 	), bail);
 
+	ge_timer_wheel_init(&self->timers,get_time_ms());
+	ge_timer_init(&self->ack_timer,&ge_serial_ack_expired,self);
+	ge_timer_init(&self->refresh_timer,&ge_refresh_expired,self);
+	ge_timer_init(&self->notify_timer,&ge_notify_held_expired,self);
+	ge_timer_init(&self->rules_timer,&ge_rules_boundary,self);
+	ge_timer_init(&self->rules_retry_timer,&ge_rules_retry_due,self);
+
+	ge_keypress_macro_init(self);
+
+	smcp_variable_node_init(&self->sys_node,&self->node,"sys");
+	self->sys_node.func = &system_node_var_func;
+	self->sys_node.node.request_handler = (void*)&system_request_handler;
+
+	smcp_node_init(&self->changes_node,&self->node,"changes");
+	self->changes_node.request_handler = (void*)&changes_request_handler;
+
+	smcp_node_init(&self->state_node,&self->node,"state");
+	self->state_node.request_handler = (void*)&state_request_handler;
+
+	smcp_node_init(&self->zones_node,&self->node,"zones");
+	self->zones_node.request_handler = (void*)&zones_request_handler;
+
+	for(i=0;i<GE_ZONE_SET_COUNT;i++) {
+		smcp_node_init(&self->zone_set_node[i],&self->zones_node,zone_set_names[i]);
+		self->zone_set_node[i].request_handler = (void*)&zone_set_request_handler;
+	}
+
 	ge_rs232_t interface = ge_rs232_init(&self->interface);
 	struct ge_queue_s *qinterface = ge_queue_init(&self->qinterface,interface);
 	interface->received_message = (void*)&received_message;
 	interface->send_byte = &send_byte;
 	interface->context = (void*)self;
+	self->serial_poll_ms = GE_SERIAL_POLL_MS;
 
-	if(SMCP_STATUS_OK!=reset_serial(self,"/dev/ttyUSB0")) {
-		if(SMCP_STATUS_OK!=reset_serial(self,"/dev/ttyUSB1")) {
-			smcp_node_delete(&self->node);
-			self = NULL;
-			sleep(1);
-			goto bail;
-		}
+	ge_hook_runner_init(&self->hooks);
+	self->hooks.finished = &ge_hook_finished;
+	self->hooks.context = (void*)self;
+	ge_hook_configure(&self->hooks,GE_HOOK_ALARM,GE_ALARM_HOOK_PATH,GE_HOOK_DEFAULT_TIMEOUT_MS);
+
+	ge_rules_load(self,GE_RULES_FILE);
+
+	if(!devices)
+		devices = default_devices;
+
+	for(self->serial_device_count=0;
+		self->serial_device_count<GE_SERIAL_MAX_DEVICES && devices[self->serial_device_count];
+		self->serial_device_count++
+	) {
+		snprintf(self->serial_device[self->serial_device_count],GE_SERIAL_DEVICE_LENGTH,"%s",devices[self->serial_device_count]);
+	}
+
+	if(SMCP_STATUS_OK!=reopen_serial(self)) {
+		smcp_node_delete(&self->node);
+		self = NULL;
+		sleep(1);
+		goto bail;
 	}
 
 	// Make sure we at least have the first partition set up.
 	ge_get_partition(self,1);
 
 	dynamic_data_refresh(qinterface,NULL,NULL);
+	ge_refresh_begin(self);
 	refresh_equipment_list(qinterface,NULL,NULL);
 
+#if GE_QUEUE_THREADS && GE_SERIAL_THREAD
+	smcp_ge_system_node_start_serial_thread(self,GE_SERIAL_THREAD_PRIORITY);
+#endif
+
 bail:
 	return self;
 }
@@ -1382,7 +4757,7 @@ smcp_ge_system_node_update_fdset(
     int *max_fd,
 	cms_t *timeout
 ) {
-	int fd = fileno(self->serial_in);
+	int fd = smcp_ge_system_node_get_fd(self);
 
 	//log_msg(LOG_LEVEL_CRITICAL,">>> Updated FDSET, fd=%d",fd);
 
@@ -1395,33 +4770,53 @@ smcp_ge_system_node_update_fdset(
 	if(exc_fd_set && fd >= 0)
 		FD_SET(fd,exc_fd_set);
 
-	if(timeout && *timeout/1000>(next_lawn_care_hack_check-time(NULL)))
-		*timeout = MAX(60,next_lawn_care_hack_check-time(NULL))*1000;
+	if(timeout) {
+		int32_t remaining;
+
+		ge_serial_arm_timeout(self);
+		remaining = ge_timer_wheel_next(&self->timers,get_time_ms());
+		if((self->rules.dirty && !self->refresh.active)
+			|| (self->notify.pending && !self->notify.held)
+		) {
+			remaining = 0;
+		}
+		if(remaining>=0 && *timeout>remaining)
+			*timeout = remaining;
+	}
+
+	{
+		int32_t remaining = INT32_MAX;
+		ge_hook_runner_update_fdset(&self->hooks,read_fd_set,max_fd,&remaining);
+		if(timeout && *timeout>remaining)
+			*timeout = remaining;
+	}
 
 	return 0;
 }
 
-smcp_status_t
-smcp_ge_system_node_process(ge_system_node_t self) {
+static smcp_status_t
+ge_serial_poll(ge_system_node_t self) {
 	smcp_status_t status = 0;
+	int poll_ms = self->serial_poll_ms;
+	int i;
 
 	struct pollfd polltable[] = {
 		{ fileno(self->serial_in), POLLIN | POLLHUP, 0 },
 	};
 
 	if(feof(self->serial_in) || ferror(self->serial_in)) {
-		status = reset_serial(self,"/dev/ttyUSB0");
-		if(SMCP_STATUS_OK!=status) {
-			status = reset_serial(self,"/dev/ttyUSB1");
-		}
+		status = reopen_serial(self);
 		if(SMCP_STATUS_OK!=status) {
 			goto bail;
 		}
+		polltable[0].fd = fileno(self->serial_in);
 	}
 
-	if(poll(polltable, 1, 10) > 0) {
-		ge_rs232_status_t status;
-		char byte = fgetc(self->serial_in);
+	for(i=0;i<GE_SERIAL_POLL_MAX_BYTES && poll(polltable, 1, poll_ms) > 0;i++) {
+		int byte = fgetc(self->serial_in);
+
+		if(byte==EOF)
+			break;
 
 		if(byte==GE_RS232_NAK) {
 			log_msg(LOG_LEVEL_WARNING,"GOT NAK");
@@ -1430,28 +4825,68 @@ smcp_ge_system_node_process(ge_system_node_t self) {
 		if(byte==GE_RS232_ACK) {
 			log_msg(LOG_LEVEL_DEBUG,"GOT ACK");
 		}
-		status = ge_rs232_receive_byte(&self->interface,byte);
+		ge_rs232_receive_byte(&self->interface,byte);
+
+		// Only wait for the first byte.
+		poll_ms = 0;
 	}
 
 	ge_queue_update(&self->qinterface);
 
-	if(
-		ge_rs232_ready_to_send(&self->interface)==GE_RS232_STATUS_TIMEOUT
-	) {
-		if(self->interface.output_attempt_count<3) {
-			ge_rs232_resend_last_message(&self->interface);
-		} else if(self->interface.got_response) {
-			self->interface.got_response(self->interface.response_context,&self->interface,false);
-		}
+	ge_serial_arm_timeout(self);
+
+bail:
+	return status;
+}
+
+smcp_status_t
+smcp_ge_system_node_process(ge_system_node_t self) {
+	smcp_status_t status = 0;
+	uint64_t started = get_time_us();
+	uint32_t elapsed;
+
+	if(!ge_serial_is_threaded(self)) {
+		status = ge_serial_poll(self);
+		if(SMCP_STATUS_OK!=status)
+			goto bail;
 	}
 
-	if(time(NULL)>next_lawn_care_hack_check)
-		lawn_care_hack_check(self);
+#if GE_QUEUE_THREADS
+	ge_serial_thread_drain(self);
+#endif
+
+	ge_timer_wheel_run(&self->timers,get_time_ms());
+
+	ge_hook_runner_process(&self->hooks);
+
+	// Held notifications are flushed by notify_timer.
+	if(self->notify.pending && !self->notify.held)
+		ge_notify_flush(self);
+
+	ge_rules_run(self);
 
 bail:
+	ge_snapshot_publish(self);
+
+	elapsed = (uint32_t)(get_time_us()-started);
+	self->stats.calls++;
+	self->stats.time_us += elapsed;
+	if(self->stats.max_us<elapsed)
+		self->stats.max_us = elapsed;
 	return status;
 }
 
+int
+smcp_ge_system_node_get_fd(ge_system_node_t self) {
+#if GE_QUEUE_THREADS
+	// The serial thread does its own waiting, we only need to hear
+	// about what it passes back.
+	if(self->serial_thread.running)
+		return self->serial_thread.event_fd;
+#endif
+	return fileno(self->serial_in);
+}
+
 
 
 #if 0
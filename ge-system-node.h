@@ -4,6 +4,11 @@
 
 #include <smcp/assert_macros.h>
 #include "ge-rs232.h"
+#include "ge-seqlock.h"
+#include "ge-shm.h"
+#include "ge-events.h"
+#include "ge-hook.h"
+#include "ge-timer.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -16,10 +21,217 @@
 //#include <stdlib.h>
 //#include <fcntl.h>
 
+#define LOG_LEVEL_EMERGENCY		(0)
+#define LOG_LEVEL_ALERT		(1)
+#define LOG_LEVEL_CRITICAL	(2)
+#define LOG_LEVEL_ERROR		(3)
+#define LOG_LEVEL_WARNING		(4)
+#define LOG_LEVEL_NOTICE		(5)
+#define LOG_LEVEL_INFO		(6)
+#define LOG_LEVEL_DEBUG		(7)
+
+extern int current_log_level;
+void log_msg(int level,const char* format, ...);
+
 #define GE_RS232_MAX_ZONES				(96)
 #define GE_RS232_MAX_PARTITIONS			(6)
 #define GE_RS232_MAX_SCHEDULES			(16)
 
+#define GE_ZONE_MAX_PATHS				(16)
+#define GE_PARTITION_MAX_PATHS			(32)
+
+#define GE_VALUE_CACHE_SLOT_LENGTH		(12)
+
+#define GE_ZONE_SET_WORDS				((GE_RS232_MAX_ZONES+31)/32)
+
+// How long smcp_ge_system_node_process() waits for serial input by
+// default, and the most bytes it reads in one call.
+#define GE_SERIAL_POLL_MS				(10)
+#define GE_SERIAL_POLL_MAX_BYTES		(256)
+
+// Serial devices to try, in order, when none are given to init.
+#define GE_SERIAL_MAX_DEVICES			(4)
+#define GE_SERIAL_DEVICE_LENGTH			(64)
+
+#ifndef GE_SERIAL_DEFAULT_DEVICES
+#define GE_SERIAL_DEFAULT_DEVICES		"/dev/ttyUSB0", "/dev/ttyUSB1"
+#endif
+
+// Run on general alarms and cancellations, with the general type,
+// specific type and zone as arguments.
+#ifndef GE_ALARM_HOOK_PATH
+#define GE_ALARM_HOOK_PATH				"/home/pi/bin/report-alarm"
+#endif
+
+enum {
+	GE_HOOK_ALARM,
+};
+
+#define GE_KEYPRESS_FRAME_MAX_KEYS		(GE_RS232_MAX_MESSAGE_SIZE-3)
+#define GE_KEYPRESS_MAX_MACROS			(32)
+#define GE_KEYPRESS_MACRO_NAME_LENGTH	(24)
+
+#ifndef GE_KEYPRESS_MACRO_FILE
+#define GE_KEYPRESS_MACRO_FILE			"/etc/ge-rs232/macros.conf"
+#endif
+
+// Macros the node itself relies on. These always occupy the first
+// slots, though their key sequences can be redefined.
+enum {
+	GE_MACRO_DISARM,
+	GE_MACRO_ARM_STAY,
+	GE_MACRO_ARM_AWAY,
+	GE_MACRO_CHIME_TOGGLE,
+
+	GE_MACRO_BUILTIN_COUNT
+};
+
+// A named keypress sequence, already encoded into key codes.
+struct ge_keypress_macro_s {
+	char name[GE_KEYPRESS_MACRO_NAME_LENGTH];
+	uint8_t len;
+	uint8_t codes[GE_KEYPRESS_FRAME_MAX_KEYS];
+};
+
+// Site-specific automations, one per line of GE_RULES_FILE:
+//
+//   <name> if <term> [and <term> ...] then <action>
+//
+// Terms, each of which may be preceded by "not":
+//   armed <partition>            Armed at any level (stay, away, night...).
+//   disarmed <partition>
+//   zone <zone> <status>         tripped, fault, alarm, trouble or bypassed.
+//   time <days> <HH:MM>-<HH:MM>  Days are "*" or a list like "mon,wed".
+//                                The window can't span midnight.
+//
+// Actions:
+//   bypass <zone>[,<zone>...]    Bypassed while the rule holds. Only
+//                                acted on in armed partitions, so pair
+//                                it with an "armed" term. Re-applied
+//                                whenever the zones' bypass, the arming
+//                                of any partition or the system code
+//                                changes.
+//   light <partition> <n>[,...]  On while the rule holds (0 is "all").
+//   macro <partition> <name>     Sent each time the rule starts to hold.
+//
+// For example:
+//
+//   lawn-gate if armed 1 and time wed 07:00-18:00 then bypass 18
+//
+// A rule is only re-evaluated when a zone or partition it reads changes,
+// or when one of its time windows opens or closes. An action the panel
+// didn't take is tried again after GE_RULE_RETRY_MS.
+#define GE_RULES_MAX					(16)
+#define GE_RULE_MAX_TERMS				(4)
+#define GE_RULE_NAME_LENGTH				(24)
+#define GE_RULE_RETRY_MS				(10000)
+
+#ifndef GE_RULES_FILE
+#define GE_RULES_FILE					"/etc/ge-rs232/rules.conf"
+#endif
+
+enum {
+	GE_RULE_TERM_ARMED,
+	GE_RULE_TERM_DISARMED,
+	GE_RULE_TERM_ZONE,
+	GE_RULE_TERM_TIME,
+};
+
+enum {
+	GE_RULE_ACTION_BYPASS,
+	GE_RULE_ACTION_LIGHT,
+	GE_RULE_ACTION_MACRO,
+};
+
+struct ge_rule_term_s {
+	uint8_t type;
+	bool negate;
+	uint8_t number;			// Partition or zone.
+	uint8_t status;			// GE_RS232_ZONE_STATUS_* bit, for zone terms.
+	uint8_t days;			// Bit 0 is Sunday, for time terms.
+	uint16_t start;			// Minutes past midnight, for time terms.
+	uint16_t end;
+};
+
+struct ge_rule_s {
+	char name[GE_RULE_NAME_LENGTH];
+	uint8_t term_count;
+	struct ge_rule_term_s term[GE_RULE_MAX_TERMS];
+
+	uint8_t action;
+	uint8_t partition;		// For lights and macros.
+	uint8_t macro;
+	uint16_t lights;
+	uint32_t zones[GE_ZONE_SET_WORDS];	// For bypass.
+
+	int8_t state;			// -1 until first evaluated.
+	time_t next_boundary;	// When a time window next opens or closes.
+};
+
+struct ge_rules_s {
+	struct ge_rule_s rule[GE_RULES_MAX];
+	uint8_t count;
+
+	// Which rules read each input, one bit per rule.
+	uint16_t partition_rules[GE_RS232_MAX_PARTITIONS];
+	uint16_t zone_rules[GE_RS232_MAX_ZONES];
+	uint16_t time_rules;
+
+	// Which rules bypass each zone, and every bypass rule.
+	uint16_t zone_bypass_rules[GE_RS232_MAX_ZONES];
+	uint16_t bypass_rules;
+
+	uint16_t dirty;
+	uint16_t acting;		// Action queued and not yet finished.
+	uint16_t failed;		// Action to try again.
+};
+
+// Formatted variable values, kept so that a GET is just a copy. Short
+// values live in fixed-size slots owned by the node; long text values
+// share one buffer, which holds whichever was formatted last. A value
+// stays valid until the underlying field changes.
+struct ge_value_cache_s {
+	uint32_t valid;
+	char (*slot)[GE_VALUE_CACHE_SLOT_LENGTH];
+	uint8_t text_path;
+	uint8_t text_len;
+	char text[SMCP_VARIABLE_MAX_VALUE_LENGTH+1];
+};
+
+// Copies of zone and partition state that other threads can read at any
+// time with ge_zone_snapshot() and ge_partition_snapshot(). They are
+// republished at the end of every smcp_ge_system_node_process() call
+// that changed them.
+struct ge_zone_snapshot_s {
+	uint32_t version;
+	uint16_t zone_number;
+	uint8_t partition;
+	uint8_t area;
+	uint8_t group;
+	uint8_t type;
+	uint8_t status;
+	uint8_t label_len;
+	time_t last_tripped;
+	uint32_t trip_count;
+	char label[16];
+};
+
+struct ge_partition_snapshot_s {
+	uint32_t version;
+	uint8_t partition_number;
+	uint8_t arming_level;
+	uint16_t armed_by;
+	time_t arm_date;
+	uint8_t feature_state;
+	uint16_t light_state;
+	bool ready_to_arm;
+	uint8_t open_count;
+	uint8_t fault_count;
+	uint8_t trouble_count;
+	uint8_t touchpad_lcd_len;
+	char touchpad_lcd[32];
+};
+
 struct ge_zone_s {
 	struct smcp_variable_node_s node;
 
@@ -35,6 +247,15 @@ struct ge_zone_s {
 
 	char label[16];
 	uint8_t label_len;
+
+	uint32_t version;
+	uint32_t notify_dirty;
+
+	struct ge_value_cache_s cache;
+	char cache_slot[GE_ZONE_MAX_PATHS][GE_VALUE_CACHE_SLOT_LENGTH];
+
+	struct ge_seqlock_s snapshot_lock;
+	struct ge_zone_snapshot_s snapshot;
 };
 
 struct ge_schedule_s {
@@ -85,21 +306,279 @@ struct ge_partition_s {
 
 	char touchpad_lcd[32];
 	uint8_t touchpad_lcd_len;
+
+	// Zones assigned to this partition, and how many of them are open,
+	// faulted or in trouble without being bypassed. Any of those will
+	// make the panel refuse to arm.
+	uint32_t zones[GE_ZONE_SET_WORDS];
+	uint8_t open_count;
+	uint8_t fault_count;
+	uint8_t trouble_count;
+	bool ready_to_arm;
+
+	uint32_t version;
+	uint32_t notify_dirty;
+	uint32_t notify_last[GE_PARTITION_MAX_PATHS];
+
+	struct ge_value_cache_s cache;
+	char cache_slot[GE_PARTITION_MAX_PATHS][GE_VALUE_CACHE_SLOT_LENGTH];
+
+	struct ge_seqlock_s snapshot_lock;
+	struct ge_partition_snapshot_s snapshot;
+};
+
+#define GE_REFRESH_STAGED_ARMING		(1<<0)
+#define GE_REFRESH_STAGED_FEATURES		(1<<1)
+#define GE_REFRESH_STAGED_LIGHTS		(1<<2)
+
+// Shadow copy of the dynamic state that the panel streams back after
+// a dynamic data refresh. Status messages received while a refresh
+// burst is in progress are staged here and diffed against the live
+// state once the burst goes quiet.
+struct ge_refresh_s {
+	bool active;
+	uint32_t started;
+	uint16_t message_count;
+
+	uint32_t zone_staged[(GE_RS232_MAX_ZONES+31)/32];
+	uint8_t zone_status[GE_RS232_MAX_ZONES];
+
+	struct {
+		uint8_t staged;
+		uint8_t arming_level;
+		uint16_t armed_by;
+		uint8_t feature_state;
+		uint16_t light_state;
+	} partition[GE_RS232_MAX_PARTITIONS];
+};
+
+// Pending observer notifications. Variable changes are collected as
+// dirty (node, path) bits while a frame is processed and then flushed
+// in one pass, so repeated changes to the same variable only notify once.
+struct ge_notify_s {
+	bool pending;
+	bool held;
+	uint32_t deadline;
+
+	uint32_t zone_dirty[(GE_RS232_MAX_ZONES+31)/32];
+	uint8_t partition_dirty;
+};
+
+#define GE_CHANGELOG_SIZE				(256)
+
+#define GE_ENTITY_ZONE					(1)
+#define GE_ENTITY_PARTITION				(2)
+
+struct ge_change_s {
+	uint32_t version;
+	uint8_t entity_type;
+	uint8_t entity;
+	uint8_t path;
+	bool has_value;
+	int32_t value;
+};
+
+// Bounded log of recent state changes, used to answer delta-sync
+// requests. Once an entry is overwritten, clients that haven't seen
+// its version have to do a full resync.
+struct ge_changelog_s {
+	struct ge_change_s entry[GE_CHANGELOG_SIZE];
+	uint16_t head;
+	uint16_t count;
+	uint32_t dropped_version;
+};
+
+enum {
+	GE_ZONE_SET_TRIPPED,
+	GE_ZONE_SET_FAULT,
+	GE_ZONE_SET_ALARM,
+	GE_ZONE_SET_TROUBLE,
+	GE_ZONE_SET_BYPASSED,
+
+	GE_ZONE_SET_COUNT
+};
+
+#define GE_SYSTEM_STATUS_UNCONFIRMED	(-32)
+
+#define GE_PENDING_MAX_COMMANDS			(8)
+#define GE_PENDING_CONFIRM_TIMEOUT_MS	(10000)
+#define GE_LATENCY_BUCKETS				(16)
+
+enum {
+	GE_PENDING_ARM,
+	GE_PENDING_FEATURES,
+	GE_PENDING_LIGHTS,
+
+	GE_PENDING_KIND_COUNT
+};
+
+// A command that has been sent to the panel, waiting for the panel to
+// report the state it was meant to bring about. The slot is reused once
+// the command is both resolved and ACKed (or NAKed) by the queue.
+struct ge_pending_s {
+	bool active;
+	bool acked;
+	bool resolved;
+	uint8_t kind;
+	uint8_t partition;
+	uint16_t mask;
+	uint16_t expected;
+	uint32_t start;
+	struct ge_timer_s timer;	// Confirmation timeout.
+	void (*finished)(void* context,ge_rs232_status_t status);
+	void* context;
+};
+
+#if GE_QUEUE_THREADS
+// Ring sizes for the serial thread. Both must be powers of two.
+#define GE_FRAME_RING_SIZE				(32)
+#define GE_COMPLETION_RING_SIZE			(64)
+
+#ifndef GE_SERIAL_THREAD
+#define GE_SERIAL_THREAD				(0)
+#endif
+
+// SCHED_FIFO priority for the serial thread started by init, or zero to
+// leave it at the default priority.
+#ifndef GE_SERIAL_THREAD_PRIORITY
+#define GE_SERIAL_THREAD_PRIORITY		(0)
+#endif
+
+// A frame the serial thread has ACKed, waiting to be handled.
+struct ge_frame_s {
+	uint8_t len;
+	uint8_t data[GE_RS232_MAX_MESSAGE_SIZE];
+};
+
+// Link statistics for the sys node. With the serial thread running they
+// belong to that thread, which publishes a copy under a seqlock.
+struct ge_link_stats_s {
+	uint8_t queue_depth;
+	uint8_t queue_max_depth;
+	uint32_t queue_rejected;
+	uint32_t queue_coalesced;
+	uint32_t srtt;
+	uint32_t rttvar;
+	uint32_t rto;
+	uint32_t retransmits;
+};
+
+// The result of a message queued from another thread.
+struct ge_completion_s {
+	void (*finished)(void* context,ge_rs232_status_t status);
+	void* context;
+	ge_rs232_status_t status;
+};
+
+// When running, the serial thread owns the interface and the queue, so
+// that the panel gets its ACKs no matter what the SMCP thread is busy
+// with. Frames and results come back to the SMCP thread through the
+// rings, with event_fd to wake it up. `executor` delivers results to the
+// SMCP thread, for use with ge_queue_submit().
+struct ge_serial_thread_s {
+	struct ge_executor_s executor;
+
+	bool running;
+	atomic_bool stop;
+	pthread_t thread;
+	pthread_mutex_t startup;
+
+	int wakeup_fd;	// Serial thread waits on this.
+	int event_fd;	// SMCP thread waits on this.
+
+	struct ge_spsc_ring_s frames;
+	struct ge_frame_s frame_storage[GE_FRAME_RING_SIZE];
+	struct ge_spsc_ring_s completions;
+	struct ge_completion_s completion_storage[GE_COMPLETION_RING_SIZE];
+
+	// Frames the panel sent (and we ACKed) that didn't fit in `frames`.
+	// The serial thread sets frames_lost on the first of a run, and the
+	// SMCP thread asks for a dynamic data refresh to catch up.
+	atomic_uint frames_dropped;
+	atomic_bool frames_lost;
+	uint32_t completions_dropped;
+
+	struct ge_seqlock_s link_lock;
+	struct ge_link_stats_s link;
+};
+#endif
+
+// How much work smcp_ge_system_node_process() has been doing. Times
+// include any wait for serial input (see serial_poll_ms).
+struct ge_process_stats_s {
+	uint32_t calls;
+	uint32_t frames;
+	uint64_t time_us;
+	uint32_t max_us;
+	uint32_t rule_evaluations;
+	uint32_t rules_fired;
 };
 
 struct ge_system_node_s {
 	struct smcp_node_s node;
+	struct smcp_variable_node_s sys_node;
+	struct smcp_node_s changes_node;
+	struct smcp_node_s state_node;
+	struct smcp_node_s zones_node;
+	struct smcp_node_s zone_set_node[GE_ZONE_SET_COUNT];
+
+	// Bumped on every change to zone or partition state. Each zone and
+	// partition records the value it had at the time of its last change.
+	uint32_t version;
 
 	struct ge_queue_s qinterface;
 	struct ge_rs232_s interface;
 
 	FILE* serial_in;
 	FILE* serial_out;
+	char serial_device[GE_SERIAL_MAX_DEVICES][GE_SERIAL_DEVICE_LENGTH];
+	uint8_t serial_device_count;
+
+	// How long process() may block waiting for serial input. Zero when
+	// something else is doing the waiting.
+	uint16_t serial_poll_ms;
+
+	struct ge_process_stats_s stats;
+
+	// Last message received, to skip duplicates.
+	uint8_t last_msg[GE_RS232_MAX_MESSAGE_SIZE];
+	uint8_t last_msg_len;
+
+
+#if GE_QUEUE_THREADS
+	struct ge_serial_thread_s serial_thread;
+#endif
 
 	struct ge_zone_s zone[GE_RS232_MAX_ZONES];
 	struct ge_partition_s partition[GE_RS232_MAX_PARTITIONS];
+
+	// One bit per zone for each of the zone status flags, mirroring
+	// zone[].status, so that set queries don't have to walk every zone.
+	uint32_t zone_sets[GE_ZONE_SET_COUNT][GE_ZONE_SET_WORDS];
+
+	// Shared-memory mirror of the snapshots, if exported.
+	struct ge_shm_s shm;
+
+	// Shared-memory stream of decoded events, if exported.
+	struct ge_events_s events;
+
+	// External programs run in response to panel events.
+	struct ge_hook_runner_s hooks;
+
+	struct ge_rules_s rules;
+
+	// Zones and partitions whose snapshots are out of date.
+	uint32_t snapshot_dirty_zones[GE_ZONE_SET_WORDS];
+	uint8_t snapshot_dirty_partitions;
 	struct ge_schedule_s schedules[GE_RS232_MAX_SCHEDULES];
 
+	struct ge_refresh_s refresh;
+	struct ge_notify_s notify;
+	struct ge_changelog_s changelog;
+
+	// Serialized state document cache, allocated on first request.
+	struct ge_state_doc_s* state_doc;
+
 	uint8_t zone_count;
 
 	uint8_t panel_type;
@@ -110,26 +589,103 @@ struct ge_system_node_s {
 	char installer_code[5];
 	char system_code[5];
 
+	struct ge_keypress_macro_s macro[GE_KEYPRESS_MAX_MACROS];
+	uint8_t macro_count;
+
+	struct ge_pending_s pending[GE_PENDING_MAX_COMMANDS];
+	uint32_t latency[GE_PENDING_KIND_COUNT][GE_LATENCY_BUCKETS];
+	uint32_t unconfirmed[GE_PENDING_KIND_COUNT];
+
+	// All of the node's deferred work: the ACK timeout, the end of a
+	// refresh burst, command confirmation timeouts, held notifications,
+	// rule time windows and rule retries.
+	struct ge_timer_wheel_s timers;
+	struct ge_timer_s ack_timer;
+	struct ge_timer_s refresh_timer;
+	struct ge_timer_s notify_timer;
+	struct ge_timer_s rules_timer;
+	struct ge_timer_s rules_retry_timer;
+
 	struct smcp_async_response_s async_response;
 };
 
+#define GE_KEYPRESS_BATCH_MAX_FRAMES	(4)
+
+// Several keypress sequences for one partition, packed into as few
+// KEYPRESS frames as will hold them.
+struct ge_keypress_batch_s {
+	uint8_t partition;
+	uint8_t area;
+	uint8_t frame_count;
+	uint8_t frame_len[GE_KEYPRESS_BATCH_MAX_FRAMES];
+	uint8_t frame[GE_KEYPRESS_BATCH_MAX_FRAMES][GE_RS232_MAX_MESSAGE_SIZE];
+};
+
+typedef struct ge_keypress_batch_s* ge_keypress_batch_t;
+
 typedef struct ge_system_node_s* ge_system_node_t;
 typedef struct ge_partition_s* ge_partition_t;
 typedef struct ge_zone_s* ge_zone_t;
 typedef struct ge_schedule_s* ge_schedule_t;
 
-const char* ge_text_to_ascii_one_line(const char* bytes, uint8_t len);
-const char* ge_text_to_ascii(const char* bytes, uint8_t len);
 struct ge_zone_s *ge_get_zone(struct ge_system_node_s *node,int zonei);
 
 struct ge_partition_s *ge_get_partition(struct ge_system_node_s *node,int partitioni);
 
+// Torn-free copies of zone and partition state, safe to take from any
+// thread without blocking the node. Return false for entities the panel
+// hasn't told us about yet.
+bool ge_zone_snapshot(struct ge_system_node_s *node,int zonei,struct ge_zone_snapshot_s* snapshot);
+bool ge_partition_snapshot(struct ge_system_node_s *node,int partitioni,struct ge_partition_snapshot_s* snapshot);
+
+int ge_keypress_encode(const char* keys, uint8_t* codes, uint8_t max_len);
+void ge_keypress_batch_init(ge_keypress_batch_t batch, uint8_t partition, uint8_t area);
+int ge_keypress_batch_add_codes(ge_keypress_batch_t batch, const uint8_t* codes, uint8_t len);
+int ge_keypress_batch_add(ge_keypress_batch_t batch, const char* keys);
+ge_rs232_status_t ge_keypress_batch_send(ge_queue_t qinterface, ge_keypress_batch_t batch,
+	void (*finished)(void* context,ge_rs232_status_t status),
+	void* context
+);
+
+int ge_keypress_macro_define(struct ge_system_node_s* self, const char* name, const char* keys);
+int ge_keypress_macro_load(struct ge_system_node_s* self, const char* path);
+int ge_rule_define(struct ge_system_node_s* self, const char* name, const char* text);
+int ge_rules_load(struct ge_system_node_s* self, const char* path);
+ge_rs232_status_t ge_keypress_macro_send(struct ge_system_node_s* self, uint8_t partition, const struct ge_keypress_macro_s* macro,
+	void (*finished)(void* context,ge_rs232_status_t status),
+	void* context
+);
+
+struct ge_pending_s* ge_pending_expect(
+	struct ge_system_node_s* self,
+	uint8_t kind,
+	uint8_t partition,
+	uint16_t mask,
+	uint16_t expected,
+	void (**finished)(void* context,ge_rs232_status_t status),
+	void** context
+);
+void ge_pending_cancel(struct ge_pending_s* pending);
+
+int ge_partition_set_lights(ge_keypress_batch_t batch, struct ge_partition_s* partition, uint16_t mask, bool on);
+int ge_partition_bypass_zones(ge_keypress_batch_t batch, struct ge_partition_s* partition, const uint32_t* zones, bool bypass);
+int ge_partition_bypass_open_group(ge_keypress_batch_t batch, struct ge_partition_s* partition, uint8_t group);
+
 extern ge_system_node_t smcp_ge_system_node_init(
 	ge_system_node_t self,
 	smcp_node_t parent,
 	const char* name
 );
 
+// Like smcp_ge_system_node_init(), but with a NULL-terminated list of
+// serial devices to try instead of GE_SERIAL_DEFAULT_DEVICES.
+extern ge_system_node_t smcp_ge_system_node_init_with_devices(
+	ge_system_node_t self,
+	smcp_node_t parent,
+	const char* name,
+	const char* const* devices
+);
+
 extern smcp_status_t smcp_ge_system_node_update_fdset(
 	ge_system_node_t node,
     fd_set *read_fd_set,
@@ -141,6 +697,35 @@ extern smcp_status_t smcp_ge_system_node_update_fdset(
 
 extern smcp_status_t smcp_ge_system_node_process(ge_system_node_t node);
 
+// The descriptor to wait on for input: the serial port, or the serial
+// thread's event descriptor when it is running. It can change after
+// the serial port is reopened.
+extern int smcp_ge_system_node_get_fd(ge_system_node_t node);
+
+// Mirrors zone and partition state into the POSIX shared-memory segment
+// `name`, for local readers using ge-shm.h. If NULL, the name is
+// GE_SHM_DEFAULT_NAME followed by "-" and the node's name, e.g.
+// "/ge-rs232-security".
+extern smcp_status_t smcp_ge_system_node_export_shm(ge_system_node_t node, const char* name);
+
+// Writes decoded events (zone transitions, alarms, arming changes and so
+// on) into the shared-memory ring `name`, for local subscribers using
+// ge-events.h. If NULL, the name is GE_EVENTS_DEFAULT_NAME followed by
+// "-" and the node's name.
+extern smcp_status_t smcp_ge_system_node_export_events(ge_system_node_t node, const char* name);
+
+// Sets the program run on general alarms and cancellations, killed if
+// it takes longer than `timeout_ms` (GE_HOOK_DEFAULT_TIMEOUT_MS if zero).
+// A NULL path disables it.
+extern smcp_status_t smcp_ge_system_node_set_alarm_hook(ge_system_node_t node, const char* path, int32_t timeout_ms);
+
+#if GE_QUEUE_THREADS
+// Moves serial I/O onto its own thread, at SCHED_FIFO `rt_priority` if
+// that is greater than zero. Call from the thread that calls
+// smcp_ge_system_node_process().
+extern smcp_status_t smcp_ge_system_node_start_serial_thread(ge_system_node_t node, int rt_priority);
+#endif
+
 
 
 #endif
@@ -0,0 +1,211 @@
+#include "ge-timer.h"
+#include <string.h>
+
+#define GE_TIMER_SLOT_MASK			(GE_TIMER_SLOTS-1)
+
+// Stands in for the level of timers on the expired list.
+#define GE_TIMER_EXPIRED			(GE_TIMER_LEVELS)
+
+static inline unsigned
+ge_timer_shift(int level) {
+	return level*GE_TIMER_SLOT_BITS;
+}
+
+ge_timer_wheel_t
+ge_timer_wheel_init(ge_timer_wheel_t wheel, uint32_t now) {
+	memset(wheel,0,sizeof(*wheel));
+	wheel->now = now;
+	return wheel;
+}
+
+void
+ge_timer_init(ge_timer_t timer, ge_timer_func_t func, void* context) {
+	memset(timer,0,sizeof(*timer));
+	timer->func = func;
+	timer->context = context;
+}
+
+static void
+ge_timer_insert(ge_timer_wheel_t wheel, ge_timer_t timer) {
+	uint32_t delta = timer->expires-wheel->now;
+	uint32_t when = timer->expires;
+	int level = 0;
+	ge_timer_t* list;
+
+	if((int32_t)delta<0) {
+		delta = 0;
+		when = wheel->now;
+	} else if(delta>GE_TIMER_MAX_DELAY) {
+		// Park it in the furthest slot; it gets placed properly once
+		// that slot cascades.
+		delta = GE_TIMER_MAX_DELAY;
+		when = wheel->now+GE_TIMER_MAX_DELAY;
+	}
+
+	while(delta>>ge_timer_shift(level+1))
+		level++;
+
+	timer->level = level;
+	timer->slot = (when>>ge_timer_shift(level))&GE_TIMER_SLOT_MASK;
+
+	list = &wheel->slot[level][timer->slot];
+	if(*list) {
+		ll_prepend((void**)list,timer);
+	} else {
+		timer->item.next = timer->item.prev = NULL;
+		*list = timer;
+	}
+	wheel->occupied[level] |= 1ull<<timer->slot;
+}
+
+static void
+ge_timer_unlink(ge_timer_wheel_t wheel, ge_timer_t timer) {
+	ge_timer_t* list;
+
+	if(timer->level==GE_TIMER_EXPIRED) {
+		ll_remove((void**)&wheel->expired,timer);
+		return;
+	}
+
+	list = &wheel->slot[timer->level][timer->slot];
+	ll_remove((void**)list,timer);
+	if(!*list)
+		wheel->occupied[timer->level] &= ~(1ull<<timer->slot);
+}
+
+void
+ge_timer_schedule(ge_timer_wheel_t wheel, ge_timer_t timer, uint32_t expires) {
+	ge_timer_cancel(timer);
+
+	timer->expires = expires;
+	timer->wheel = wheel;
+	wheel->count++;
+	ge_timer_insert(wheel,timer);
+}
+
+void
+ge_timer_cancel(ge_timer_t timer) {
+	if(!timer->wheel)
+		return;
+
+	ge_timer_unlink(timer->wheel,timer);
+	timer->wheel->count--;
+	timer->wheel = NULL;
+}
+
+// The first occupied slot at or after `from`, going round the level.
+static inline int
+ge_timer_next_slot(uint64_t occupied, unsigned from) {
+	uint64_t rotated = (occupied>>from)|(from?occupied<<(GE_TIMER_SLOTS-from):0);
+
+	return (__builtin_ctzll(rotated)+from)&GE_TIMER_SLOT_MASK;
+}
+
+// The first tick at or after wheel->now on which something happens: a
+// level 0 slot fires, or an upper slot cascades.
+static bool
+ge_timer_next_tick(ge_timer_wheel_t wheel, uint32_t* tick) {
+	uint32_t now = wheel->now;
+	bool ret = false;
+	int level;
+
+	for(level=0;level<GE_TIMER_LEVELS;level++) {
+		unsigned shift = ge_timer_shift(level);
+		unsigned current = (now>>shift)&GE_TIMER_SLOT_MASK;
+		uint32_t offset;
+		uint32_t when;
+
+		if(!wheel->occupied[level])
+			continue;
+
+		if(level==0) {
+			offset = (ge_timer_next_slot(wheel->occupied[0],current)-current)&GE_TIMER_SLOT_MASK;
+			when = now+offset;
+		} else if(!(now&((1u<<shift)-1))) {
+			// Right on a boundary of this level, whose slot hasn't
+			// cascaded yet.
+			offset = (ge_timer_next_slot(wheel->occupied[level],current)-current)&GE_TIMER_SLOT_MASK;
+			when = ((now>>shift)+offset)<<shift;
+		} else {
+			// The current slot already cascaded, so anything in it now
+			// belongs to its next time round.
+			offset = ((ge_timer_next_slot(wheel->occupied[level],(current+1)&GE_TIMER_SLOT_MASK)-current-1)&GE_TIMER_SLOT_MASK)+1;
+			when = ((now>>shift)+offset)<<shift;
+		}
+
+		if(!ret || (int32_t)(when-*tick)<0)
+			*tick = when;
+		ret = true;
+	}
+
+	return ret;
+}
+
+int32_t
+ge_timer_wheel_next(ge_timer_wheel_t wheel, uint32_t now) {
+	uint32_t tick;
+	int32_t ret;
+
+	if(!ge_timer_next_tick(wheel,&tick))
+		return -1;
+
+	ret = (int32_t)(tick-now);
+	return (ret>0)?ret:0;
+}
+
+static void
+ge_timer_cascade(ge_timer_wheel_t wheel, int level, unsigned slot) {
+	ge_timer_t list = wheel->slot[level][slot];
+
+	wheel->slot[level][slot] = NULL;
+	wheel->occupied[level] &= ~(1ull<<slot);
+
+	while(list) {
+		ge_timer_t timer = list;
+		list = (ge_timer_t)timer->item.next;
+		ge_timer_insert(wheel,timer);
+	}
+}
+
+void
+ge_timer_wheel_run(ge_timer_wheel_t wheel, uint32_t now) {
+	ge_timer_t timer;
+	uint32_t tick;
+
+	while((int32_t)(now-wheel->now)>=0) {
+		uint32_t current = wheel->now;
+		unsigned slot = current&GE_TIMER_SLOT_MASK;
+		int level;
+
+		for(level=GE_TIMER_LEVELS-1;level>0;level--) {
+			unsigned shift = ge_timer_shift(level);
+			if(!(current&((1u<<shift)-1)))
+				ge_timer_cascade(wheel,level,(current>>shift)&GE_TIMER_SLOT_MASK);
+		}
+
+		// Everything in the slot is due. Move it aside first, so that
+		// callbacks scheduling into this slot again (for a full turn
+		// later) don't get run now. Anything scheduled for now or
+		// earlier lands on the next tick.
+		wheel->expired = wheel->slot[0][slot];
+		wheel->slot[0][slot] = NULL;
+		wheel->occupied[0] &= ~(1ull<<slot);
+		for(timer=wheel->expired;timer;timer=(ge_timer_t)timer->item.next)
+			timer->level = GE_TIMER_EXPIRED;
+
+		wheel->now = current+1;
+
+		while((timer = wheel->expired)) {
+			ge_timer_cancel(timer);
+			(*timer->func)(timer->context,timer);
+		}
+
+		// Skip straight over ticks where nothing happens.
+		if(!ge_timer_next_tick(wheel,&tick) || (int32_t)(tick-now)>0) {
+			if((int32_t)(now+1-wheel->now)>0)
+				wheel->now = now+1;
+			break;
+		}
+		wheel->now = tick;
+	}
+}
@@ -0,0 +1,79 @@
+
+#ifndef __GE_TIMER_H__
+#define __GE_TIMER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "ll.h"
+
+// Hierarchical timer wheel with one-millisecond ticks. Each level has
+// GE_TIMER_SLOTS slots, and each slot covers GE_TIMER_SLOTS times as
+// much time as a slot on the level below, so GE_TIMER_LEVELS levels
+// cover GE_TIMER_SLOTS^GE_TIMER_LEVELS ms (about twelve days). Anything
+// further out waits on the top level until it comes into range.
+//
+// Timers are intrusive and live in whatever struct owns them, so the
+// wheel never allocates. Scheduling and cancelling are O(1). Finding the
+// next deadline is O(GE_TIMER_LEVELS), using a bitmap of occupied slots
+// on each level. Timers on the upper levels are moved down a level
+// ("cascaded") when their slot comes round, which can make the next
+// deadline a little earlier than the next timer that actually fires.
+//
+// Times are uint32_t milliseconds from a monotonic clock, compared
+// modulo 2^32.
+
+#define GE_TIMER_LEVELS				(5)
+#define GE_TIMER_SLOT_BITS			(6)
+#define GE_TIMER_SLOTS				(1<<GE_TIMER_SLOT_BITS)
+#define GE_TIMER_MAX_DELAY			((1u<<(GE_TIMER_SLOT_BITS*GE_TIMER_LEVELS))-1)
+
+struct ge_timer_s;
+struct ge_timer_wheel_s;
+typedef struct ge_timer_s* ge_timer_t;
+typedef struct ge_timer_wheel_s* ge_timer_wheel_t;
+
+typedef void (*ge_timer_func_t)(void* context, ge_timer_t timer);
+
+struct ge_timer_s {
+	struct ll_item_s item;			// Must be first.
+	struct ge_timer_wheel_s* wheel;	// Non-NULL while scheduled.
+	uint32_t expires;
+	uint8_t level;
+	uint8_t slot;
+	ge_timer_func_t func;
+	void* context;
+};
+
+struct ge_timer_wheel_s {
+	uint32_t now;					// The next tick not yet run.
+	uint32_t count;
+	uint64_t occupied[GE_TIMER_LEVELS];
+	ge_timer_t slot[GE_TIMER_LEVELS][GE_TIMER_SLOTS];
+	ge_timer_t expired;				// Due, and waiting for their callbacks.
+};
+
+extern ge_timer_wheel_t ge_timer_wheel_init(ge_timer_wheel_t wheel, uint32_t now);
+
+extern void ge_timer_init(ge_timer_t timer, ge_timer_func_t func, void* context);
+
+// (Re)schedules `timer` to fire at `expires`. A time already passed
+// fires on the next ge_timer_wheel_run().
+extern void ge_timer_schedule(ge_timer_wheel_t wheel, ge_timer_t timer, uint32_t expires);
+
+extern void ge_timer_cancel(ge_timer_t timer);
+
+static inline bool
+ge_timer_is_scheduled(const struct ge_timer_s* timer) {
+	return timer->wheel!=NULL;
+}
+
+// Milliseconds from `now` until the wheel next needs to run, or -1 if
+// nothing is scheduled.
+extern int32_t ge_timer_wheel_next(ge_timer_wheel_t wheel, uint32_t now);
+
+// Fires every timer due at or before `now`. Timers may schedule or
+// cancel any timer, themselves included, from their callbacks.
+extern void ge_timer_wheel_run(ge_timer_wheel_t wheel, uint32_t now);
+
+#endif
@@ -72,12 +72,15 @@ void log_msg(int level,const char* format, ...) {
 typedef struct interface_context_s {
 	struct ge_rs232_s interface;
 	struct ge_queue_s queue;
+
+	// Last message received, to skip duplicates.
+	uint8_t last_msg[GE_RS232_MAX_MESSAGE_SIZE];
+	uint8_t last_msg_len;
 } *interface_context_t;
 
 ge_rs232_status_t
 received_message(interface_context_t context, const uint8_t* data, uint8_t len,struct ge_rs232_s* instance) {
-	static uint8_t last_msg[GE_RS232_MAX_MESSAGE_SIZE];
-	static uint8_t last_msg_len;
+	char text[GE_RS232_TEXT_MAX_LENGTH];
 
 	if(data[0]==GE_RS232_PTA_SUBCMD && (
 		data[1]==GE_RS232_PTA_SUBCMD_SIREN_SYNC
@@ -94,12 +97,12 @@ received_message(interface_context_t context, const uint8_t* data, uint8_t len,s
 		//return GE_RS232_STATUS_OK;
 	}
 
-	if(last_msg_len == len && 0==memcmp(data,last_msg,len)) {
+	if(context->last_msg_len == len && 0==memcmp(data,context->last_msg,len)) {
 		// Skip duplicates.
 		return GE_RS232_STATUS_OK;
 	}
-	memcpy(last_msg,data,len);
-	last_msg_len = len;
+	memcpy(context->last_msg,data,len);
+	context->last_msg_len = len;
 
 	if(data[0]==GE_RS232_PTA_AUTOMATION_EVENT_LOST) {
 		log_msg(LOG_LEVEL_NOTICE,"[AUTOMATION_EVENT_LOST]");
@@ -144,7 +147,7 @@ received_message(interface_context_t context, const uint8_t* data, uint8_t len,s
 			data[7]&GE_RS232_ZONE_STATUS_ALARM?"A":"-",
 			data[7]&GE_RS232_ZONE_STATUS_TROUBLE?"R":"-",
 			data[7]&GE_RS232_ZONE_STATUS_BYPASSED?"B":"-",
-			ge_text_to_ascii_one_line(data+8,len-8)
+			ge_text_to_ascii_one_line(text,sizeof(text),data+8,len-8)
 		);
 		return 0;
 	} else if(data[0]==GE_RS232_PTA_EQUIP_LIST_SUPERBUS_DEV_DATA) {
@@ -210,7 +213,7 @@ received_message(interface_context_t context, const uint8_t* data, uint8_t len,s
 					"[ARMING_LEVEL] PN:%d AREA:%d USER:%s LEVEL:%d",
 					data[2],
 					data[3],
-					ge_user_to_cstr(NULL,(data[4]<<8)+data[5]),
+					ge_user_to_cstr(text,(data[4]<<8)+data[5]),
 					data[6]
 				);
 				return 0;
@@ -290,7 +293,7 @@ received_message(interface_context_t context, const uint8_t* data, uint8_t len,s
 					data[2],
 					data[3],
 					data[4],
-					ge_text_to_ascii_one_line(data+5,len-5)
+					ge_text_to_ascii_one_line(text,sizeof(text),data+5,len-5)
 				);
 				return 0;
 				break;
@@ -407,14 +410,14 @@ received_message(interface_context_t context, const uint8_t* data, uint8_t len,s
 #if DEBUG
 			log_msg(LOG_LEVEL_DEBUG,
 				"[EQUIP_LIST_USER_DATA] USER:\"%s\"(%d) CODE=\"%s\"",
-				ge_user_to_cstr(NULL,user),
+				ge_user_to_cstr(text,user),
 				user,
 				code
 			);
 #else
 			log_msg(LOG_LEVEL_INFO,
 				"[EQUIP_LIST_USER_DATA] USER:\"%s\"(%d) CODE=\"????\"",
-				ge_user_to_cstr(NULL,user),
+				ge_user_to_cstr(text,user),
 				user
 			);
 #endif